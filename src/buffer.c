@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include "lsdbus.h"
+
+/*
+ * lsdbus.buffer: a contiguous C array of a fixed size D-Bus basic
+ * type. Buffers are accepted by msg_fromlua for arrays of the same
+ * type and returned by msg_tolua with LSDBUS_MSG_BUFFER.
+ */
+
+static const char buffer_types[] = {
+	SD_BUS_TYPE_BYTE,
+	SD_BUS_TYPE_INT16,
+	SD_BUS_TYPE_UINT16,
+	SD_BUS_TYPE_INT32,
+	SD_BUS_TYPE_UINT32,
+	SD_BUS_TYPE_INT64,
+	SD_BUS_TYPE_UINT64,
+	SD_BUS_TYPE_DOUBLE,
+	'\0'
+};
+
+int buffer_type_is_valid(char type)
+{
+	return type != '\0' && strchr(buffer_types, type) != NULL;
+}
+
+/**
+ * push a new zero initialized buffer of len elements of type [-0, +1, m]
+ */
+struct lsdbus_buffer *lsdbus_buffer_push(lua_State *L, char type, size_t len)
+{
+	struct lsdbus_buffer *buf;
+	size_t size = bus_type_trivial_size(type);
+
+	assert(buffer_type_is_valid(type));
+
+	if (len > (SIZE_MAX - sizeof(struct lsdbus_buffer)) / size)
+		luaL_error(L, "buffer too large");
+
+	buf = lua_newuserdata(L, sizeof(struct lsdbus_buffer) + len * size);
+	buf->len = len;
+	buf->type = type;
+	buf->size = size;
+	memset(buf->data, 0, len * size);
+
+	luaL_setmetatable(L, BUFFER_MT);
+	return buf;
+}
+
+/* push the element i (0 based) */
+static void buffer_pushelem(lua_State *L, const struct lsdbus_buffer *buf, size_t i)
+{
+	const void *p = buf->data;
+
+	switch (buf->type) {
+	case SD_BUS_TYPE_BYTE:   lua_pushinteger(L, ((const uint8_t*) p)[i]); break;
+	case SD_BUS_TYPE_INT16:  lua_pushinteger(L, ((const int16_t*) p)[i]); break;
+	case SD_BUS_TYPE_UINT16: lua_pushinteger(L, ((const uint16_t*) p)[i]); break;
+	case SD_BUS_TYPE_INT32:  lua_pushinteger(L, ((const int32_t*) p)[i]); break;
+	case SD_BUS_TYPE_UINT32: lua_pushinteger(L, ((const uint32_t*) p)[i]); break;
+	case SD_BUS_TYPE_INT64:  lua_pushinteger(L, ((const int64_t*) p)[i]); break;
+	case SD_BUS_TYPE_UINT64: lua_pushinteger(L, ((const uint64_t*) p)[i]); break;
+	case SD_BUS_TYPE_DOUBLE: lua_pushnumber(L, ((const double*) p)[i]); break;
+	}
+}
+
+/* set the element i (0 based) to the value at idx */
+void buffer_setelem(lua_State *L, struct lsdbus_buffer *buf, size_t i, int idx)
+{
+	void *p = buf->data;
+
+	if (buf->type == SD_BUS_TYPE_DOUBLE) {
+		((double*) p)[i] = luaL_checknumber(L, idx);
+		return;
+	}
+
+	lua_Integer x = luaL_checkinteger(L, idx);
+
+	switch (buf->type) {
+	case SD_BUS_TYPE_BYTE:   ((uint8_t*) p)[i] = x; break;
+	case SD_BUS_TYPE_INT16:  ((int16_t*) p)[i] = x; break;
+	case SD_BUS_TYPE_UINT16: ((uint16_t*) p)[i] = x; break;
+	case SD_BUS_TYPE_INT32:  ((int32_t*) p)[i] = x; break;
+	case SD_BUS_TYPE_UINT32: ((uint32_t*) p)[i] = x; break;
+	case SD_BUS_TYPE_INT64:  ((int64_t*) p)[i] = x; break;
+	case SD_BUS_TYPE_UINT64: ((uint64_t*) p)[i] = x; break;
+	}
+}
+
+/**
+ * lsdbus.buffer(type, n|table)
+ *
+ * create a new buffer of the given type with either n zeroed
+ * elements or with the elements of the array table.
+ */
+int lsdbus_buffer_new(lua_State *L)
+{
+	size_t len;
+	struct lsdbus_buffer *buf;
+	const char *type = luaL_checkstring(L, 1);
+
+	if (type[1] != '\0' || !buffer_type_is_valid(type[0]))
+		luaL_error(L, "invalid buffer type %s", type);
+
+	if (lua_type(L, 2) == LUA_TTABLE) {
+		len = lua_rawlen(L, 2);
+		buf = lsdbus_buffer_push(L, type[0], len);
+
+		for (size_t i=0; i<len; i++) {
+			lua_rawgeti(L, 2, i + 1);
+			buffer_setelem(L, buf, i, -1);
+			lua_pop(L, 1);
+		}
+		return 1;
+	}
+
+	lua_Integer n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n >= 0, 2, "negative size");
+	luaL_argcheck(L, (lua_Unsigned) n <= (SIZE_MAX - sizeof(struct lsdbus_buffer)) /
+		      bus_type_trivial_size(type[0]), 2, "size too large");
+	lsdbus_buffer_push(L, type[0], n);
+	return 1;
+}
+
+static int buffer_index(lua_State *L)
+{
+	lua_Integer i;
+	struct lsdbus_buffer *buf = luaL_checkudata(L, 1, BUFFER_MT);
+
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		i = lua_tointeger(L, 2);
+		if (i < 1 || (size_t) i > buf->len)
+			lua_pushnil(L);
+		else
+			buffer_pushelem(L, buf, i - 1);
+		return 1;
+	}
+
+	/* methods */
+	luaL_getmetatable(L, BUFFER_MT);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	return 1;
+}
+
+static int buffer_newindex(lua_State *L)
+{
+	struct lsdbus_buffer *buf = luaL_checkudata(L, 1, BUFFER_MT);
+	lua_Integer i = luaL_checkinteger(L, 2);
+
+	if (i < 1 || (size_t) i > buf->len)
+		luaL_error(L, "buffer index %d out of range [1..%d]", (int) i, (int) buf->len);
+
+	buffer_setelem(L, buf, i - 1, 3);
+	return 0;
+}
+
+static int buffer_len(lua_State *L)
+{
+	struct lsdbus_buffer *buf = luaL_checkudata(L, 1, BUFFER_MT);
+	lua_pushinteger(L, buf->len);
+	return 1;
+}
+
+static int buffer_tostring(lua_State *L)
+{
+	struct lsdbus_buffer *buf = luaL_checkudata(L, 1, BUFFER_MT);
+	lua_pushfstring(L, "buffer <%p> [%c:%d]", buf, buf->type, (int) buf->len);
+	return 1;
+}
+
+/* return the D-Bus type of the buffer */
+static int buffer_type(lua_State *L)
+{
+	struct lsdbus_buffer *buf = luaL_checkudata(L, 1, BUFFER_MT);
+	lua_pushlstring(L, &buf->type, 1);
+	return 1;
+}
+
+/* buf:sub(i, j): return a copy of the elements i to j, like string.sub */
+static int buffer_sub(lua_State *L)
+{
+	struct lsdbus_buffer *buf = luaL_checkudata(L, 1, BUFFER_MT);
+	struct lsdbus_buffer *res;
+	lua_Integer len = buf->len;
+	lua_Integer i = luaL_optinteger(L, 2, 1);
+	lua_Integer j = luaL_optinteger(L, 3, -1);
+
+	if (i < 0) i = len + i + 1;
+	if (j < 0) j = len + j + 1;
+	if (i < 1) i = 1;
+	if (j > len) j = len;
+
+	if (i > j) {
+		lsdbus_buffer_push(L, buf->type, 0);
+		return 1;
+	}
+
+	res = lsdbus_buffer_push(L, buf->type, j - i + 1);
+	memcpy(res->data, buf->data + (i - 1) * buf->size, res->len * buf->size);
+	return 1;
+}
+
+/* convert into a Lua table */
+static int buffer_totable(lua_State *L)
+{
+	struct lsdbus_buffer *buf = luaL_checkudata(L, 1, BUFFER_MT);
+
+	lua_createtable(L, buf->len, 0);
+
+	for (size_t i=0; i<buf->len; i++) {
+		buffer_pushelem(L, buf, i);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+const luaL_Reg lsdbus_buffer_m [] = {
+	{ "type", buffer_type },
+	{ "sub", buffer_sub },
+	{ "totable", buffer_totable },
+	{ "__index", buffer_index },
+	{ "__newindex", buffer_newindex },
+	{ "__len", buffer_len },
+	{ "__tostring", buffer_tostring },
+	{ NULL, NULL }
+};
@@ -147,6 +147,7 @@ int evl_loop(lua_State *L)
 	sd_bus *b = lua_checksdbus(L, 1);
 	sd_event *loop = evl_get(L, b);
 
+	lsdbus_bus_register(L, 1);
 	ret = sd_event_loop(loop);
 
 	if(ret<0)
@@ -165,6 +166,7 @@ int evl_run(lua_State *L)
 
 	usec = luaL_optinteger(L, 2, 0);
 
+	lsdbus_bus_register(L, 1);
 	ret = sd_event_run(loop, usec);
 
 	if(ret<0)
@@ -217,7 +219,7 @@ static int evl_sig_callback(sd_event_source *s, const struct signalfd_siginfo *s
 	dbg("received signal %d", sd_event_source_get_signal(s));
 
 	regtab_get(L, REG_EVSRC_TABLE, s);
-	lua_pushvalue(L, 1);		/* bus */
+	lsdbus_push_bus(L, sd_event_source_get_event(s));	/* bus */
 	lua_pushinteger(L, sig);	/* signal */
 
 	ret = lua_pcall(L, 2, 0, 0);
@@ -252,7 +254,7 @@ int evl_add_signal(lua_State *L)
 	if (sigprocmask(SIG_BLOCK, &ss, NULL) < 0)
 		luaL_error(L, "sigprocmask failed: %m");
 
-	ret = sd_event_add_signal(loop, &source, sig, evl_sig_callback, L);
+	ret = sd_event_add_signal(loop, &source, sig, evl_sig_callback, lsdbus_main_thread(L));
 
 	if (ret<0)
 		luaL_error(L, "adding signal failed: %s", strerror(-ret));
@@ -285,7 +287,7 @@ static int timer_callback(sd_event_source *evsrc, uint64_t usec, void* userdata)
 	lua_pop(L, 1);
 
 	lua_rawgeti(L, -1, 1);
-	lua_pushvalue(L, 1);		/* bus */
+	lsdbus_push_bus(L, sd_event_source_get_event(evsrc));	/* bus */
 	lua_pushinteger(L, usec);	/* usec */
 	ret = lua_pcall(L, 2, 0, 0);
 
@@ -294,6 +296,10 @@ static int timer_callback(sd_event_source *evsrc, uint64_t usec, void* userdata)
 		fprintf(stderr, "error in periodic callback: %s\n", err?err:"-");
 	}
 
+	/* the callback may have unref'ed the event source */
+	if (regtab_get(L, REG_EVSRC_TABLE, evsrc) == LUA_TNIL)
+		goto out;
+
 	/* rearm */
 	loop = sd_event_source_get_event(evsrc);
 
@@ -309,6 +315,7 @@ static int timer_callback(sd_event_source *evsrc, uint64_t usec, void* userdata)
 	
 	sd_event_source_set_time(evsrc, usec);
 
+out:
 	lua_settop(L, top);
 	return 0;
 }
@@ -345,7 +352,7 @@ int evl_add_periodic(lua_State *L)
 		luaL_error(L, "failed get current time: %s", strerror(-ret));
 
 	ret = sd_event_add_time(
-		loop, &evsrc, CLOCK_MONOTONIC, now+usec, accuracy, timer_callback, L);
+		loop, &evsrc, CLOCK_MONOTONIC, now+usec, accuracy, timer_callback, lsdbus_main_thread(L));
 
 	if(ret<0)
 		luaL_error(L, "failed add monotonic time source: %s", strerror(-ret));
@@ -381,7 +388,7 @@ static int evl_io_callback(sd_event_source *s, int fd, uint32_t revents, void *u
 	dbg("received io event %i on fd %i", revents, fd);
 	regtab_get(L, REG_EVSRC_TABLE, s);
 
-	lua_pushvalue(L, 1);	/* bus */
+	lsdbus_push_bus(L, sd_event_source_get_event(s));	/* bus */
 	lua_pushinteger(L, fd);
 	lua_pushinteger(L, revents);
 
@@ -409,7 +416,7 @@ int evl_add_io(lua_State *L)
 
 	sd_event *loop = evl_get(L, b);
 
-	ret = sd_event_add_io(loop, &source, fd, events, evl_io_callback, L);
+	ret = sd_event_add_io(loop, &source, fd, events, evl_io_callback, lsdbus_main_thread(L));
 
 	if (ret<0)
 		luaL_error(L, "adding io event src failed: %s", strerror(-ret));
@@ -434,7 +441,7 @@ static int evl_child_callback(sd_event_source *s, const siginfo_t *si, void *use
 	dbg("received wait child (pid %i) event", si->si_pid);
 
 	regtab_get(L, REG_EVSRC_TABLE, s);
-	lua_pushvalue(L, 1);		/* bus */
+	lsdbus_push_bus(L, sd_event_source_get_event(s));	/* bus */
 
 	lua_newtable(L);		/* si */
 
@@ -483,7 +490,7 @@ int evl_add_child(lua_State *L)
 
 	dbg("add callback for pid %i (%i)", pid, options);
 
-	ret = sd_event_add_child(loop, &source, pid, options, evl_child_callback, L);
+	ret = sd_event_add_child(loop, &source, pid, options, evl_child_callback, lsdbus_main_thread(L));
 
 	if (ret<0)
 		luaL_error(L, "adding child pid event src failed: %s", strerror(-ret));
@@ -500,3 +507,66 @@ int evl_add_child(lua_State *L)
 
 	return 1;
 }
+
+/* defer */
+static int evl_defer_callback(sd_event_source *s, void *userdata)
+{
+	int ret, top;
+	lua_State *L = (lua_State*) userdata;
+
+	top = lua_gettop(L);
+
+	regtab_get(L, REG_EVSRC_TABLE, s);
+	lsdbus_push_bus(L, sd_event_source_get_event(s));	/* bus */
+
+	ret = lua_pcall(L, 1, 0, 0);
+
+	if (ret != LUA_OK) {
+		const char *err = lua_tolstring(L, -1, NULL);
+		fprintf(stderr, "error in defer callback: %s\n", err?err:"-");
+	}
+
+	lua_settop(L, top);
+	return 0;
+}
+
+/**
+ * bus:add_defer(callback, enabled)
+ *
+ * add a defer event source, which calls callback once in the next
+ * loop iteration. The source is oneshot and can be rearmed with
+ * evsrc:set_enabled(lsdbus.SD_EVENT_ONESHOT). If enabled is false, it
+ * is created disabled.
+ */
+int evl_add_defer(lua_State *L)
+{
+	int ret, enabled = SD_EVENT_ONESHOT;
+	sd_event_source *source, **sourcep;
+
+	sd_bus *b = lua_checksdbus(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+
+	if (!lua_isnoneornil(L, 3))
+		enabled = lua_toboolean(L, 3) ? SD_EVENT_ONESHOT : SD_EVENT_OFF;
+
+	sd_event *loop = evl_get(L, b);
+
+	ret = sd_event_add_defer(loop, &source, evl_defer_callback, lsdbus_main_thread(L));
+
+	if (ret<0)
+		luaL_error(L, "adding defer event src failed: %s", strerror(-ret));
+
+	ret = sd_event_source_set_enabled(source, enabled);
+	if (ret<0)
+		luaL_error(L, "failed to set event mode: %s", strerror(-ret));
+
+	regtab_store(L,	REG_EVSRC_TABLE, source, 2);
+
+	sourcep = (sd_event_source**) lua_newuserdata(L, sizeof(sd_event_source*));
+	*sourcep = source;
+
+	luaL_setmetatable(L, EVSRC_MT);
+	sd_event_source_set_description(source, "defer");
+
+	return 1;
+}
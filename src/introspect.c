@@ -36,6 +36,41 @@
 </node>
 */
 
+/*
+ * set the field annotations of the table on the top of the stack to a
+ * table mapping the names of the <annotation> children of elem to
+ * their values. Nothing is set if there are no annotations.
+ */
+static void push_annotations(lua_State *L, mxml_node_t *elem)
+{
+	mxml_node_t *ann;
+	const char *name, *value;
+	int have = 0;
+
+	for(ann = mxmlFindElement(elem, elem, "annotation", NULL, NULL, MXML_DESCEND_FIRST);
+	    ann != NULL;
+	    ann = mxmlFindElement(ann, elem, "annotation", NULL, NULL, MXML_NO_DESCEND)) {
+		name = mxmlElementGetAttr(ann, "name");
+		value = mxmlElementGetAttr(ann, "value");
+
+		if (!name || !value)
+			continue;
+
+		if (!have) {
+			lua_pushstring(L, "annotations");
+			lua_newtable(L);
+			have = 1;
+		}
+
+		lua_pushstring(L, name);
+		lua_pushstring(L, value);
+		lua_rawset(L, -3);
+	}
+
+	if (have)
+		lua_rawset(L, -3); /* t.annotations = annotations */
+}
+
 /*
  * convert the given D-Bus XML node to it's corresponding Lua
  * representation.
@@ -120,6 +155,8 @@ static int dbus_xml2lua(lua_State *L, mxml_node_t *root)
 			lua_pushstring(L, mxmlElementGetAttr(prop, "access"));
 			lua_rawset(L, -3);
 
+			push_annotations(L, prop);
+
 			lua_rawset(L, -3); /* properties[name] = property */
 		}
 
@@ -156,6 +193,8 @@ static int dbus_xml2lua(lua_State *L, mxml_node_t *root)
 
 		lua_rawset(L, -3); /* interface.signals = signals */
 
+		push_annotations(L, intf);
+
 		/* interfaces[#interfaces+1] = interface */
 		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
 	}
@@ -1,4 +1,5 @@
 #include <signal.h>
+#include <time.h>
 #include "lsdbus.h"
 
 static const char *const open_opts_lst [] = {
@@ -73,6 +74,27 @@ void regtab_clear(lua_State *L, const char* regtab, void *k)
 		lua_pushnil(L);
 		lua_rawsetp(L, -2, k);
 	}
+	lua_pop(L, 1);
+}
+
+/**
+ * return the main thread of L. Callbacks are registered with the
+ * main thread, since the thread registering them may be a coroutine,
+ * which is suspended or dead when the callback is invoked.
+ */
+lua_State *lsdbus_main_thread(lua_State *L)
+{
+	lua_State *main;
+
+#if LUA_VERSION_NUM >= 502
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+#else
+	lua_getfield(L, LUA_REGISTRYINDEX, REG_MAIN_THREAD);
+#endif
+	main = lua_tothread(L, -1);
+	lua_pop(L, 1);
+
+	return main ? main : L;
 }
 
 const char* luaL_checkintf(lua_State *L, int arg)
@@ -123,6 +145,63 @@ sd_bus* lua_checksdbus(lua_State *L, int index)
 	return lsdbus->b;
 }
 
+/*
+ * Callbacks run on the main thread, so the bus object passed to them
+ * is looked up in the weak REG_BUS_TABLE. It maps the sd_bus and its
+ * event loop (if any) to the bus object at idx. Several bus objects
+ * can share the sd_bus of the default buses, hence the bus is
+ * registered again whenever it is run.
+ */
+void lsdbus_bus_register(lua_State *L, int idx)
+{
+	struct lsdbus_bus *lsdbus = (struct lsdbus_bus*) luaL_checkudata(L, idx, BUS_MT);
+	sd_event *loop = sd_bus_get_event(lsdbus->b);
+
+	regtab_store(L, REG_BUS_TABLE, lsdbus->b, idx);
+
+	if (loop)
+		regtab_store(L, REG_BUS_TABLE, loop, idx);
+}
+
+/* push the bus object of the sd_bus or sd_event key or nil [-0, +1, e] */
+int lsdbus_push_bus(lua_State *L, void *key)
+{
+	return regtab_get(L, REG_BUS_TABLE, key);
+}
+
+/* return the default LSDBUS_MSG_* flags of b for use in callbacks */
+uint32_t lsdbus_msg_flags(lua_State *L, sd_bus *b)
+{
+	uint32_t flags = 0;
+	struct lsdbus_bus *lsdbus;
+
+	lsdbus_push_bus(L, b);
+	lsdbus = (struct lsdbus_bus*) luaL_testudata(L, -1, BUS_MT);
+
+	if (lsdbus && lsdbus->b == b)
+		flags = lsdbus->msg_flags;
+
+	lua_pop(L, 1);
+	return flags;
+}
+
+/**
+ * return the LSDBUS_MSG_* flags for messages dispatched to slot: the
+ * flags set with slot:set_msg_flags or the bus defaults.
+ */
+uint32_t lsdbus_slot_msg_flags(lua_State *L, sd_bus *b, sd_bus_slot *slot)
+{
+	uint32_t flags;
+
+	if (regtab_get(L, REG_SLOT_MSG_FLAGS, slot) == LUA_TNUMBER)
+		flags = lua_tointeger(L, -1);
+	else
+		flags = lsdbus_msg_flags(L, b);
+
+	lua_pop(L, 1);
+	return flags;
+}
+
 /* toplevel functions */
 static int lsdbus_open(lua_State *L)
 {
@@ -134,6 +213,8 @@ static int lsdbus_open(lua_State *L)
 	dbg("opening %s bus connection", open_opts_lst[busidx]);
 
 	lsdbus = (struct lsdbus_bus*) lua_newuserdata(L, sizeof(struct lsdbus_bus));
+	lsdbus->flags = 0;
+	lsdbus->msg_flags = 0;
 
 	ret = open_funcs[busidx](&lsdbus->b);
 
@@ -149,22 +230,84 @@ static int lsdbus_open(lua_State *L)
 
 	luaL_getmetatable(L, BUS_MT);
 	lua_setmetatable(L, -2);
+	lsdbus_bus_register(L, -1);
 	return 1;
 }
 
 /* bus methods */
-static int __lsdbus_bus_call(lua_State *L, int raw)
+
+/*
+ * optional timeout (in us) before the destination of the call
+ * methods. It is removed from the stack, 0 if not given.
+ */
+static uint64_t opt_timeout(lua_State *L, int idx)
+{
+	lua_Integer timeout;
+
+	if (lua_type(L, idx) != LUA_TNUMBER)
+		return 0;
+
+	timeout = luaL_checkinteger(L, idx);
+
+	if (timeout < 0)
+		luaL_error(L, "invalid timeout: must not be negative");
+
+	lua_remove(L, idx);
+	return timeout;
+}
+
+/**
+ * lsdbus_call_msg - call m and push the results [-0, +n, e]
+ *
+ * @param flags LSDBUS_MSG_* flags for converting the reply
+ * @param timeout in us, 0 for the method call timeout of the bus
+ * @return the number of values pushed: true and the results or false
+ * and the error table. m is unref'd.
+ */
+int lsdbus_call_msg(lua_State *L, sd_bus *b, sd_bus_message *m, uint32_t flags, uint64_t timeout)
+{
+	int ret;
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	sd_bus_message *reply = NULL;
+
+	ret = sd_bus_call(b, m, timeout, &error, &reply);
+	sd_bus_message_unref(m);
+
+	if (ret<0) {
+		if(!sd_bus_error_is_set(&error))
+			luaL_error(L, "call failed: %s", strerror(-ret));
+
+		lua_pushboolean(L, 0);
+		push_sd_bus_error(L, &error);
+		sd_bus_error_free(&error);
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+
+	if (flags & LSDBUS_MSG_LAZY)
+		ret = lsdbus_msg_push(L, reply, flags);
+	else
+		ret = msg_tolua(L, reply, flags);
+
+	sd_bus_message_unref(reply);
+
+	if (ret<0)
+		lua_error(L);
+
+	return ret + 1;
+}
+
+static int __lsdbus_bus_call(lua_State *L, uint32_t flags)
 {
 	int ret;
 	uint64_t timeout;
 	const char *dest, *path, *intf, *memb, *types;
-
-	sd_bus_error error = SD_BUS_ERROR_NULL;
 	sd_bus_message *m = NULL;
-	sd_bus_message *reply = NULL;
 
 	sd_bus *b = lua_checksdbus(L, 1);
 
+	timeout = opt_timeout(L, 2);
 	dest = luaL_checkservice(L, 2);
 	path = luaL_checkpath(L, 3);
 	intf = luaL_checkintf(L, 4);
@@ -178,50 +321,37 @@ static int __lsdbus_bus_call(lua_State *L, int raw)
 			   __func__, strerror(-ret));
 
 	if (types != NULL) {
-		ret = msg_fromlua(L, m, types, 7);
-
-		if (ret<0)
-			goto out;
-	}
-
-	ret = sd_bus_get_method_call_timeout(b, &timeout);
-
-	if(ret<0)
-		luaL_error(L, "%s: failed to get call timeout: %s",
-			   __func__, strerror(-ret));
+		ret = msg_fromlua(L, m, types, 7, flags);
 
-	ret = sd_bus_call(b, m, 0, &error, &reply);
-
-	if (ret<0) {
-		lua_pushboolean(L, 0);
-		if(sd_bus_error_is_set(&error)) {
-			push_sd_bus_error(L, &error);
-			ret = 2;
-		} else {
-			luaL_error(L, "call failed: %s", strerror(-ret));
+		if (ret<0) {
+			sd_bus_message_unref(m);
+			lua_error(L);
 		}
-
-		goto out;
 	}
 
-	lua_pushboolean(L, 1);
-	ret = msg_tolua(L, reply, raw);
-
-	if (ret >= 0)
-		ret++;
-out:
-	sd_bus_error_free(&error);
-	sd_bus_message_unref(reply);
-	sd_bus_message_unref(m);
+	return lsdbus_call_msg(L, b, m, flags, timeout);
+}
 
-	if (ret<0)
-		lua_error(L);
+static int lsdbus_bus_call(lua_State *L)
+{
+	struct lsdbus_bus *lsdbus = (struct lsdbus_bus*) luaL_checkudata(L, 1, BUS_MT);
+	return __lsdbus_bus_call(L, lsdbus->msg_flags & ~(LSDBUS_MSG_LAZY|LSDBUS_MSG_AUTO_VARIANT));
+}
 
-	return ret;
+static int lsdbus_bus_callr(lua_State *L)
+{
+	struct lsdbus_bus *lsdbus = (struct lsdbus_bus*) luaL_checkudata(L, 1, BUS_MT);
+	return __lsdbus_bus_call(L, (lsdbus->msg_flags & ~(LSDBUS_MSG_LAZY|LSDBUS_MSG_AUTO_VARIANT)) |
+				 LSDBUS_MSG_RAW);
 }
 
-static int lsdbus_bus_call(lua_State *L) { return __lsdbus_bus_call(L, 0); }
-static int lsdbus_bus_callr(lua_State *L) { return __lsdbus_bus_call(L, 1); }
+/* bus:callf(flags, [timeout,] dest, path, intf, member, types, ...) */
+static int lsdbus_bus_callf(lua_State *L)
+{
+	uint32_t flags = luaL_checkinteger(L, 2);
+	lua_remove(L, 2);
+	return __lsdbus_bus_call(L, flags);
+}
 
 void push_string_or_nil(lua_State *L, const char* s)
 {
@@ -238,26 +368,39 @@ static int signal_callback(sd_bus_message *m, void *userdata, sd_bus_error *ret_
 {
 	(void)ret_error;
 	int ret, nargs, top;
+	uint32_t flags;
 	lua_State *L = (lua_State*) userdata;
 	sd_bus *b = sd_bus_message_get_bus(m);
 	sd_bus_slot *slot = sd_bus_get_current_slot(b);
 
 	top = lua_gettop(L);
+	flags = lsdbus_slot_msg_flags(L, b, slot);
 
 	regtab_get(L, REG_SLOT_TABLE, slot);
 
-	lua_pushvalue(L, 1); /* bus */
-	push_string_or_nil(L, sd_bus_message_get_sender(m));
-	push_string_or_nil(L, sd_bus_message_get_path(m));
-	push_string_or_nil(L, sd_bus_message_get_interface(m));
-	push_string_or_nil(L, sd_bus_message_get_member(m));
+	lsdbus_push_bus(L, b);
+
+	if (flags & LSDBUS_MSG_LAZY) {
+		nargs = lsdbus_msg_push(L, m, flags);
+	} else {
+		struct lsdbus_str_cache *sc = str_cache_get(L);
+		int sctab = lua_gettop(L);
 
-	nargs = msg_tolua(L, m, 0);
+		str_cache_push(L, sc, sctab, sd_bus_message_get_sender(m));
+		str_cache_push(L, sc, sctab, sd_bus_message_get_path(m));
+		str_cache_push(L, sc, sctab, sd_bus_message_get_interface(m));
+		str_cache_push(L, sc, sctab, sd_bus_message_get_member(m));
+		lua_remove(L, sctab);
 
-	if(nargs<0)
-		lua_error(L);
+		nargs = msg_tolua(L, m, flags);
 
-	ret = lua_pcall(L, 5+nargs, 1, 0);
+		if(nargs<0)
+			lua_error(L);
+
+		nargs += 4;
+	}
+
+	ret = lua_pcall(L, 1+nargs, 1, 0);
 
 	if (ret != LUA_OK) {
 		const char *err = lua_tolstring(L, -1, NULL);
@@ -285,12 +428,14 @@ static int lsdbus_match_signal(lua_State *L)
 	if (!lua_isnil(L, 5)) memb = luaL_checkmember(L, 5);
 	luaL_checktype(L, 6, LUA_TFUNCTION);
 
-	ret = sd_bus_match_signal(b, &slot, sender, path, intf, memb, signal_callback, L);
+	ret = sd_bus_match_signal(b, &slot, sender, path, intf, memb, signal_callback,
+				  lsdbus_main_thread(L));
 
 	if (ret<0)
 		luaL_error(L, "failed to install signal match rule: %s", strerror(-ret));
 
 	regtab_store(L,	REG_SLOT_TABLE, slot, 6);
+	regtab_clear(L,	REG_SLOT_MSG_FLAGS, slot);
 	return lsdbus_slot_push(L, slot, LSDBUS_SLOT_TYPE_MATCH);
 }
 
@@ -305,7 +450,7 @@ static int lsdbus_match(lua_State *L)
 	if (!lua_isnil(L, 2)) match = luaL_checkstring(L, 2);
 	luaL_checktype(L, 3, LUA_TFUNCTION);
 
-	ret = sd_bus_add_match(b, &slot, match, signal_callback, L);
+	ret = sd_bus_add_match(b, &slot, match, signal_callback, lsdbus_main_thread(L));
 
 	if (ret<0)
 		luaL_error(L, "failed to install match rule: %s", strerror(-ret));
@@ -320,6 +465,7 @@ static int lsdbus_match(lua_State *L)
 
 	lua_pushvalue(L, 3);
 	lua_rawsetp(L, -2, slot);
+	regtab_clear(L,	REG_SLOT_MSG_FLAGS, slot);
 	return lsdbus_slot_push(L, slot, LSDBUS_SLOT_TYPE_MATCH);
 }
 
@@ -330,25 +476,33 @@ static int method_callback(sd_bus_message *m, void *userdata, sd_bus_error *ret_
 {
 	(void)ret_error;
 	int ret, nargs, top;
+	uint32_t flags;
 	lua_State *L = (lua_State*) userdata;
 	sd_bus *b = sd_bus_message_get_bus(m);
 	sd_bus_slot *slot = sd_bus_get_current_slot(b);
 
 	top = lua_gettop(L);
+	flags = lsdbus_slot_msg_flags(L, b, slot);
 
 	regtab_get(L, REG_SLOT_TABLE, slot);
 
-	lua_pushvalue(L, 1); /* bus */
+	/* there is only one reply, release the callback right away */
+	regtab_clear(L, REG_SLOT_TABLE, slot);
+	regtab_clear(L, REG_SLOT_MSG_FLAGS, slot);
+
+	lsdbus_push_bus(L, b);
 
 	ret = sd_bus_message_is_method_error(m, NULL);
 
-	if (ret) {
+	if (flags & LSDBUS_MSG_LAZY) {
+		nargs = lsdbus_msg_push(L, m, flags);
+	} else if (ret) {
 		lua_pushstring(L, "__error__");
 		const sd_bus_error *e = sd_bus_message_get_error(m);
 		if (e) push_sd_bus_error(L, e);
 		nargs = 2;
 	} else {
-		nargs = msg_tolua(L, m, 0);
+		nargs = msg_tolua(L, m, flags);
 		if (nargs<0) lua_error(L);
 	}
 
@@ -367,18 +521,46 @@ static int method_callback(sd_bus_message *m, void *userdata, sd_bus_error *ret_
 	return ret;
 }
 
+/**
+ * lsdbus_call_async_msg - call m asynchronously [-0, +1, e]
+ *
+ * @param cbidx stack index of the callback
+ * @param timeout in us, 0 for the method call timeout of the bus
+ * @return 1, the slot is pushed. m is unref'd.
+ */
+int lsdbus_call_async_msg(lua_State *L, sd_bus *b, sd_bus_message *m, int cbidx, uint64_t timeout)
+{
+	int ret = 0;
+	sd_bus_slot *slot;
+
+	if (timeout == 0)
+		ret = sd_bus_get_method_call_timeout(b, &timeout);
+
+	if (ret >= 0)
+		ret = sd_bus_call_async(b, &slot, m, method_callback, lsdbus_main_thread(L), timeout);
+
+	sd_bus_message_unref(m);
+
+	if (ret<0)
+		luaL_error(L, "call_async failed: %s", strerror(-ret));
+
+	regtab_store(L,	REG_SLOT_TABLE, slot, cbidx);
+	regtab_clear(L,	REG_SLOT_MSG_FLAGS, slot);
+	return lsdbus_slot_push(L, slot, LSDBUS_SLOT_TYPE_ASYNC);
+}
+
+/* bus:call_async(callback, [timeout,] dest, path, intf, member, types, ...) */
 static int lsdbus_call_async(lua_State *L)
 {
 	int ret;
 	uint64_t timeout;
 	const char *dest, *path, *intf, *memb, *types;
-
-	sd_bus_slot *slot;
 	sd_bus_message *m = NULL;
 
 	sd_bus *b = lua_checksdbus(L, 1);
 
 	luaL_checktype(L, 2, LUA_TFUNCTION);
+	timeout = opt_timeout(L, 3);
 	dest = luaL_checkservice(L, 3);
 	path = luaL_checkpath(L, 4);
 	intf = luaL_checkintf(L, 5);
@@ -392,30 +574,226 @@ static int lsdbus_call_async(lua_State *L)
 			   __func__, strerror(-ret));
 
 	if (types != NULL) {
-		ret = msg_fromlua(L, m, types, 8);
+		ret = msg_fromlua(L, m, types, 8, 0);
+
+		if (ret<0) {
+			sd_bus_message_unref(m);
+			luaL_error(L, "call_async failed: %s", strerror(-ret));
+		}
+	}
+
+	return lsdbus_call_async_msg(L, b, m, 2, timeout);
+}
+
+/*
+ * call_many: issue a batch of calls at once and collect the replies.
+ * The entries are kept in a userdata, so that the memory is released
+ * on errors. The slots must be unref'd before raising an error, since
+ * their userdata points into it.
+ *
+ * While waiting, the bus is processed, so that other messages (signals,
+ * method calls, replies) are dispatched too. That is not possible from
+ * within a callback, so there the calls are made one after another.
+ */
+struct call_many_ent {
+	sd_bus_message *m;
+	sd_bus_slot *slot;
+	sd_bus_message *reply;
+	sd_bus_error error;
+	unsigned *pending;
+};
+
+static int call_many_callback(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	(void)ret_error;
+	struct call_many_ent *ent = (struct call_many_ent*) userdata;
+
+	ent->reply = sd_bus_message_ref(m);
+	(*ent->pending)--;
+	return 1;
+}
+
+static void call_many_free(struct call_many_ent *ents, int n)
+{
+	for (int i=0; i<n; i++) {
+		ents[i].m = sd_bus_message_unref(ents[i].m);
+		ents[i].slot = sd_bus_slot_unref(ents[i].slot);
+		ents[i].reply = sd_bus_message_unref(ents[i].reply);
+		sd_bus_error_free(&ents[i].error);
+	}
+}
+
+/* push { n=N, true, results... } or { n=2, false, { name, message } } */
+static int call_many_push_result(lua_State *L, struct call_many_ent *ent, uint32_t flags)
+{
+	int ret, top = lua_gettop(L);
+
+	if (ent->reply == NULL) {
+		lua_pushboolean(L, 0);
+		push_sd_bus_error(L, &ent->error);
+	} else if (sd_bus_message_is_method_error(ent->reply, NULL)) {
+		lua_pushboolean(L, 0);
+		push_sd_bus_error(L, sd_bus_message_get_error(ent->reply));
+	} else {
+		lua_pushboolean(L, 1);
+		ret = msg_tolua(L, ent->reply, flags);
 
 		if (ret<0)
-			goto out;
+			return ret;
 	}
 
-	ret = sd_bus_get_method_call_timeout(b, &timeout);
+	ret = lua_gettop(L) - top;
+	lua_createtable(L, ret, 1);
+	lua_insert(L, top+1);
 
-	if(ret<0)
-		luaL_error(L, "%s: failed to get call timeout: %s", __func__, strerror(-ret));
+	for (int i=ret; i>0; i--)
+		lua_rawseti(L, top+1, i);
+
+	lua_pushinteger(L, ret);
+	lua_setfield(L, top+1, "n");
+	return 0;
+}
 
-	ret = sd_bus_call_async(b, &slot, m, method_callback, L, timeout);
+/* bus:call_many({ { dest, path, intf, member, types, ... }, ... }, timeout) */
+static int lsdbus_call_many(lua_State *L)
+{
+	int ret, i, n, base, nargs;
+	uint64_t timeout;
+	unsigned pending = 0;
+	const char *dest, *path, *intf, *memb, *types;
+	struct call_many_ent *ents;
 
-out:
-	sd_bus_message_unref(m);
+	struct lsdbus_bus *lsdbus = (struct lsdbus_bus*) luaL_checkudata(L, 1, BUS_MT);
+	sd_bus *b = lsdbus->b;
+	uint32_t flags = lsdbus->msg_flags & ~(LSDBUS_MSG_LAZY|LSDBUS_MSG_AUTO_VARIANT);
 
-	if (ret<0)
-		luaL_error(L, "call_async failed: %s", strerror(-ret));
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lsdbus_bus_register(L, 1);
 
-	regtab_store(L,	REG_SLOT_TABLE, slot, 2);
-	return lsdbus_slot_push(L, slot, LSDBUS_SLOT_TYPE_ASYNC);
+	if (lua_isnoneornil(L, 3)) {
+		ret = sd_bus_get_method_call_timeout(b, &timeout);
+		if (ret<0)
+			luaL_error(L, "call_many: failed to get timeout: %s", strerror(-ret));
+	} else {
+		lua_Integer t = luaL_checkinteger(L, 3);
+
+		if (t < 0)
+			luaL_error(L, "invalid timeout: must not be negative");
+
+		timeout = t;
+	}
+
+	n = lua_rawlen(L, 2);
+	ents = (struct call_many_ent*) lua_newuserdata(L, n * sizeof(struct call_many_ent) + 1);
+	memset(ents, 0, n * sizeof(struct call_many_ent));
+	base = lua_gettop(L);
+
+	/* create all messages first, so that invalid calls raise an
+	 * error before anything is sent */
+	for (i=0; i<n; i++) {
+		lua_rawgeti(L, 2, i+1);
+
+		if (lua_type(L, -1) != LUA_TTABLE)
+			goto inval;
+
+		nargs = lua_rawlen(L, -1);
+
+		if (!lua_checkstack(L, nargs + 2)) {
+			call_many_free(ents, n);
+			luaL_error(L, "call_many: call %d: too many args", i+1);
+		}
+
+		for (int j=1; j<=nargs; j++)
+			lua_rawgeti(L, base+1, j);
+
+		dest = lua_tostring(L, base+2);
+		path = lua_tostring(L, base+3);
+		intf = lua_tostring(L, base+4);
+		memb = lua_tostring(L, base+5);
+		types = lua_tostring(L, base+6);
+
+		if (!dest || !path || !intf || !memb)
+			goto inval;
+
+		ret = sd_bus_message_new_method_call(b, &ents[i].m, dest, path, intf, memb);
+
+		if (ret<0) {
+			call_many_free(ents, n);
+			luaL_error(L, "call_many: call %d: failed to create call message: %s",
+				   i+1, strerror(-ret));
+		}
+
+		if (types != NULL && msg_fromlua(L, ents[i].m, types, base+7, flags) < 0) {
+			call_many_free(ents, n);
+			lua_error(L);
+		}
+
+		lua_settop(L, base);
+	}
+
+	/* sd_bus_process fails with EBUSY while dispatching */
+	if (sd_bus_get_current_message(b) != NULL) {
+		for (i=0; i<n; i++) {
+			ret = sd_bus_call(b, ents[i].m, timeout, &ents[i].error, &ents[i].reply);
+
+			if (ret<0 && !sd_bus_error_is_set(&ents[i].error)) {
+				call_many_free(ents, n);
+				luaL_error(L, "call_many: call %d failed: %s", i+1, strerror(-ret));
+			}
+		}
+		goto results;
+	}
+
+	/* the messages are written out while waiting for the replies */
+	for (i=0; i<n; i++) {
+		ents[i].pending = &pending;
+		ret = sd_bus_call_async(b, &ents[i].slot, ents[i].m, call_many_callback, &ents[i], timeout);
+
+		if (ret<0) {
+			call_many_free(ents, n);
+			luaL_error(L, "call_many: call %d failed: %s", i+1, strerror(-ret));
+		}
+
+		ents[i].m = sd_bus_message_unref(ents[i].m);
+		pending++;
+	}
+
+	/* sd-bus synthesizes a NoReply error once the timeout has elapsed */
+	while (pending > 0) {
+		ret = sd_bus_process(b, NULL);
+
+		if (ret > 0)
+			continue;
+
+		if (ret == 0)
+			ret = sd_bus_wait(b, UINT64_MAX);
+
+		if (ret < 0 && ret != -EINTR) {
+			call_many_free(ents, n);
+			luaL_error(L, "call_many failed: %s", strerror(-ret));
+		}
+	}
+
+results:
+	lua_createtable(L, n, 0);
+
+	for (i=0; i<n; i++) {
+		if (call_many_push_result(L, &ents[i], flags) < 0) {
+			call_many_free(ents, n);
+			lua_error(L);
+		}
+		lua_rawseti(L, -2, i+1);
+	}
+
+	call_many_free(ents, n);
+	return 1;
+
+inval:
+	call_many_free(ents, n);
+	return luaL_error(L, "call_many: call %d: expected { dest, path, intf, member, types, ... }", i+1);
 }
 
-static int __lsdbus_testmsg(lua_State *L, int raw)
+static int __lsdbus_testmsg(lua_State *L, uint32_t flags)
 {
 	int ret;
 	sd_bus_message *m = NULL;
@@ -425,7 +803,8 @@ static int __lsdbus_testmsg(lua_State *L, int raw)
 	const char *intf = "org.lsdb.test";
 	const char *memb = "testmsg";
 
-	sd_bus *b = lua_checksdbus(L, 1);
+	struct lsdbus_bus *lsdbus = (struct lsdbus_bus*) luaL_checkudata(L, 1, BUS_MT);
+	sd_bus *b = lsdbus->b;
 	types = luaL_optstring(L, 2, NULL);
 
 	ret = sd_bus_message_new_method_call(b, &m, dest, path, intf, memb);
@@ -435,7 +814,7 @@ static int __lsdbus_testmsg(lua_State *L, int raw)
 			   __func__, strerror(-ret));
 
 	if (types!= NULL)
-		ret = msg_fromlua(L, m, types, 3);
+		ret = msg_fromlua(L, m, types, 3, flags);
 
 	if (ret<0)
 		goto out;
@@ -445,7 +824,7 @@ static int __lsdbus_testmsg(lua_State *L, int raw)
 	sd_bus_message_dump(m, stdout, SD_BUS_MESSAGE_DUMP_WITH_HEADER);
 #endif
 	sd_bus_message_rewind(m, 1);
-	ret = msg_tolua(L, m, raw);
+	ret = msg_tolua(L, m, (lsdbus->msg_flags & ~LSDBUS_MSG_LAZY) | flags);
 
 out:
 	sd_bus_message_unref(m);
@@ -457,7 +836,15 @@ out:
 }
 
 static int lsdbus_testmsg(lua_State *L) { return __lsdbus_testmsg(L, 0); }
-static int lsdbus_testmsgr(lua_State *L) { return __lsdbus_testmsg(L, 1); }
+static int lsdbus_testmsgr(lua_State *L) { return __lsdbus_testmsg(L, LSDBUS_MSG_RAW); }
+
+/* bus:testmsgf(flags, types, ...) */
+static int lsdbus_testmsgf(lua_State *L)
+{
+	uint32_t flags = luaL_checkinteger(L, 2);
+	lua_remove(L, 2);
+	return __lsdbus_testmsg(L, flags & ~LSDBUS_MSG_LAZY);
+}
 
 static int lsdbus_bus_request_name(lua_State *L)
 {
@@ -529,6 +916,20 @@ static int lsdbus_bus_set_method_call_timeout(lua_State *L)
 	return 0;
 }
 
+static int lsdbus_bus_set_msg_flags(lua_State *L)
+{
+	struct lsdbus_bus *lsdbus = (struct lsdbus_bus*) luaL_checkudata(L, 1, BUS_MT);
+	lsdbus->msg_flags = luaL_checkinteger(L, 2);
+	return 0;
+}
+
+static int lsdbus_bus_get_msg_flags(lua_State *L)
+{
+	struct lsdbus_bus *lsdbus = (struct lsdbus_bus*) luaL_checkudata(L, 1, BUS_MT);
+	lua_pushinteger(L, lsdbus->msg_flags);
+	return 1;
+}
+
 static int lsdbus_bus_get_method_call_timeout(lua_State *L)
 {
 	int ret;
@@ -562,10 +963,31 @@ static int lsdbus_bus_gc(lua_State *L)
 	return 0;
 }
 
+/* lsdbus.now(): CLOCK_MONOTONIC in us */
+static int lsdbus_now(lua_State *L)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		luaL_error(L, "clock_gettime failed: %s", strerror(errno));
+
+	lua_pushinteger(L, (lua_Integer) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+	return 1;
+}
+
 static const luaL_Reg lsdbus_f [] = {
 	{ "open", lsdbus_open },
 	{ "xml_fromfile", lsdbus_xml_fromfile },
 	{ "xml_fromstr", lsdbus_xml_fromstr },
+	{ "sig_cache_stats", lsdbus_sig_cache_stats },
+	{ "str_cache_stats", lsdbus_str_cache_stats },
+	{ "str_cache_resize", lsdbus_str_cache_resize },
+	{ "buffer", lsdbus_buffer_new },
+	{ "variant", lsdbus_variant },
+	{ "tovariant", lsdbus_tovariant },
+	{ "tovariant2", lsdbus_tovariant2 },
+	{ "vtable", lsdbus_vtable_new },
+	{ "now", lsdbus_now },
 	/* { "testmsg_tolua", lsdbus_testmsg_tolua }, */
 	{ NULL, NULL },
 };
@@ -573,15 +995,26 @@ static const luaL_Reg lsdbus_f [] = {
 static const luaL_Reg lsdbus_bus_m [] = {
 	{ "get_method_call_timeout", lsdbus_bus_get_method_call_timeout },
 	{ "set_method_call_timeout", lsdbus_bus_set_method_call_timeout },
+	{ "get_msg_flags", lsdbus_bus_get_msg_flags },
+	{ "set_msg_flags", lsdbus_bus_set_msg_flags },
 	{ "call", lsdbus_bus_call },
 	{ "callr", lsdbus_bus_callr },
+	{ "callf", lsdbus_bus_callf },
+	{ "prepare", lsdbus_prepare },
 	{ "call_async", lsdbus_call_async },
+	{ "call_many", lsdbus_call_many },
 	{ "match_signal", lsdbus_match_signal },
 	{ "match", lsdbus_match },
 	{ "add_object_vtable", lsdbus_add_object_vtable },
+	{ "add_fallback_vtable", lsdbus_add_fallback_vtable },
+	{ "add_node_enumerator", lsdbus_add_node_enumerator },
+	{ "add_object_manager", lsdbus_add_object_manager },
 	{ "emit_properties_changed", lsdbus_emit_prop_changed },
 	{ "emit_signal", lsdbus_emit_signal },
+	{ "emit_interfaces_added", lsdbus_emit_interfaces_added },
+	{ "emit_interfaces_removed", lsdbus_emit_interfaces_removed },
 	{ "context", lsdbus_context },
+	{ "defer_reply", lsdbus_defer_reply },
 	{ "credentials", lsdbus_credentials },
 	{ "negotiate_credentials", lsdbus_negotiate_credentials },
 	{ "loop", evl_loop },
@@ -592,10 +1025,12 @@ static const luaL_Reg lsdbus_bus_m [] = {
 	{ "add_periodic", evl_add_periodic },
 	{ "add_io", evl_add_io },
 	{ "add_child", evl_add_child },
+	{ "add_defer", evl_add_defer },
 	{ "request_name", lsdbus_bus_request_name },
 	{ "release_name", lsdbus_bus_release_name },
 	{ "testmsg", lsdbus_testmsg },
 	{ "testmsgr", lsdbus_testmsgr },
+	{ "testmsgf", lsdbus_testmsgf },
 	{ "state", lsdbus_bus_state },
 	{ "__tostring", lsdbus_bus_tostring },
 	{ "__gc", lsdbus_bus_gc },
@@ -611,6 +1046,10 @@ static const luaL_Reg lsdbus_bus_m [] = {
     lua_pushinteger(L, s);\
     lua_setfield(L, -2, #s);
 
+#define register_constant_as(s, name)\
+    lua_pushinteger(L, s);\
+    lua_setfield(L, -2, name);
+
 int luaopen_lsdbus_core(lua_State *L)
 {
 	luaL_newmetatable(L, BUS_MT);
@@ -628,15 +1067,60 @@ int luaopen_lsdbus_core(lua_State *L)
 	lua_setfield(L, -1, "__index");
 	luaL_setfuncs(L, lsdbus_slot_m, 0);
 
+	luaL_newmetatable(L, MSG_MT);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -1, "__index");
+	luaL_setfuncs(L, lsdbus_msg_m, 0);
+
+	luaL_newmetatable(L, PREPARED_MT);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -1, "__index");
+	luaL_setfuncs(L, lsdbus_prepared_m, 0);
+
+	luaL_newmetatable(L, VTABLE_MT);
+	luaL_setfuncs(L, lsdbus_vtable_m, 0);
+
+	luaL_newmetatable(L, REPLY_MT);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -1, "__index");
+	luaL_setfuncs(L, lsdbus_reply_m, 0);
+
 	luaL_newmetatable(L, VARIANT_MT);
 	luaL_newmetatable(L, ARRAY_MT);
 	luaL_newmetatable(L, STRUCT_MT);
 
+	luaL_newmetatable(L, BUFFER_MT);
+	luaL_setfuncs(L, lsdbus_buffer_m, 0);
+
 	lua_settop(L, 1);
 
 	/* create REG_VTAB_USER_ARG reg table as a weak value table */
 	init_reg_vtab_user(L);
 
+	/* REG_BUS_TABLE must not keep the bus objects alive */
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushstring(L, "v");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, REG_BUS_TABLE);
+
+	/* create REG_SIG_CACHE reg table for compiled signatures */
+	init_reg_sig_cache(L);
+
+	/* create REG_STR_CACHE reg table for interned strings */
+	init_reg_str_cache(L);
+
+#if LUA_VERSION_NUM < 502
+	/* the main thread for lsdbus_main_thread */
+	lua_pushthread(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, REG_MAIN_THREAD);
+#endif
+
+	/* create REG_SLOT_MSG_FLAGS reg table for per slot msg flags */
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, REG_SLOT_MSG_FLAGS);
+
 	luaL_newlib(L, lsdbus_f);
 
 	/* constants */
@@ -647,6 +1131,14 @@ int luaopen_lsdbus_core(lua_State *L)
 	register_constant(EPOLLET);
 	register_constant(EPOLLERR);
 
+	/* message conversion flags */
+	register_constant_as(LSDBUS_MSG_RAW, "MSG_RAW");
+	register_constant_as(LSDBUS_MSG_AY_STRING, "MSG_AY_STRING");
+	register_constant_as(LSDBUS_MSG_BUFFER, "MSG_BUFFER");
+	register_constant_as(LSDBUS_MSG_COLUMNAR, "MSG_COLUMNAR");
+	register_constant_as(LSDBUS_MSG_LAZY, "MSG_LAZY");
+	register_constant_as(LSDBUS_MSG_AUTO_VARIANT, "MSG_AUTO_VARIANT");
+
 	register_constant(SD_EVENT_OFF);
 	register_constant(SD_EVENT_ON);
 	register_constant(SD_EVENT_ONESHOT);
@@ -6,6 +6,7 @@
 #include <systemd/sd-event.h>
 #include <assert.h>
 #include <errno.h>
+#include <stdbool.h>
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -21,14 +22,23 @@
 #define MSG_MT	 		"lsdbus.msg"
 #define EVSRC_MT		"lsdbus.evsrc"
 #define SLOT_MT			"lsdbus.slot"
+#define PREPARED_MT		"lsdbus.prepared"
+#define VTABLE_MT		"lsdbus.vtable"
+#define REPLY_MT		"lsdbus.reply"
 
 #define VARIANT_MT		"lsdbus.variant"
 #define ARRAY_MT		"lsdbus.array"
 #define STRUCT_MT		"lsdbus.struct"
+#define BUFFER_MT		"lsdbus.buffer"
 
 #define REG_SLOT_TABLE		"lsdbus.slot_table"
 #define REG_EVSRC_TABLE		"lsdbus.evsrc_table"
 #define REG_VTAB_USER_ARG	"lsdbus.vtab_user_arg"
+#define REG_SIG_CACHE		"lsdbus.sig_cache"
+#define REG_SLOT_MSG_FLAGS	"lsdbus.slot_msg_flags"
+#define REG_STR_CACHE		"lsdbus.str_cache"
+#define REG_MAIN_THREAD		"lsdbus.main_thread"
+#define REG_BUS_TABLE		"lsdbus.bus_table"
 
 #ifdef DEBUG
 # define dbg(fmt, args...) ( fprintf(stderr, "%s:%u ", __FUNCTION__, __LINE__),	\
@@ -40,9 +50,18 @@
 
 #define LSDBUS_BUS_IS_DEFAULT	0x1
 
+/* message to Lua conversion flags */
+#define LSDBUS_MSG_RAW		0x1	/* don't unpack variants */
+#define LSDBUS_MSG_AY_STRING	0x2	/* return ay as Lua string */
+#define LSDBUS_MSG_BUFFER	0x4	/* return numeric arrays as lsdbus.buffer */
+#define LSDBUS_MSG_COLUMNAR	0x8	/* return a(...) as struct of arrays */
+#define LSDBUS_MSG_LAZY		0x10	/* pass lsdbus.msg objects to callbacks */
+#define LSDBUS_MSG_AUTO_VARIANT	0x20	/* encode variants from plain Lua values */
+
 struct lsdbus_bus {
 	sd_bus *b;
 	uint32_t flags;
+	uint32_t msg_flags;	/* default LSDBUS_MSG_* flags */
 };
 
 #define LSDBUS_SLOT_TYPE_MASK		0xf	/* 4 bits for slot type */
@@ -50,23 +69,86 @@ struct lsdbus_bus {
 #define LSDBUS_SLOT_TYPE_VTAB		0x1
 #define LSDBUS_SLOT_TYPE_MATCH		0x2
 #define LSDBUS_SLOT_TYPE_ASYNC		0x3
+#define LSDBUS_SLOT_TYPE_OBJMGR		0x4
+#define LSDBUS_SLOT_TYPE_NODE_ENUM	0x5
 
 struct lsdbus_slot {
 	sd_bus_slot *slot;
 	uint32_t flags;
 	/* slot type specific data */
 	union {
-		struct sd_bus_vtable *vt;
+		struct {
+			struct sd_bus_vtable *vt;
+			struct vtab_entry *ents;
+			sd_bus_slot *getall;
+		};
 	};
 };
 
+/* received message object */
+struct lsdbus_msg {
+	sd_bus_message *m;
+	uint32_t flags;		/* LSDBUS_MSG_* flags for converting args */
+};
+
+/* compiled signature: a pre-order array of ops */
+struct lsdbus_sigop {
+	char type;		/* D-Bus type code */
+	uint16_t nchild;	/* number of direct children of containers */
+	uint16_t len;		/* number of ops of this complete type */
+	const char *contents;	/* contents signature of containers */
+};
+
+struct lsdbus_sig {
+	uint16_t nops;
+	uint16_t nargs;		/* number of complete top-level types */
+	struct lsdbus_sigop ops[];
+};
+
+/* typed buffer of fixed size basic types */
+struct lsdbus_buffer {
+	size_t len;		/* number of elements */
+	char type;		/* D-Bus type code */
+	uint8_t size;		/* size of one element */
+	_Alignas(8) uint8_t data[];
+};
+
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 sd_bus* lua_checksdbus(lua_State *L, int index);
+void lsdbus_bus_register(lua_State *L, int idx);
+int lsdbus_push_bus(lua_State *L, void *key);
+uint32_t lsdbus_msg_flags(lua_State *L, sd_bus *b);
+uint32_t lsdbus_slot_msg_flags(lua_State *L, sd_bus *b, sd_bus_slot *slot);
+void push_string_or_nil(lua_State *L, const char* s);
+int lsdbus_call_msg(lua_State *L, sd_bus *b, sd_bus_message *m, uint32_t flags, uint64_t timeout);
+int lsdbus_call_async_msg(lua_State *L, sd_bus *b, sd_bus_message *m, int cbidx, uint64_t timeout);
 
 int push_sd_bus_error(lua_State* L, const sd_bus_error* err);
-int msg_fromlua(lua_State *L, sd_bus_message *m, const char *types, int stpos);
-int msg_tolua(lua_State *L, sd_bus_message* m, int raw);
+int msg_fromlua(lua_State *L, sd_bus_message *m, const char *types, int stpos, uint32_t flags);
+int msg_fromlua_sig(lua_State *L, sd_bus_message *m, const struct lsdbus_sig *sig,
+		    int stpos, uint32_t flags);
+int msg_tolua(lua_State *L, sd_bus_message* m, uint32_t flags);
+int msg_tolua_max(lua_State *L, sd_bus_message* m, uint32_t flags, int max);
+int lsdbus_variant(lua_State *L);
+int lsdbus_tovariant(lua_State *L);
+int lsdbus_tovariant2(lua_State *L);
+
+bool bus_type_is_basic(char c);
+size_t bus_type_trivial_size(char c);
+int signature_element_length(const char *s, size_t *l);
+
+struct lsdbus_sig *sig_get(lua_State *L, int idx);
+struct lsdbus_sig *sig_getstr(lua_State *L, const char *types);
+void init_reg_sig_cache(lua_State *L);
+int lsdbus_sig_cache_stats(lua_State *L);
+
+struct lsdbus_str_cache;
+struct lsdbus_str_cache *str_cache_get(lua_State *L);
+void str_cache_push(lua_State *L, struct lsdbus_str_cache *c, int tabidx, const char *s);
+void init_reg_str_cache(lua_State *L);
+int lsdbus_str_cache_resize(lua_State *L);
+int lsdbus_str_cache_stats(lua_State *L);
 
 int evl_loop(lua_State *L);
 int evl_run(lua_State *L);
@@ -77,12 +159,18 @@ int evl_add_signal(lua_State *L);
 int evl_add_periodic(lua_State *L);
 int evl_add_io(lua_State *L);
 int evl_add_child(lua_State *L);
+int evl_add_defer(lua_State *L);
 int evl_get_fd(lua_State *L);
 
 extern const luaL_Reg lsdbus_evsrc_m [];
 extern const luaL_Reg lsdbus_slot_m [];
 
 int lsdbus_add_object_vtable(lua_State *L);
+int lsdbus_add_fallback_vtable(lua_State *L);
+int lsdbus_add_node_enumerator(lua_State *L);
+int lsdbus_add_object_manager(lua_State *L);
+int lsdbus_emit_interfaces_added(lua_State *L);
+int lsdbus_emit_interfaces_removed(lua_State *L);
 void vtable_cleanup(lua_State *L);
 int lsdbus_emit_prop_changed(lua_State *L);
 int lsdbus_emit_signal(lua_State *L);
@@ -93,9 +181,28 @@ struct lsdbus_slot* __lsdbus_slot_push(lua_State *L, sd_bus_slot *slot, uint32_t
 int lsdbus_slot_push(lua_State *L, sd_bus_slot *slot, uint32_t flags);
 void init_reg_vtab_user(lua_State *L);
 
+extern const luaL_Reg lsdbus_vtable_m [];
+int lsdbus_vtable_new(lua_State *L);
+
+extern const luaL_Reg lsdbus_reply_m [];
+int lsdbus_defer_reply(lua_State *L);
+
+extern const luaL_Reg lsdbus_msg_m [];
+int lsdbus_msg_push(lua_State *L, sd_bus_message *m, uint32_t flags);
+
+extern const luaL_Reg lsdbus_prepared_m [];
+int lsdbus_prepare(lua_State *L);
+
+extern const luaL_Reg lsdbus_buffer_m [];
+int buffer_type_is_valid(char type);
+struct lsdbus_buffer *lsdbus_buffer_push(lua_State *L, char type, size_t len);
+void buffer_setelem(lua_State *L, struct lsdbus_buffer *buf, size_t i, int idx);
+int lsdbus_buffer_new(lua_State *L);
+
 int lsdbus_xml_fromfile(lua_State *L);
 int lsdbus_xml_fromstr(lua_State *L);
 
+lua_State *lsdbus_main_thread(lua_State *L);
 void regtab_store(lua_State *L, const char* regtab, void *k, int funidx);
 int regtab_get(lua_State *L, const char* regtab, void *k);
 void regtab_clear(lua_State *L, const char* regtab, void *k);
@@ -0,0 +1,404 @@
+--
+-- Coroutine layer: sequential looking client code without blocking
+-- the event loop
+--
+-- A task is a coroutine started with co.spawn. Within a task, calls
+-- made with co.call (and the proxy methods built on it) are issued
+-- asynchronously and the task yields until the reply has arrived.
+-- The task is resumed from the reply callback, so the bus loop must
+-- be running. Outside of tasks, the calls block like bus:call.
+--
+-- co.async issues a call without waiting for it and returns a future,
+-- which can be awaited later with co.await or co.await_all. This way
+-- a task can have many calls in flight.
+--
+-- Like with bus:call, the destination of the calls can be preceded by
+-- a timeout in us.
+--
+-- A group (co.group) coalesces identical calls: while a call is in
+-- flight, the same call made via the group waits for its reply
+-- instead of making another one. Optionally, successful replies are
+-- cached for a short time. The result values are shared by all
+-- callers and must not be modified.
+--
+
+local core = require("lsdbus.core")
+local err = require("lsdbus.error")
+
+local fmt = string.format
+local unpack = table.unpack or unpack
+
+local M = {}
+
+local function pack(...) return { n = select('#', ...), ... } end
+
+-- coroutine -> task
+local tasks = setmetatable({}, { __mode = "k" })
+
+local task = {}
+task.__index = task
+
+local future = {}
+future.__index = future
+
+local group = {}
+group.__index = group
+
+--- return the task of the running coroutine or nil
+function M.current()
+   local c = coroutine.running()
+   return c and tasks[c]
+end
+
+-- resume the task t. Once it has finished, the tasks joining it are
+-- resumed. Errors of tasks nobody joins are printed to stderr.
+local function resume(t, ...)
+   local ok, e = coroutine.resume(t.co, ...)
+
+   if ok and coroutine.status(t.co) ~= 'dead' then return end
+
+   t.done = true
+   tasks[t.co] = nil
+
+   if not ok then
+      t.err = e
+      if not t.joined then
+	 io.stderr:write(fmt("lsdbus.co: task failed: %s\n", tostring(e)))
+      end
+   end
+
+   local waiters = t.waiters
+   t.waiters = nil
+   for _,w in ipairs(waiters or {}) do resume(w) end
+end
+
+local function start(joined, fun, ...)
+   assert(type(fun) == 'function', "invalid function arg: expected function")
+
+   local t = setmetatable({ done = false, joined = joined }, task)
+
+   t.co = coroutine.create(function(...) t.res = pack(fun(...)) end)
+   tasks[t.co] = t
+   resume(t, ...)
+   return t
+end
+
+--- start a new task, which runs until its first await
+-- @param fun task function
+-- @param ... arguments passed to fun
+-- @return task
+function M.spawn(fun, ...)
+   return start(false, fun, ...)
+end
+
+--- run fun as a task and run the bus loop until it has finished
+-- @return the results of fun, errors are raised
+function M.run(bus, fun, ...)
+   return start(true, fun, ...):join(bus)
+end
+
+--- wait for the task to finish and return its results
+-- Within another task, this yields. Outside of tasks, the bus loop
+-- of bus is run until the task has finished. Errors of the task are
+-- raised.
+function task:join(bus)
+   if not self.done then
+      local cur = M.current()
+      self.joined = true
+
+      if cur then
+	 self.waiters = self.waiters or {}
+	 self.waiters[#self.waiters+1] = cur
+	 coroutine.yield()
+      else
+	 assert(bus, "join: bus arg required outside of tasks")
+	 while not self.done do bus:run(1000*1000) end
+      end
+   end
+
+   if self.err then error(self.err, 0) end
+   return unpack(self.res, 1, self.res.n)
+end
+
+function task:__tostring()
+   return fmt("task <%s> %s", tostring(self.co):match("0x%x+") or "?",
+	      self.err and "failed" or self.done and "done" or "running")
+end
+
+-- complete the future f with the result ... and resume its waiters
+local function settle(f, ...)
+   f.res = pack(...)
+   f.done, f.slot = true, nil
+
+   if f.settled then f.settled(f) end
+
+   local waiters = f.waiters
+   f.waiters = nil
+   for _,w in ipairs(waiters or {}) do resume(w) end
+end
+
+-- issue an asynchronous call via send(cb) and return a future. The
+-- callback clears f.slot, which breaks the reference cycle via the
+-- slot table once the reply is there.
+local function issue(bus, send)
+   local f = setmetatable({ bus = bus, done = false }, future)
+
+   f.slot = send(function(_, ...)
+	 if select(1, ...) == '__error__' then
+	    settle(f, false, select(2, ...))
+	 else
+	    settle(f, true, ...)
+	 end
+   end)
+
+   return f
+end
+
+--- issue a method call without waiting for the reply
+-- @param bus
+-- @param dest, path, intf, member, ts, ... like bus:call
+-- @return future
+function M.async(bus, dest, path, intf, member, ts, ...)
+   local args = pack(...)
+   return issue(bus, function(cb)
+		   return bus:call_async(cb, dest, path, intf, member, ts, unpack(args, 1, args.n))
+		end)
+end
+
+--- issue a prepared call (see bus:prepare) without waiting
+-- @return future
+function M.async_prepared(bus, pc, ...)
+   local args = pack(...)
+   return issue(bus, function(cb) return pc:call_async(cb, unpack(args, 1, args.n)) end)
+end
+
+--- wait for a future
+-- @return true, results... or false, { error_name, message } like
+--         bus:call
+function M.await(f)
+   if not f.done then
+      local cur = M.current()
+
+      if cur then
+	 f.waiters = f.waiters or {}
+	 f.waiters[#f.waiters+1] = cur
+	 coroutine.yield()
+      else
+	 while not f.done do f.bus:run(1000*1000) end
+      end
+   end
+
+   return unpack(f.res, 1, f.res.n)
+end
+
+--- wait for all futures of the table futs
+-- @return table with a packed result table { ok, results... } per future
+function M.await_all(futs)
+   local res = {}
+   for i,f in ipairs(futs) do res[i] = pack(M.await(f)) end
+   return res
+end
+
+--- method call, which yields the running task until the reply has
+-- arrived. Outside of tasks, this is the same as bus:call.
+function M.call(bus, dest, path, intf, member, ts, ...)
+   if not M.current() then
+      return bus:call(dest, path, intf, member, ts, ...)
+   end
+   return M.await(M.async(bus, dest, path, intf, member, ts, ...))
+end
+
+--- cancel the call of a pending future. The reply is dropped and the
+-- future fails with NoReply. A future of a group only detaches from
+-- the shared call, which is cancelled once nobody waits for it.
+-- @return true if the call was pending
+function future:cancel()
+   if self.done then return false end
+
+   local call = self.call
+
+   if call then
+      call.followers[self] = nil
+      if next(call.followers) == nil then call:cancel() end
+   else
+      self.slot:unref()
+   end
+
+   settle(self, false, { err.NO_REPLY, "call cancelled" })
+   return true
+end
+
+function future:__tostring()
+   return fmt("future %s", self.done and (self.res[1] and "ok" or "failed") or "pending")
+end
+
+-- return a key for the call args ..., or nil if they can't be compared
+-- by value (tables, userdata)
+local function callkey(...)
+   local k = {}
+
+   for i=1,select('#', ...) do
+      local v = select(i, ...)
+      local t = type(v)
+
+      if t ~= 'string' and t ~= 'number' and t ~= 'boolean' and t ~= 'nil' then
+	 return nil
+      end
+
+      local s = tostring(v)
+      k[i] = fmt("%s%d:%s", t:sub(1, 1), #s, s)
+   end
+
+   return table.concat(k)
+end
+
+local function sweep(g, now)
+   local n = 0
+
+   for k,e in pairs(g.cache) do
+      if e.expires <= now then g.cache[k] = nil else n = n + 1 end
+   end
+
+   g.ncache, g.sweep_at = n, math.max(64, 2 * n)
+end
+
+-- return the cached result of key or nil
+local function cache_get(g, key)
+   if g.ttl <= 0 or key == nil then return nil end
+
+   local e = g.cache[key]
+
+   if e and e.expires > core.now() then
+      g.cached = g.cached + 1
+      return e.res
+   end
+end
+
+local function cache_put(g, key, res)
+   if g.ttl <= 0 or key == nil or not res[1] then return end
+
+   local now = core.now()
+   if g.ncache >= g.sweep_at then sweep(g, now) end
+   if not g.cache[key] then g.ncache = g.ncache + 1 end
+   g.cache[key] = { res = res, expires = now + g.ttl }
+end
+
+-- return a future for the call identified by key, using issue() to
+-- make the call if it is neither in flight nor cached. Each caller
+-- gets its own future, which follows the shared call.
+local function group_call(g, bus, key, issue)
+   if key == nil then
+      g.issued = g.issued + 1
+      return issue()
+   end
+
+   local res = cache_get(g, key)
+
+   if res then
+      return setmetatable({ bus = bus, done = true, res = res }, future)
+   end
+
+   local call = g.inflight[key]
+
+   if call then
+      g.coalesced = g.coalesced + 1
+   else
+      call = issue()
+      call.followers = {}
+      g.issued = g.issued + 1
+      g.inflight[key] = call
+
+      call.settled = function()
+	 g.inflight[key] = nil
+	 cache_put(g, key, call.res)
+	 for f in pairs(call.followers) do settle(f, unpack(call.res, 1, call.res.n)) end
+      end
+   end
+
+   local f = setmetatable({ bus = bus, done = false, call = call }, future)
+   call.followers[f] = true
+   return f
+end
+
+-- blocking variant of group_call for use outside of tasks: the reply
+-- may be cached, but there are no calls in flight to coalesce with
+local function group_call_sync(g, key, call)
+   local res = cache_get(g, key)
+
+   if not res then
+      g.issued = g.issued + 1
+      res = pack(call())
+      cache_put(g, key, res)
+   end
+
+   return unpack(res, 1, res.n)
+end
+
+--- create a group for coalescing identical calls
+-- @param opts optional table, opts.ttl is the time in us for which
+--        successful replies are cached (default 0: no caching)
+-- @return group
+function M.group(opts)
+   opts = opts or {}
+   assert(opts.ttl == nil or type(opts.ttl) == 'number', "invalid ttl opt")
+
+   return setmetatable({ ttl = opts.ttl or 0, inflight = {}, cache = {}, ncache = 0,
+			 sweep_at = 64, issued = 0, coalesced = 0, cached = 0 }, group)
+end
+
+--- like co.async, but return the future of an identical call in flight
+function group:async(bus, dest, path, intf, member, ts, ...)
+   local args = pack(...)
+   return group_call(self, bus, callkey(dest, path, intf, member, ts, ...),
+		     function() return M.async(bus, dest, path, intf, member, ts, unpack(args, 1, args.n)) end)
+end
+
+--- like co.async_prepared, but return the future of an identical call
+-- in flight
+function group:async_prepared(bus, pc, ...)
+   local args = pack(...)
+   local key = callkey(...)
+   return group_call(self, bus, key and tostring(pc) .. key,
+		     function() return M.async_prepared(bus, pc, unpack(args, 1, args.n)) end)
+end
+
+--- like co.call: within a task, coalesce with an identical call in
+-- flight. Outside of tasks, this is bus:call (or a cache hit).
+function group:call(bus, dest, path, intf, member, ts, ...)
+   if M.current() then
+      return M.await(self:async(bus, dest, path, intf, member, ts, ...))
+   end
+
+   local args = pack(...)
+   return group_call_sync(self, callkey(dest, path, intf, member, ts, ...),
+			  function() return bus:call(dest, path, intf, member, ts, unpack(args, 1, args.n)) end)
+end
+
+--- the same for a prepared call
+function group:call_prepared(bus, pc, ...)
+   if M.current() then
+      return M.await(self:async_prepared(bus, pc, ...))
+   end
+
+   local args = pack(...)
+   local key = callkey(...)
+   return group_call_sync(self, key and tostring(pc) .. key,
+			  function() return pc:call(unpack(args, 1, args.n)) end)
+end
+
+--- drop all cached replies
+function group:flush()
+   self.cache, self.ncache = {}, 0
+end
+
+--- return the counters of the group: calls issued, calls coalesced
+-- with one in flight and calls answered from the cache
+function group:stats()
+   return { issued = self.issued, coalesced = self.coalesced, cached = self.cached }
+end
+
+function group:__tostring()
+   return fmt("group issued: %d, coalesced: %d, cached: %d", self.issued, self.coalesced, self.cached)
+end
+
+return M
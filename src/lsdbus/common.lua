@@ -122,6 +122,31 @@ function M.signal2names(stab)
    return concat(names, '\0') .. '\0\0'
 end
 
+--- return the message flags as used by bus:call
+-- i.e. the bus flags without MSG_LAZY and MSG_AUTO_VARIANT. This is
+-- useful for callbacks that expect the same values as call returns.
+function M.call_flags(bus)
+   local flags = bus:get_msg_flags()
+   local lazy, av = lsdb.MSG_LAZY, lsdb.MSG_AUTO_VARIANT
+   if flags % (lazy * 2) >= lazy then flags = flags - lazy end
+   if flags % (av * 2) >= av then flags = flags - av end
+   return flags
+end
+
+--- return the value of the EmitsChangedSignal annotation of a property
+-- The property annotation takes precedence over the one of the
+-- interface, the default is 'true'.
+-- @param intf interface table
+-- @param name property name
+-- @return 'true', 'invalidates', 'const' or 'false'
+function M.emits_changed(intf, name)
+   local ann = 'org.freedesktop.DBus.Property.EmitsChangedSignal'
+   local ptab = intf.properties and intf.properties[name]
+
+   return (ptab and ptab.annotations and ptab.annotations[ann]) or
+      (intf.annotations and intf.annotations[ann]) or 'true'
+end
+
 function M.check_intf(intf)
    local function err(format, ...) error(fmt(format, ...)) end
 
@@ -214,6 +239,10 @@ function M.check_intf(intf)
       for n,ptab in pairs(intf.properties or {}) do check_ptab(n, ptab) end
    end
 
+   if intf.getall ~= nil and type(intf.getall) ~= 'function' then
+      err("invalid getall: expected function, got %s", type(intf.getall))
+   end
+
    -- signals
    if intf.signals ~= nil and type(intf.signals) ~= 'table' then
       err("invalid signals: expected table, got %s", type(intf.signals))
@@ -234,48 +263,12 @@ end
 --
 -- @param val value to encode
 -- @return lsdbus variant table
-function M.tovariant(val)
-   local function is_array(t)
-      for k in pairs(t) do
-	 if math.type(k) ~= 'integer' then return false end
-      end
-      return true
-   end
-
-   local typ = type(val)
-
-   if typ == 'number' then
-      if math.type(val) == 'integer' then
-	 return { 'x', val }
-      else
-	 return { 'd', val }
-      end
-   elseif typ == 'string' then
-      return { 's', val }
-   elseif typ == 'boolean' then
-      return { 'b', val }
-   elseif typ == 'table' then
-      if is_array(val) then
-	 local res = {}
-	 for i,v in pairs(val) do res[i] = M.tovariant(v) end
-	 return { 'a{iv}', res }
-      else
-	 local res = {}
-	 for k,v in pairs(val) do res[k] = M.tovariant(v) end
-	 return { 'a{sv}', res }
-      end
-   else
-      error(string.format("unsupported type %s", typ))
-   end
-end
+M.tovariant = lsdb.tovariant -- implemented in C
 
 --- encode an arbitrary Lua datastructure into a lsdb variant table
 --- but only return the actual variant table, not the typestr.
 -- This is useful to return variants from property get/set or methods
 -- where the variant typestr is already added by the server method.
-function M.tovariant2(val)
-   local r = M.tovariant(val)
-   return r[2]
-end
+M.tovariant2 = lsdb.tovariant2
 
 return M
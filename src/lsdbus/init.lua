@@ -9,6 +9,9 @@ local common = require("lsdbus.common")
 lsdbus.proxy = require("lsdbus.proxy")
 lsdbus.server = require("lsdbus.server")
 lsdbus.error = require("lsdbus.error")
+lsdbus.intfcache = require("lsdbus.intfcache")
+lsdbus.objtree = require("lsdbus.objtree")
+lsdbus.co = require("lsdbus.co")
 
 lsdbus.PropIntf = 'org.freedesktop.DBus.Properties'
 
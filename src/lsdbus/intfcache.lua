@@ -0,0 +1,233 @@
+--
+-- Interface cache: introspected interface definitions shared by all
+-- proxies of a bus
+--
+-- Interfaces are cached per bus, keyed by the unique name of the
+-- service owning the object and the interface name. The unique owner
+-- of well-known names is cached too. Both are invalidated by the
+-- NameOwnerChanged signal, which is only received while the bus loop
+-- is run.
+--
+
+local core = require("lsdbus.core")
+
+local fmt = string.format
+
+local M = {}
+
+local dbus_srv, dbus_path, dbus_if =
+   'org.freedesktop.DBus', '/org/freedesktop/DBus', 'org.freedesktop.DBus'
+
+local SNAPSHOT_VERSION = 1
+
+-- bus -> cache
+local caches = setmetatable({}, { __mode = "k" })
+
+local function name_owner_changed(c, name, old, new)
+   if new ~= "" and name:sub(1,1) ~= ':' then
+      c.owners[name] = new
+   else
+      c.owners[name] = nil
+   end
+
+   if old ~= "" and new == "" and name == old then
+      c.intfs[old] = nil
+   end
+end
+
+local function get_cache(bus)
+   local c = caches[bus]
+   if c then return c end
+
+   c = { owners = {}, intfs = {}, hits = 0, misses = 0 }
+
+   c.slot = bus:match_signal(dbus_srv, dbus_path, dbus_if, 'NameOwnerChanged',
+			     function(_, _, _, _, _, name, old, new)
+				name_owner_changed(c, name, old, new)
+			     end)
+   c.slot:set_msg_flags(0)
+   caches[bus] = c
+   return c
+end
+
+--- return the unique name of the owner of srv
+-- @param bus
+-- @param srv service name
+-- @return unique name or false, error
+function M.owner(bus, srv)
+   if srv:sub(1,1) == ':' then return srv end
+
+   local c = get_cache(bus)
+   local owner = c.owners[srv]
+
+   if owner then return owner end
+
+   local ok, res = bus:call(dbus_srv, dbus_path, dbus_if, 'GetNameOwner', 's', srv)
+   if not ok then return false, res end
+
+   c.owners[srv] = res
+   return res
+end
+
+--- lookup the interface intf of object obj of srv
+-- On a miss, obj is introspected and all its interfaces are cached.
+-- @param bus
+-- @param srv service name
+-- @param obj object path
+-- @param intf interface name
+-- A hit is keyed by the owner and intf only, so it doesn't check that
+-- obj exists or implements intf.
+-- @return interface table, nil if obj doesn't implement it or false, error
+function M.lookup(bus, srv, obj, intf)
+   local c = get_cache(bus)
+   local owner, err = M.owner(bus, srv)
+
+   if not owner then return false, err end
+
+   local intfs = c.intfs[owner]
+
+   if intfs and intfs[intf] then
+      c.hits = c.hits + 1
+      return intfs[intf]
+   end
+
+   c.misses = c.misses + 1
+
+   local ok, xml = bus:call(owner, obj, 'org.freedesktop.DBus.Introspectable', 'Introspect')
+   if not ok then return false, xml end
+
+   intfs = c.intfs[owner] or {}
+   for _,i in ipairs(core.xml_fromstr(xml).interfaces) do
+      intfs[i.name] = intfs[i.name] or i
+   end
+   c.intfs[owner] = intfs
+
+   return intfs[intf]
+end
+
+--- drop the cached interfaces of name (a service or unique name) or
+-- of all services if name is nil
+function M.invalidate(bus, name)
+   local c = get_cache(bus)
+
+   if name == nil then
+      c.owners, c.intfs = {}, {}
+      return
+   end
+
+   local owner = name:sub(1,1) == ':' and name or c.owners[name]
+   c.owners[name] = nil
+   if owner then c.intfs[owner] = nil end
+end
+
+--- drop the cache of bus and remove its NameOwnerChanged match
+-- Like all matches, it is otherwise kept until the bus is closed.
+function M.detach(bus)
+   local c = caches[bus]
+   if not c then return end
+   c.slot:unref()
+   caches[bus] = nil
+end
+
+--- return a table with the cache statistics
+function M.stats(bus)
+   local c = get_cache(bus)
+   local services, intfs = 0, 0
+
+   for _,t in pairs(c.intfs) do
+      services = services + 1
+      for _ in pairs(t) do intfs = intfs + 1 end
+   end
+
+   return { hits = c.hits, misses = c.misses, services = services, interfaces = intfs }
+end
+
+local function bus_id(bus)
+   local ok, id = bus:call(dbus_srv, dbus_path, dbus_if, 'GetId')
+   if not ok then error(fmt("GetId failed: %s", id[2])) end
+   return id
+end
+
+local function serialize(f, val, indent)
+   local t = type(val)
+
+   if t == 'string' then
+      f:write(fmt("%q", val))
+   elseif t == 'number' or t == 'boolean' then
+      f:write(tostring(val))
+   elseif t == 'table' then
+      local keys = {}
+      for k in pairs(val) do keys[#keys+1] = k end
+      table.sort(keys, function(a, b) return tostring(a) < tostring(b) end)
+
+      f:write("{\n")
+      for _,k in ipairs(keys) do
+	 f:write(indent, "  [")
+	 serialize(f, k, "")
+	 f:write("] = ")
+	 serialize(f, val[k], indent .. "  ")
+	 f:write(",\n")
+      end
+      f:write(indent, "}")
+   else
+      error(fmt("can't serialize value of type %s", t))
+   end
+end
+
+--- save a snapshot of the cached interfaces to file
+-- The snapshot is only valid for the same bus instance (bus id).
+function M.save(bus, file)
+   local c = get_cache(bus)
+   local f = assert(io.open(file, "w"))
+
+   f:write("return ")
+   serialize(f, { version = SNAPSHOT_VERSION, busid = bus_id(bus), intfs = c.intfs }, "")
+   f:write("\n")
+   f:close()
+end
+
+--- load a snapshot saved with save
+-- Interfaces of owners that have disconnected since are dropped as
+-- soon as their well-known names are resolved. Snapshots of other bus
+-- instances are ignored.
+-- @return true if loaded or false, error
+function M.load(bus, file)
+   local f, err = io.open(file, "r")
+   if not f then return false, err end
+
+   local chunk = f:read("*a")
+   f:close()
+
+   local fun, lerr
+
+   if _VERSION == "Lua 5.1" then
+      if chunk:byte(1) == 27 then return false, "invalid snapshot" end
+      fun, lerr = loadstring(chunk, "="..file)
+      if fun then setfenv(fun, {}) end
+   else
+      fun, lerr = load(chunk, "="..file, "t", {})
+   end
+
+   if not fun then return false, lerr end
+
+   local ok, snap = pcall(fun)
+   if not ok or type(snap) ~= 'table' or snap.version ~= SNAPSHOT_VERSION then
+      return false, "invalid snapshot"
+   end
+
+   if snap.busid ~= bus_id(bus) then
+      return false, "snapshot of a different bus"
+   end
+
+   local c = get_cache(bus)
+   for owner,intfs in pairs(snap.intfs) do
+      local ok2, has = bus:call(dbus_srv, dbus_path, dbus_if, 'NameHasOwner', 's', owner)
+      if ok2 and has then
+	 c.intfs[owner] = c.intfs[owner] or intfs
+      end
+   end
+
+   return true
+end
+
+return M
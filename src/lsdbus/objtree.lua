@@ -0,0 +1,289 @@
+--
+-- Object tree: client side mirror of all objects, interfaces and
+-- properties of a service
+--
+-- The tree is populated with a single GetManagedObjects call and kept
+-- up to date by the InterfacesAdded, InterfacesRemoved and
+-- PropertiesChanged signals. For services without an ObjectManager,
+-- the tree is introspected with asynchronous (i.e. concurrent)
+-- Introspect and GetAll calls, and only property changes are tracked.
+--
+
+local core = require("lsdbus.core")
+local common = require("lsdbus.common")
+
+local fmt = string.format
+
+local om_if = 'org.freedesktop.DBus.ObjectManager'
+local prop_if = 'org.freedesktop.DBus.Properties'
+local introspect_if = 'org.freedesktop.DBus.Introspectable'
+
+-- errors of GetManagedObjects that cause the fallback to introspection
+local no_objmgr = {
+   ['org.freedesktop.DBus.Error.UnknownMethod'] = true,
+   ['org.freedesktop.DBus.Error.UnknownInterface'] = true,
+   ['org.freedesktop.DBus.Error.UnknownObject'] = true,
+}
+
+local objtree = {}
+objtree.__index = objtree
+
+local function sorted_keys(t)
+   local res = {}
+   for k in pairs(t or {}) do res[#res+1] = k end
+   table.sort(res)
+   return res
+end
+
+local function add_intf(self, path, intf, props)
+   local obj = self.objects[path]
+
+   if not obj then
+      obj = {}
+      self.objects[path] = obj
+   end
+
+   obj[intf] = props
+
+   local paths = self.by_intf[intf]
+
+   if not paths then
+      paths = {}
+      self.by_intf[intf] = paths
+   end
+
+   paths[path] = true
+end
+
+local function remove_intf(self, path, intf)
+   local obj = self.objects[path]
+
+   if not obj then return end
+
+   obj[intf] = nil
+   if self.by_intf[intf] then self.by_intf[intf][path] = nil end
+
+   if next(obj) == nil then self.objects[path] = nil end
+end
+
+-- asynchronous call, the callback is called as cb(ok, res...). The
+-- reply closure must not reference the slot, which would keep it
+-- alive via the slot table.
+local function async(self, cb, path, intf, member, ts, ...)
+   local id = self._nextid
+
+   local function reply(_, ...)
+      self._pending[id] = nil
+      self.calls = self.calls + 1
+
+      if select(1, ...) == '__error__' then
+	 cb(false, select(2, ...))
+      else
+	 cb(true, ...)
+      end
+   end
+
+   local slot = self._bus:call_async(reply, self.srv, path, intf, member, ts, ...)
+   slot:set_msg_flags(self._flags)
+   self._pending[id] = slot
+   self._nextid = id + 1
+end
+
+-- fetch the readable properties of path one by one, used if GetAll
+-- fails due to a failing getter
+local function get_each(self, path, intf, props)
+   for name,ptab in pairs(props) do
+      if ptab.access ~= 'write' then
+	 async(self, function(ok, val)
+		  local obj = self.objects[path]
+		  if ok and obj and obj[intf] then obj[intf][name] = val end
+	       end, path, prop_if, 'Get', 'ss', intf, name)
+      end
+   end
+end
+
+local function introspect(self, path)
+   async(self, function(ok, xml)
+	    if not ok then return end
+
+	    local node = core.xml_fromstr(xml)
+
+	    for _,i in ipairs(node.interfaces) do
+	       add_intf(self, path, i.name, {})
+
+	       if next(i.properties) then
+		  async(self, function(ok2, props)
+			   local obj = self.objects[path]
+			   if not obj or not obj[i.name] then return end
+			   if ok2 then
+			      obj[i.name] = props
+			   else
+			      get_each(self, path, i.name, i.properties)
+			   end
+			end, path, prop_if, 'GetAll', 's', i.name)
+	       end
+	    end
+
+	    for _,sub in ipairs(node.nodes) do
+	       introspect(self, (path == '/' and '' or path) .. '/' .. sub)
+	    end
+	 end, path, introspect_if, 'Introspect')
+end
+
+local function interfaces_added(self, path, intfs)
+   for intf,props in pairs(intfs) do
+      add_intf(self, path, intf, props)
+   end
+   self.updates = self.updates + 1
+   if self._opts.added then self._opts.added(self, path, intfs) end
+end
+
+local function interfaces_removed(self, path, intfs)
+   for _,intf in ipairs(intfs) do
+      remove_intf(self, path, intf)
+   end
+   self.updates = self.updates + 1
+   if self._opts.removed then self._opts.removed(self, path, intfs) end
+end
+
+local function properties_changed(self, path, intf, changed, invalidated)
+   local obj = self.objects[path]
+   local props = obj and obj[intf]
+
+   if not props then return end
+
+   for k,v in pairs(changed) do props[k] = v end
+
+   -- invalidated values are fetched again
+   for _,k in ipairs(invalidated) do
+      props[k] = nil
+      async(self, function(ok, val)
+	       if ok and obj[intf] == props then props[k] = val end
+	    end, path, prop_if, 'Get', 'ss', intf, k)
+   end
+
+   self.updates = self.updates + 1
+   if self._opts.changed then self._opts.changed(self, path, intf, changed, invalidated) end
+end
+
+-- run the bus until all pending calls have returned
+local function wait(self)
+   while next(self._pending) do
+      self._bus:run(1000*1000)
+   end
+end
+
+--- Create a new object tree
+-- @param bus bus object
+-- @param srv service name
+-- @param root path of the ObjectManager (and root of the tree if
+--        introspected). Default: '/'
+-- @param opts optional table with the callbacks
+--        added(tree, path, intfs), removed(tree, path, intfnames) and
+--        changed(tree, path, intf, changed, invalidated)
+-- @return object tree
+function objtree.new(bus, srv, root, opts)
+   assert(type(bus)=='userdata', "missing or invalid bus arg")
+   assert(type(srv)=='string', "missing or invalid srv arg")
+
+   root = root or '/'
+   opts = opts or {}
+
+   local self = setmetatable({
+	 srv = srv, root = root, objects = {}, by_intf = {},
+	 managed = false, calls = 0, updates = 0,
+	 _bus = bus, _opts = opts, _flags = common.call_flags(bus),
+	 _pending = {}, _nextid = 1, _slots = {} }, objtree)
+
+   local function match(path, intf, member, cb)
+      local slot = bus:match_signal(srv, path, intf, member, cb)
+      slot:set_msg_flags(self._flags)
+      self._slots[#self._slots+1] = slot
+      return slot
+   end
+
+   -- subscribe first, so that no change is missed
+   match(nil, prop_if, 'PropertiesChanged',
+	 function(_, _, path, _, _, intf, changed, invalidated)
+	    properties_changed(self, path, intf, changed, invalidated)
+	 end)
+   local added = match(root, om_if, 'InterfacesAdded',
+		       function(_, _, _, _, _, path, intfs) interfaces_added(self, path, intfs) end)
+   local removed = match(root, om_if, 'InterfacesRemoved',
+			 function(_, _, _, _, _, path, intfs) interfaces_removed(self, path, intfs) end)
+
+   local ok, res = bus:call(srv, root, om_if, 'GetManagedObjects')
+   self.calls = self.calls + 1
+
+   if ok then
+      self.managed = true
+
+      for path,intfs in pairs(res) do
+	 for intf,props in pairs(intfs) do add_intf(self, path, intf, props) end
+      end
+   elseif no_objmgr[res[1]] then
+      added:unref()
+      removed:unref()
+      self._slots = { self._slots[1] }
+      introspect(self, root)
+      wait(self)
+   else
+      self:close()
+      error(fmt("GetManagedObjects on %s %s failed: %s: %s", srv, root, res[1], res[2]))
+   end
+
+   return self
+end
+
+--- return the properties of an interface of an object or the value
+-- of a single property if prop is given
+-- @param path object path
+-- @param intf interface name
+-- @param prop optional property name
+function objtree:get(path, intf, prop)
+   local obj = self.objects[path]
+   local props = obj and obj[intf]
+
+   if prop == nil or props == nil then return props end
+   return props[prop]
+end
+
+--- return the sorted paths of all objects or of the objects
+-- implementing intf
+function objtree:paths(intf)
+   if intf == nil then return sorted_keys(self.objects) end
+   return sorted_keys(self.by_intf[intf])
+end
+
+--- return the sorted interface names of the object at path
+function objtree:interfaces(path)
+   return sorted_keys(self.objects[path])
+end
+
+--- return a table with statistics of the tree
+function objtree:stats()
+   local objects, intfs = 0, 0
+
+   for _,obj in pairs(self.objects) do
+      objects = objects + 1
+      for _ in pairs(obj) do intfs = intfs + 1 end
+   end
+
+   return { objects = objects, interfaces = intfs, calls = self.calls,
+	    updates = self.updates, managed = self.managed }
+end
+
+--- stop tracking changes and remove the signal matches
+function objtree:close()
+   for _,slot in ipairs(self._slots) do slot:unref() end
+   for _,slot in pairs(self._pending) do slot:unref() end
+   self._slots, self._pending = {}, {}
+end
+
+function objtree:__tostring()
+   local st = self:stats()
+   return fmt("objtree <%s %s> %i objects, %i interfaces (%s)", self.srv, self.root,
+	      st.objects, st.interfaces, self.managed and "managed" or "introspected")
+end
+
+return objtree
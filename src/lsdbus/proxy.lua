@@ -5,8 +5,11 @@
 local core = require("lsdbus.core")
 local err = require("lsdbus.error")
 local common = require("lsdbus.common")
+local intfcache = require("lsdbus.intfcache")
+local co = require("lsdbus.co")
 
 local met2its, met2ots = common.met2its, common.met2ots
+local call_flags = common.call_flags
 local fmt = string.format
 local unpack = table.unpack or unpack
 
@@ -14,13 +17,9 @@ local prop_if = 'org.freedesktop.DBus.Properties'
 local peer_if = 'org.freedesktop.DBus.Peer'
 local introspect_if = 'org.freedesktop.DBus.Introspectable'
 
-local function encode_variant(t, v)
-   if t == "a{sv}" or t == "a{iv}" or t == "av" then
-      return common.tovariant2(v)
-   elseif t == "v" then
-      return common.tovariant(v)
-   end
-   return v
+-- message flags for calls with automatic variant encoding
+local function av_flags(bus)
+   return call_flags(bus) + core.MSG_AUTO_VARIANT
 end
 
 local proxy = {}
@@ -53,47 +52,148 @@ function proxy:error(err_, msg)
    error(fmt("%s: %s (%s, %s, %s)", err_, msg or "-", self._srv, self._obj, self._intf.name))
 end
 
+-- raise an error for a failed xcall, return the results otherwise
+local function xcall_ret(self, m, ts, ok, ...)
+   if not ok then
+      local e = ...
+      self:error(e[1], fmt("calling %s(%s) failed: %s", m, ts, e[2]))
+   end
+   return ...
+end
+
 -- lowlevel plumbing method
 function proxy:xcall(i, m, ts, ...)
-   local ret = { self._bus:call(self._srv, self._obj, i, m, ts, ...) }
-   if not ret[1] then
-      self:error(ret[2][1], fmt("calling %s(%s) failed: %s", m, ts, ret[2][2]))
+   return xcall_ret(self, m, ts, co.call(self._bus, self._timeout, self._srv, self._obj, i, m, ts, ...))
+end
+
+-- like xcall for reading properties, which are coalesced if enabled
+local function xcall_read(self, i, m, ts, ...)
+   if not self._group then return self:xcall(i, m, ts, ...) end
+   return xcall_ret(self, m, ts, self._group:call(self._bus, self._timeout, self._srv,
+						 self._obj, i, m, ts, ...))
+end
+
+-- method stubs: the signature and the argument and result names of
+-- each method are precomputed by proxy.new and the prepared call is
+-- created on first use.
+local function compile_stub(mtab)
+   local st = { its = met2its(mtab), innames = {}, outnames = {} }
+
+   for _,a in ipairs(mtab) do
+      if a.direction == 'out' then
+	 st.outnames[#st.outnames+1] = a.name or false
+      else
+	 st.innames[#st.innames+1] = a.name or false
+      end
    end
-   return unpack(ret, 2)
+
+   st.nin, st.nout = #st.innames, #st.outnames
+   return st
 end
 
-function proxy:call(m, ...)
-   local mtab = self._intf.methods[m]
-   if not mtab then
-      self:error(err.UNKNOWN_METHOD, fmt("call: no method %s", m))
+local function stub(self, m, what)
+   local st = self._stubs[m]
+
+   if not st then
+      local mtab = self._intf.methods[m]
+      if not mtab then
+	 self:error(err.UNKNOWN_METHOD, fmt("%s: no method %s", what, m))
+      end
+      st = compile_stub(mtab)
+      self._stubs[m] = st
    end
-   local its = met2its(mtab)
-   return self:xcall(self._intf.name, m, its, ...)
+
+   if not st.pc then
+      st.pc = self._bus:prepare(self._srv, self._obj, self._intf.name, m, st.its, self._timeout)
+   end
+
+   return st
 end
 
-function proxy:__call(m, ...) return self:call(m, ...) end
+-- call the prepared call of the stub. Within a task (see lsdbus.co),
+-- the call is issued asynchronously and the task yields. Coalesced
+-- methods go through the group.
+local function stub_call(self, m, st, ...)
+   if self._coalesce[m] then
+      return self._group:call_prepared(self._bus, st.pc, ...)
+   elseif co.current() then
+      return co.await(co.async_prepared(self._bus, st.pc, ...))
+   end
+   return st.pc:call(...)
+end
 
-function proxy:callr(m, ...)
-   local mtab = self._intf.methods[m]
-   if not mtab then
-      self:error(err.UNKNOWN_METHOD, fmt("callr: no method %s", m))
+-- raise an error for failed calls, return the results otherwise
+local function check_ret(self, what, m, st, ok, ...)
+   if not ok then
+      local e = ...
+      self:error(e[1], fmt("%s %s(%s) failed: %s", what, m, st.its, e[2]))
    end
-   local its = met2its(mtab)
+   return ...
+end
 
-   local ret = { self._bus:callr(self._srv, self._obj, self._intf.name, m, its, ...) }
-   if not ret[1] then
-      self:error(ret[2][1], fmt("callr %s(%s) failed: %s", m, its, ret[2][2]))
+-- return the values of argtab in the order of the in-args
+local function getargs(self, m, st, argtab, i)
+   if i > st.nin then return end
+
+   local name = st.innames[i]
+   if not name then
+      self:error(err.INVALID_ARGS, fmt("callt: unnamed in-arg %i of method %s", i, m))
    end
-   return unpack(ret, 2)
+
+   local v = argtab[name]
+   if v == nil then
+      self:error(err.INVALID_ARGS, fmt("callt: argument %s missing", name))
+   end
+
+   return v, getargs(self, m, st, argtab, i + 1)
+end
+
+-- store the results into restab by the names of the out-args
+local function setres(self, m, st, restab, i, v, ...)
+   if i > st.nout then return restab end
+
+   local name = st.outnames[i]
+   if not name then
+      self:error(err.INVALID_ARGS, fmt("callt: unnamed out-arg %i of method %s", i, m))
+   end
+   if v == nil then
+      self:error(err.INVALID_ARGS, fmt("callt: result %i '%s' missing", i, name))
+   end
+
+   restab[name] = v
+   return setres(self, m, st, restab, i + 1, ...)
+end
+
+function proxy:call(m, ...)
+   local st = stub(self, m, "call")
+   return check_ret(self, "calling", m, st, stub_call(self, m, st, ...))
+end
+
+function proxy:__call(m, ...) return self:call(m, ...) end
+
+function proxy:callr(m, ...)
+   local st = stub(self, m, "callr")
+   return check_ret(self, "callr", m, st, st.pc:callr(...))
+end
+
+-- call with explicit message conversion flags (lsdbus.MSG_*)
+function proxy:callf(flags, m, ...)
+   local st = stub(self, m, "callf")
+   return check_ret(self, "callf", m, st, st.pc:callf(flags, ...))
 end
 
 function proxy:call_async(m, cb, ...)
-   local mtab = self._intf.methods[m]
-   if not mtab then
-      self:error(err.UNKNOWN_METHOD, fmt("call_async: no method %s", m))
+   local st = stub(self, m, "call_async")
+   return st.pc:call_async(cb, ...)
+end
+
+-- issue a call without waiting, returns a future (see lsdbus.co)
+function proxy:async(m, ...)
+   local st = stub(self, m, "async")
+   if self._coalesce[m] then
+      return self._group:async_prepared(self._bus, st.pc, ...)
    end
-   local its = met2its(mtab)
-   return self._bus:call_async(cb, self._srv, self._obj, self._intf.name, m, its, ...)
+   return co.async_prepared(self._bus, st.pc, ...)
 end
 
 -- call with argument table
@@ -101,25 +201,14 @@ end
 -- @param argtab argument table
 -- @param av automatically encode variants if true
 function proxy:callt(m, argtab, av)
-   local mtab = self._intf.methods[m]
-   local args = {}
+   local st = stub(self, m, "callt")
    argtab = argtab or {}
 
-   if not mtab then
-      self:error(err.UNKNOWN_METHOD, fmt("callt: no method %s", m))
-   end
-   for _,a in ipairs(mtab) do
-      if a.direction ~= 'out' then
-	 if not a.name then
-	    self:error(err.INVALID_ARGS, fmt("callt: unnamed in-arg %i of method %s", #args+1, m))
-	 end
-	 if argtab[a.name] == nil then
-	    self:error(err.INVALID_ARGS, fmt("callt: argument %s missing", a.name))
-	 end
-	 args[#args+1] = av and encode_variant(a.type, argtab[a.name]) or argtab[a.name]
-      end
+   if av then
+      return check_ret(self, "callf", m, st,
+		       st.pc:callf(av_flags(self._bus), getargs(self, m, st, argtab, 1)))
    end
-   return self:xcall(self._intf.name, m, met2its(mtab), unpack(args))
+   return check_ret(self, "calling", m, st, stub_call(self, m, st, getargs(self, m, st, argtab, 1)))
 end
 
 -- like callt, but return results as a table too
@@ -128,37 +217,90 @@ end
 -- @param argtab
 -- @param av automatically encode variants
 function proxy:calltt(m, argtab, av)
-   local res = { self:callt(m, argtab, av) }
+   local st = stub(self, m, "callt")
 
-   local mtab = self._intf.methods[m]
-   local restab = {}
-   local rescnt = 0
-
-   for _,a in ipairs(mtab) do
-      if a.direction == 'out' then
-	 rescnt = rescnt + 1
-	 if not a.name then
-	    self:error(err.INVALID_ARGS, fmt("callt: unnamed out-arg %i of method %s", rescnt, m))
-	 end
-	 if res[rescnt] == nil then
-	    self:error(err.INVALID_ARGS, fmt("callt: result %i '%s' missing", rescnt, a.name))
-	 end
-	 restab[a.name] = res[rescnt]
-      end
+   if st.nout == 0 then
+      self:callt(m, argtab, av)
+      return nil
    end
 
-   return (rescnt > 0) and restab or nil
+   return setres(self, m, st, {}, 1, self:callt(m, argtab, av))
 end
 
 function proxy:callttAV(m, argtab)
    return self:calltt(m, argtab, true)
 end
 
+-- property mirror (opts.mirror): the values of the properties are
+-- seeded with GetAll and updated by PropertiesChanged, so that reads
+-- of valid values are served locally. Invalidated values are fetched
+-- again on the next read. Properties annotated with
+-- EmitsChangedSignal=false are never mirrored.
+local function mirror_store(mir, props)
+   for k,v in pairs(props) do
+      if mir.emits[k] and mir.emits[k] ~= 'false' then
+	 mir.values[k], mir.valid[k] = v, true
+      end
+   end
+end
+
+local function mirror_new(o)
+   local intf = o._intf
+   local mir = { values={}, valid={}, emits={},
+		 hits=0, misses=0, updates=0, invalidations=0 }
+
+   for k in pairs(intf.properties) do
+      mir.emits[k] = common.emits_changed(intf, k)
+   end
+
+   local function changed(_, _, _, _, _, i, props, invalidated)
+      if i ~= intf.name then return end
+      for _ in pairs(props) do mir.updates = mir.updates + 1 end
+      mirror_store(mir, props)
+      for _,k in ipairs(invalidated) do
+	 mir.values[k], mir.valid[k] = nil, nil
+	 mir.invalidations = mir.invalidations + 1
+      end
+   end
+
+   -- subscribe first, so that no change after GetAll is missed
+   mir.slot = o._bus:match_signal(o._srv, o._obj, prop_if, 'PropertiesChanged', changed)
+   mir.slot:set_msg_flags(call_flags(o._bus))
+   o._mirror = mir
+
+   -- GetAll fails if any getter fails, the values are then fetched
+   -- on their first read
+   local ok, props = o._bus:call(o._timeout, o._srv, o._obj, prop_if, 'GetAll', 's', intf.name)
+   if ok then mirror_store(mir, props) end
+end
+
+local function mirror_invalidate(self, k)
+   local mir = self._mirror
+   if mir then mir.values[k], mir.valid[k] = nil, nil end
+   -- cached replies may be stale now
+   if self._group then self._group:flush() end
+end
+
 function proxy:Get(k)
    if not self._intf.properties[k] then
       self:error(err.UNKOWN_PROPERTY, fmt("Get: unknown property %s", k))
    end
-   return self:xcall(prop_if, 'Get', 'ss', self._intf.name, k)
+
+   local mir = self._mirror
+
+   if mir and mir.emits[k] ~= 'false' then
+      if mir.valid[k] then
+	 mir.hits = mir.hits + 1
+	 return mir.values[k]
+      end
+
+      mir.misses = mir.misses + 1
+      local v = xcall_read(self, prop_if, 'Get', 'ss', self._intf.name, k)
+      mir.values[k], mir.valid[k] = v, true
+      return v
+   end
+
+   return xcall_read(self, prop_if, 'Get', 'ss', self._intf.name, k)
 end
 
 function proxy:Set(k, ...)
@@ -166,6 +308,7 @@ function proxy:Set(k, ...)
       self:error(err.UNKOWN_PROPERTY, fmt("Set: unknown property %s", k))
    end
 
+   mirror_invalidate(self, k)
    return self:xcall(prop_if, 'Set', 'ssv', self._intf.name, k, { self._intf.properties[k].type, ... })
 end
 
@@ -176,14 +319,20 @@ function proxy:SetAV(k, value)
       self:error(err.UNKOWN_PROPERTY, fmt("Set: unknown property %s", k))
    end
 
-   value = encode_variant(ptab.type, value)
-
-   return self:xcall(prop_if, 'Set', 'ssv', self._intf.name, k, { self._intf.properties[k].type, value })
+   mirror_invalidate(self, k)
+   local ret = { self._bus:callf(av_flags(self._bus), self._timeout, self._srv, self._obj, prop_if, 'Set', 'ssv',
+				 self._intf.name, k, core.variant(ptab.type, value)) }
+   if not ret[1] then
+      self:error(ret[2][1], fmt("calling Set(ssv) failed: %s", ret[2][2]))
+   end
+   return unpack(ret, 2)
 end
 
 
 function proxy:GetAll(filter)
-   local p = self:xcall(prop_if, 'GetAll', 's', self._intf.name)
+   local p = xcall_read(self, prop_if, 'GetAll', 's', self._intf.name)
+
+   if self._mirror then mirror_store(self._mirror, p) end
 
    if filter == nil then
       return p
@@ -219,7 +368,7 @@ function proxy:SetAll(t)
 end
 
 function proxy:Ping()
-   return self._bus:call(self._srv, self._obj, peer_if, 'Ping')
+   return self._bus:call(self._timeout, self._srv, self._obj, peer_if, 'Ping')
 end
 
 function proxy:HasProperty(p)
@@ -234,6 +383,26 @@ function proxy:HasSignal(s)
    if self._intf.signals[s] then return true else return false end
 end
 
+--- return the property mirror statistics or nil if not mirrored
+function proxy:mirror_stats()
+   local mir = self._mirror
+   if not mir then return end
+   return { hits=mir.hits, misses=mir.misses, updates=mir.updates,
+	    invalidations=mir.invalidations }
+end
+
+--- return the counters of call coalescing or nil if not enabled
+function proxy:coalesce_stats()
+   if self._group then return self._group:stats() end
+end
+
+--- stop mirroring the properties and remove the signal match
+function proxy:mirror_close()
+   if not self._mirror then return end
+   self._mirror.slot:unref()
+   self._mirror = false
+end
+
 function proxy:__newindex(k, v) self:Set(k, v) end
 
 function proxy:__index(k) return proxy[k] or proxy.Get(self, k) end
@@ -268,8 +437,23 @@ local function proxy_introspect(o)
    return core.xml_fromstr(xml)
 end
 
+--- Create a new proxy
+-- String interfaces are looked up in the interface cache (unless
+-- opts.cache is false). A cache hit doesn't check that obj exists and
+-- implements intf, calls fail then instead.
 function proxy.new(bus, srv, obj, intf, opts)
    local function introspect(o)
+      if opts.cache ~= false then
+	 local i, e = intfcache.lookup(bus, srv, obj, intf)
+	 if i then
+	    o._intf = i
+	    return
+	 elseif i == false then
+	    o:error(e[1], fmt("introspection failed: %s", e[2]))
+	 end
+	 o:error(err.UNKNOWN_INTERFACE, "no such interface")
+      end
+
       local node = proxy_introspect(o)
       for _,i in ipairs(node.interfaces) do
 	 if i.name == intf then
@@ -287,9 +471,12 @@ function proxy.new(bus, srv, obj, intf, opts)
    assert(type(srv)=='string', "missing or invalid srv arg")
    assert(type(obj)=='string', "missing or invalid obj arg")
    assert(type(opts)=='table', "invalid opts arg")
+   assert(opts.timeout==nil or type(opts.timeout)=='number', "invalid timeout opt")
+   assert(opts.coalesce==nil or type(opts.coalesce)=='table', "invalid coalesce opt")
    assert(intf~=nil, "missing intf arg")
 
-   local o = { _bus=bus, _srv=srv, _obj=obj, _intf=intf, _error=opts.error }
+   local o = { _bus=bus, _srv=srv, _obj=obj, _intf=intf, _error=opts.error, _stubs={}, _mirror=false,
+	       _timeout=opts.timeout or 0, _coalesce={}, _group=false }
    setmetatable(o, proxy)
 
    if type(intf) == 'string' then
@@ -305,6 +492,18 @@ function proxy.new(bus, srv, obj, intf, opts)
    o._intf.properties = o._intf.properties or {}
    o._intf.signals = o._intf.signals or {}
 
+   for m,mtab in pairs(o._intf.methods) do
+      o._stubs[m] = compile_stub(mtab)
+   end
+
+   -- coalescing of property reads and of the methods in opts.coalesce
+   if opts.coalesce then
+      o._group = co.group{ ttl=opts.ttl }
+      for _,m in ipairs(opts.coalesce) do o._coalesce[m] = true end
+   end
+
+   if opts.mirror then mirror_new(o) end
+
    return o
 end
 
@@ -1,4 +1,5 @@
 
+local core = require("lsdbus.core")
 local common = require("lsdbus.common")
 
 local fmt = string.format
@@ -59,7 +60,7 @@ local function intf_to_vtab(intf, errh, dest)
    for n,p in pairs(intf.properties or {}) do
       local get = p.get and g(p.get, errh, { type='property-get', name=n, obj=p }) or nil
       local set = p.set and g(p.set, errh, { type='property-set', name=n, obj=p }) or nil
-      props[n] = { access=p.access, type=p.type, get=get, set=set }
+      props[n] = { access=p.access, type=p.type, get=get, set=set, annotations=p.annotations }
    end
 
    local signals = {}
@@ -68,6 +69,8 @@ local function intf_to_vtab(intf, errh, dest)
    end
 
    dest.name = intf.name
+   dest.msg_flags = intf.msg_flags
+   dest.getall = intf.getall and g(intf.getall, errh, { type='getall', name=intf.name, obj=intf }) or nil
    dest.methods = methods
    dest.properties = props
    dest.signals = signals
@@ -75,35 +78,183 @@ local function intf_to_vtab(intf, errh, dest)
    return dest
 end
 
+--
+-- ObjectManager support
+--
+-- Objects registered below a path with an object manager are
+-- announced with InterfacesAdded and InterfacesRemoved. Interfaces
+-- added or removed within one loop iteration are batched into one
+-- signal per object, which is emitted by a defer event source in the
+-- next iteration (or by srv.flush).
+--
+
+-- bus -> { slots = { path -> slot }, defer = evsrc,
+--          added = { path -> { intf... } }, removed = { path -> { intf... } } }
+local objmgrs = setmetatable({}, { __mode = "k" })
+
+local function managed(om, path)
+   for p in pairs(om.slots) do
+      if p == '/' or path == p or path:sub(1, #p + 1) == p .. '/' then
+	 return true
+      end
+   end
+   return false
+end
+
+local function remove_value(t, v)
+   for i,x in ipairs(t or {}) do
+      if x == v then
+	 table.remove(t, i)
+	 return true
+      end
+   end
+   return false
+end
+
+local function queue(bus, which, path, intf)
+   local om = objmgrs[bus]
+
+   if not om or not managed(om, path) then return end
+
+   -- an interface added and removed again within one iteration is
+   -- not announced at all
+   if which == 'removed' and remove_value(om.added[path], intf) then return end
+
+   local q = om[which][path]
+
+   if not q then
+      q = {}
+      om[which][path] = q
+   end
+
+   q[#q+1] = intf
+   om.defer:set_enabled(core.SD_EVENT_ONESHOT)
+end
+
+--- emit the pending InterfacesRemoved and InterfacesAdded signals of bus
+function srv.flush(bus)
+   local om = objmgrs[bus]
+
+   if not om then return end
+
+   local added, removed = om.added, om.removed
+   local errs = {}
+
+   om.added, om.removed = {}, {}
+
+   -- emitting InterfacesAdded fails if a property getter fails
+   local function emit(fun, path, intfs)
+      if #intfs == 0 then return end
+      local ok, e = pcall(fun, bus, path, unpack(intfs))
+      if not ok then errs[#errs+1] = fmt("%s: %s", path, e) end
+   end
+
+   for path,intfs in pairs(removed) do emit(bus.emit_interfaces_removed, path, intfs) end
+   for path,intfs in pairs(added) do emit(bus.emit_interfaces_added, path, intfs) end
+
+   if #errs > 0 then error(table.concat(errs, "; ")) end
+end
+
+--- add an ObjectManager at path
+-- Server objects created below path are announced with
+-- InterfacesAdded and InterfacesRemoved.
+-- @param bus bus object
+-- @param path object path
+-- @return slot of the object manager
+function srv.add_object_manager(bus, path)
+   local om = objmgrs[bus]
+
+   if not om then
+      om = { slots = {}, added = {}, removed = {} }
+      om.defer = bus:add_defer(srv.flush, false)
+      objmgrs[bus] = om
+   end
+
+   local slot = bus:add_object_manager(path)
+   om.slots[path] = slot
+   return slot
+end
+
+--- remove the ObjectManager at path
+function srv.remove_object_manager(bus, path)
+   local om = objmgrs[bus]
+   local slot = om and om.slots[path]
+
+   if not slot then return end
+
+   srv.flush(bus)
+   slot:unref()
+   om.slots[path] = nil
+
+   if next(om.slots) == nil then
+      om.defer:unref()
+      objmgrs[bus] = nil
+   end
+end
+
+local compiled_mt = {}
+
+function compiled_mt:__tostring()
+   return fmt("compiled interface %s", self.intf.name)
+end
+
+--- Compile an interface to be shared by many objects
+-- @param intf interface table
+-- @param errh error handler
+-- @return compiled interface, which can be passed to server.new
+-- instead of the interface table. The interface table must not be
+-- modified afterwards.
+function srv.compile(intf, errh)
+   assert(type(intf)=='table', "missing or invalid interface arg")
+
+   local vt = intf_to_vtab(intf, errh)
+   return setmetatable({ intf=intf, vt=vt, cvt=core.vtable(vt) }, compiled_mt)
+end
+
 --- Low level constructor, populate self as new server object
 function srv:initialize(bus, path, intf, errh)
    assert(type(bus)=='userdata', "missing or invalid bus arg")
    assert(type(path)=='string', "missing or invalid path arg")
    assert(type(intf)=='table', "missing or invalid interface arg")
 
-   self._vt = intf_to_vtab(intf, errh, self)
-   self._slot = bus:add_object_vtable(path, self._vt)
+   if getmetatable(intf) == compiled_mt then
+      assert(errh == nil, "errh must be passed to server.compile")
+      local vt = intf.vt
+
+      self._vt = vt
+      self.name, self.msg_flags = vt.name, vt.msg_flags
+      self.methods, self.properties, self.signals = vt.methods, vt.properties, vt.signals
+      self._slot = bus:add_object_vtable(path, intf.cvt, self)
+      intf = intf.intf
+   else
+      self._vt = intf_to_vtab(intf, errh, self)
+      self._slot = bus:add_object_vtable(path, self._vt)
+   end
+
    self._bus, self._path, self._intf = bus, path, intf
+   queue(bus, 'added', path, intf.name)
 end
 
 -- Create a new server object
 -- @param bus bus object
 -- @param path path under which to provide this interface
--- @param intf interface table
+-- @param intf interface table or compiled interface (see srv.compile)
 -- @param errh error handler
 --
 -- if the errh function is present, the method, property get and set
 -- handlers are invoked using pcall. In case of error, errh is called
 -- passing the original error, a backtrace and a context table of the
 -- form `{ type=TYPE, name=MEMBER_NAME and obj=MEMBER_TABLE }`, where
--- TYPE is one of "propery-set", "property-get", "method"
+-- TYPE is one of "propery-set", "property-get", "method", "getall"
 --
 -- if no error handler is present, the error will propagate to the
 -- lsdbus core, where it will is caught and printed to stderr.
+local srv_mt = { __index=srv }
+
 function srv.new(bus, path, intf, errh)
    local o = {}
    srv.initialize(o, bus, path, intf, errh)
-   return setmetatable(o, { __index=srv })
+   return setmetatable(o, srv_mt)
 end
 
 -- direct method handler invocation without vt arg
@@ -153,6 +304,7 @@ end
 -- remove vtab and invalidate the object
 function srv:unref()
    self._slot:unref()
+   queue(self._bus, 'removed', self._path, self.name)
    setmetatable(self, nil)
 end
 
@@ -177,11 +329,75 @@ function srv:emitAllPropertiesChanged(filter)
    end
 
    for p,pt in pairs(self._intf.properties or {}) do
-      if pt.access ~= 'write' then
+      local emits = common.emits_changed(self._intf, p)
+      if pt.access ~= 'write' and emits ~= 'const' and emits ~= 'false' then
 	 if pred(p, pt) then props[#props+1] = p end
       end
    end
    self:emitPropertiesChanged(unpack(props))
 end
 
+--
+-- Fallback objects
+--
+-- A fallback object serves an interface for all objects at and below
+-- a prefix with a single vtable. The handlers are passed the object
+-- returned by find(path) instead of the server object, so objects can
+-- be materialized on demand.
+--
+local fallback = {}
+fallback.__index = fallback
+
+--- Create a new fallback object
+-- @param bus bus object
+-- @param prefix path at and below which to provide this interface
+-- @param intf interface table
+-- @param find function(path, intfname) returning the object passed to
+--        the handlers or nil if there is no such object
+-- @param enumerate optional function(prefix) returning a table with
+--        the paths of the objects below prefix (for introspection
+--        and GetManagedObjects)
+-- @param errh error handler, see srv.new
+function srv.fallback(bus, prefix, intf, find, enumerate, errh)
+   assert(type(bus)=='userdata', "missing or invalid bus arg")
+   assert(type(prefix)=='string', "missing or invalid prefix arg")
+   assert(type(intf)=='table', "missing or invalid interface arg")
+   assert(type(find)=='function', "missing or invalid find arg")
+
+   local o = setmetatable({ _bus=bus, _path=prefix, _intf=intf, name=intf.name }, fallback)
+
+   o._vt = intf_to_vtab(intf, errh)
+   o._slot = bus:add_fallback_vtable(prefix, o._vt, find)
+
+   if enumerate then
+      o._enum_slot = bus:add_node_enumerator(prefix, enumerate)
+   end
+
+   return o
+end
+
+--- emit a signal of the interface from the object at path
+function fallback:emit(path, signal, ...)
+   local sigtab = self._vt.signals[signal]
+   if not sigtab then
+      error(fmt("no signal '%s' on interface %s", signal, self.name))
+   end
+   self._bus:emit_signal(path, self.name, signal, sigtab.sig, ...)
+end
+
+function fallback:emitPropertiesChanged(path, ...)
+   self._bus:emit_properties_changed(path, self.name, ...)
+end
+
+function fallback:get_interface()
+   return self._intf
+end
+
+-- remove the vtable and the node enumerator
+function fallback:unref()
+   self._slot:unref()
+   if self._enum_slot then self._enum_slot:unref() end
+   setmetatable(self, nil)
+end
+
 return srv
@@ -1,85 +1,5 @@
 #include "lsdbus.h"
 
-/**
- * table_explode - unpack the table at src onto the top of the stack
- *
- * @param L
- * @pos relative or absolute stack position of table to unpack
- * @ctx	context to print in case of error
- * @return number of elements unpacked or -1 in case of error.
-
- * The table is removed from the given stackpos. In the error case, a
- * string with the error message is pushed on top of the stack.
- */
-static int table_explode(lua_State *L, int pos, const char *ctx)
-{
-	int len, type, top;
-
-	pos = lua_absindex(L, pos);
-	type = lua_type(L, pos);
-	top = lua_gettop(L);
-
-	if (type != LUA_TTABLE) {
-		lua_pushfstring(
-			L, "msg_fromlua: error at %s: arg %d not a table but %s",
-			ctx, pos, lua_typename(L, type));
-		return -1;
-	}
-
-	lua_len(L, pos);
-	len = lua_tointeger(L, -1);
-	lua_pop(L, 1);
-
-	lua_checkstack(L, top+len);
-
-	for (int i=1; i<=len; i++) {
-		lua_geti(L, pos, i);
-		dbg("pushed %s value to pos %i", lua_typename(L, lua_type(L, -1)), pos+i-2);
-	}
-
-	lua_remove(L, pos);
-	return len;
-}
-
-/**
- * dict_explode - unpack the table at src onto the top of the stack
- *
- * this function is identical to the one above except that the table
- * is traversed as a dictionary (pairs) instead of as an array
- * (ipairs). The function returns the sum of keys and values pushed
- * onto the stack.
- */
-static int dict_explode(lua_State *L, int pos, const char *ctx)
-{
-	int len=0, type, top;
-
-	pos = lua_absindex(L, pos);
-	type = lua_type(L, pos);
-	top = lua_gettop(L);
-
-	if (type != LUA_TTABLE) {
-		lua_pushfstring(
-			L, "msg_fromlua: error at %s: arg %d not a table but %s",
-			ctx, pos, lua_typename(L, type));
-		return -1;
-	}
-
-	lua_pushnil(L);  /* first key */
-	while (lua_next(L, pos) != 0) {
-		lua_checkstack(L, top+len*2);
-
-		dbg("pushed %s - %s to pos %i",
-		    lua_typename(L, lua_type(L, -2)),
-		    lua_typename(L, lua_type(L, -1)), pos+len-1);
-		/* duplicate key to top for next iteration */
-		lua_pushvalue(L, -2);
-		len++;
-	}
-
-	lua_remove(L, pos);
-	return len*2;
-}
-
 int push_sd_bus_error(lua_State* L, const sd_bus_error* err)
 {
 	if (!err)
@@ -97,73 +17,6 @@ int push_sd_bus_error(lua_State* L, const sd_bus_error* err)
  */
 #define BUS_CONTAINER_DEPTH 128
 
-#include <stdbool.h>
-
-#define ELEMENTSOF(x)                                                   \
-        (__builtin_choose_expr(                                         \
-                !__builtin_types_compatible_p(typeof(x), typeof(&*(x))), \
-                sizeof(x)/sizeof((x)[0]),                               \
-                (void)0))
-
-#define assert_return(expr, r) do { } while (0)
-
-typedef struct {
-        const char *types;
-        unsigned n_struct;
-        unsigned n_array;
-	int stackpos;
-} TypeStack;
-
-static int type_stack_push(TypeStack *stack,
-			   unsigned max,
-			   unsigned *i,
-			   const char *types,
-			   unsigned n_struct,
-			   unsigned n_array,
-			   int stackpos) {
-        assert(stack);
-        assert(max > 0);
-
-        if (*i >= max)
-                return -EINVAL;
-
-        stack[*i].types = types;
-        stack[*i].n_struct = n_struct;
-        stack[*i].n_array = n_array;
-	stack[*i].stackpos = stackpos;
-        (*i)++;
-
-        return 0;
-}
-
-static int type_stack_pop(TypeStack *stack,
-			  unsigned max,
-			  unsigned *i,
-			  const char **types,
-			  unsigned *n_struct,
-			  unsigned *n_array,
-			  int *stackpos) {
-	(void) max;
-
-        assert(stack);
-        assert(max > 0);
-        assert(types);
-        assert(n_struct);
-        assert(n_array);
-        assert(stackpos);
-
-        if (*i <= 0)
-                return 0;
-
-        (*i)--;
-        *types = stack[*i].types;
-        *n_struct = stack[*i].n_struct;
-        *n_array = stack[*i].n_array;
-	*stackpos = stack[*i].stackpos;
-
-        return 1;
-}
-
 bool bus_type_is_basic(char c) {
         static const char valid[] = {
                 SD_BUS_TYPE_BYTE,
@@ -184,6 +37,17 @@ bool bus_type_is_basic(char c) {
         return !!memchr(valid, c, sizeof(valid));
 }
 
+static bool bus_type_is_container(char c) {
+        static const char valid[] = {
+                SD_BUS_TYPE_ARRAY,
+                SD_BUS_TYPE_VARIANT,
+                SD_BUS_TYPE_STRUCT,
+                SD_BUS_TYPE_DICT_ENTRY
+        };
+
+        return !!memchr(valid, c, sizeof(valid));
+}
+
 static int signature_element_length_internal(
                 const char *s,
                 bool allow_dict_entry,
@@ -278,527 +142,1352 @@ int signature_element_length(const char *s, size_t *l) {
         return signature_element_length_internal(s, true, 0, 0, l);
 }
 
-/**
- * msg_fromlua
- *
- * @param L
- * @param m message to fill with Lua data
- * @types dbus type string
- * @stpos stack position where message data starts
- *
- * All arguments are popped from the stack.
- *
- * @return 0 if OK, <0 if not. In case of error, an error message is
- * pushed to the top of the stack.
+/*
+ * return the wire size of fixed size basic types which can be read
+ * (and except for booleans appended) in one step with
+ * sd_bus_message_read_array and sd_bus_message_append_array, or 0 if
+ * type isn't one.
  */
-int msg_fromlua(lua_State *L, sd_bus_message *m, const char *types, int stpos)
+size_t bus_type_trivial_size(char c)
 {
-        unsigned n_array, n_struct;
-        TypeStack stack[BUS_CONTAINER_DEPTH];
-        unsigned stack_ptr = 0;
-        int r;
+	switch (c) {
+	case SD_BUS_TYPE_BYTE:
+		return 1;
+	case SD_BUS_TYPE_INT16:
+	case SD_BUS_TYPE_UINT16:
+		return 2;
+	case SD_BUS_TYPE_BOOLEAN:
+	case SD_BUS_TYPE_INT32:
+	case SD_BUS_TYPE_UINT32:
+		return 4;
+	case SD_BUS_TYPE_INT64:
+	case SD_BUS_TYPE_UINT64:
+	case SD_BUS_TYPE_DOUBLE:
+		return 8;
+	default:
+		return 0;
+	}
+}
 
-        assert_return(m, -EINVAL);
-        assert_return(types, -EINVAL);
-        assert_return(!m->sealed, -EPERM);
-        assert_return(!m->poisoned, -ESTALE);
+/*
+ * true if the table at idx can be accessed raw, i.e. has no
+ * metatable or one of the lsdbus ones without metamethods.
+ */
+static int table_is_raw(lua_State *L, int idx)
+{
+	int ret;
 
-        n_array = (unsigned) -1;
-        n_struct = strlen(types);
+	if (!lua_getmetatable(L, idx))
+		return 1;
 
-        for (;;) {
-                const char *t;
+	luaL_getmetatable(L, ARRAY_MT);
+	ret = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return ret;
+}
 
-                if (n_array == 0 || (n_array == (unsigned) -1 && n_struct == 0)) {
-                        r = type_stack_pop(stack, ELEMENTSOF(stack), &stack_ptr, &types, &n_struct, &n_array, &stpos);
-                        if (r < 0) {
-				lua_pushfstring(L, "invalid type string %s, no container to close", types);
-                                return r;
-			}
-                        if (r == 0)
-                                break;
+static int append_value(lua_State *L, sd_bus_message *m,
+			const struct lsdbus_sigop *op, int idx, unsigned depth, uint32_t flags);
 
-                        r = sd_bus_message_close_container(m);
-			dbg("sd_bus_message_close_container");
-                        if (r < 0) {
-				lua_pushfstring(L, "failed to close container %s", strerror(-r));
-                                return r;
-			}
+static int check_table(lua_State *L, const struct lsdbus_sigop *op, int idx, int type)
+{
+	if (type == LUA_TTABLE)
+		return 0;
+
+	if (op->type == SD_BUS_TYPE_ARRAY)
+		lua_pushfstring(L, "msg_fromlua: error at a%s: arg %d not a table but %s",
+				op->contents, idx, lua_typename(L, type));
+	else
+		lua_pushfstring(L, "msg_fromlua: error at (%s): arg %d not a table but %s",
+				op->contents, idx, lua_typename(L, type));
+	return -1;
+}
 
-                        continue;
-                }
+#define FILL_ARRAY(ctype, conv, what)					\
+	for (size_t i=0; i<n; i++) {					\
+		int ok;							\
+		lua_rawgeti(L, idx, i + 1);				\
+		((ctype*) p)[i] = (ctype) conv(L, -1, &ok);		\
+		if (!ok) {						\
+			lua_pushfstring(L, "failed to convert a%s[%d] (" what " expected, got %s)", \
+					op->contents, (int) i + 1,	\
+					lua_typename(L, lua_type(L, -1))); \
+			return -1;					\
+		}							\
+		lua_pop(L, 1);						\
+	}
 
-                t = types;
-                if (n_array != (unsigned) -1)
-                        n_array--;
-                else {
-                        types++;
-                        n_struct--;
-                }
+/*
+ * append an array of fixed size basic types with one
+ * sd_bus_message_append_array_space call and fill it directly
+ */
+static int append_trivial_array(lua_State *L, sd_bus_message *m,
+				const struct lsdbus_sigop *op, int idx, size_t size)
+{
+	int r;
+	void *p;
+	size_t n = lua_rawlen(L, idx);
+
+	r = sd_bus_message_append_array_space(m, op->contents[0], n * size, &p);
+	if (r < 0) {
+		lua_pushfstring(L, "failed to append array a%s: %s",
+				op->contents, strerror(-r));
+		return r;
+	}
 
-                switch (*t) {
+	dbg("appending trivial array a%s of size %zu", op->contents, n);
+
+	switch (op->contents[0]) {
+	case SD_BUS_TYPE_BYTE:
+		FILL_ARRAY(uint8_t, lua_tointegerx, "integer"); break;
+	case SD_BUS_TYPE_INT16:
+	case SD_BUS_TYPE_UINT16:
+		FILL_ARRAY(uint16_t, lua_tointegerx, "integer"); break;
+	case SD_BUS_TYPE_INT32:
+	case SD_BUS_TYPE_UINT32:
+		FILL_ARRAY(uint32_t, lua_tointegerx, "integer"); break;
+	case SD_BUS_TYPE_INT64:
+	case SD_BUS_TYPE_UINT64:
+		FILL_ARRAY(uint64_t, lua_tointegerx, "integer"); break;
+	case SD_BUS_TYPE_DOUBLE:
+		FILL_ARRAY(double, lua_tonumberx, "number"); break;
+	}
 
-                case SD_BUS_TYPE_BYTE: {
-			uint8_t x;
-			int ok;
-			x = lua_tointegerx(L, stpos, &ok);
-			if (!ok) {
-				lua_pushfstring(L, "failed to convert arg #%d (integer expected, got %s)",
-						stpos, lua_typename(L, lua_type(L, stpos)));
-				return -1;
-			}
-			dbg("append BYTE %c", x);
-			r = sd_bus_message_append_basic(m, *t, &x);
-			lua_remove(L, stpos);
-			break;
-                }
+	return 0;
+}
 
-                case SD_BUS_TYPE_BOOLEAN: {
-			int type = lua_type(L, stpos);
-			if (type != LUA_TBOOLEAN) {
-				lua_pushfstring(L, "bad argument #%d (boolean expected, got %s)",
-						stpos, lua_typename(L, type));
-				return -1;
-			}
-			int x = lua_toboolean(L, stpos);
-			dbg("append bool %i", x);
-			r = sd_bus_message_append_basic(m, *t, &x);
-			lua_remove(L, stpos);
-                        break;
-		}
+/* append the Lua string at idx as ay in one step */
+static int append_byte_string(lua_State *L, sd_bus_message *m, int idx)
+{
+	int r;
+	size_t len;
+	const char *s = lua_tolstring(L, idx, &len);
+
+	r = sd_bus_message_append_array(m, SD_BUS_TYPE_BYTE, s, len);
+	if (r < 0) {
+		lua_pushfstring(L, "failed to append array ay: %s", strerror(-r));
+		return r;
+	}
+
+	return 0;
+}
+
+/* append a lsdbus.buffer of matching type in one step */
+static int append_buffer(lua_State *L, sd_bus_message *m,
+			 const struct lsdbus_sigop *op, int idx)
+{
+	int r;
+	struct lsdbus_buffer *buf = luaL_testudata(L, idx, BUFFER_MT);
+
+	if (buf == NULL || op->contents[0] != buf->type || op->contents[1] != '\0') {
+		lua_pushfstring(L, "msg_fromlua: error at a%s: arg %d not a table or matching buffer",
+				op->contents, idx);
+		return -1;
+	}
+
+	r = sd_bus_message_append_array(m, buf->type, buf->data, buf->len * buf->size);
+	if (r < 0) {
+		lua_pushfstring(L, "failed to append array a%s: %s",
+				op->contents, strerror(-r));
+		return r;
+	}
+
+	return 0;
+}
+
+static int append_array(lua_State *L, sd_bus_message *m,
+			const struct lsdbus_sigop *op, int idx, unsigned depth, uint32_t flags)
+{
+	int r;
+	lua_Integer len;
+	const struct lsdbus_sigop *elem = op + 1;
+
+	size_t size = bus_type_trivial_size(elem->type);
+
+	if (elem->type == SD_BUS_TYPE_BYTE && lua_type(L, idx) == LUA_TSTRING)
+		return append_byte_string(L, m, idx);
+
+	if (lua_type(L, idx) == LUA_TUSERDATA)
+		return append_buffer(L, m, op, idx);
 
-                case SD_BUS_TYPE_INT32:
-                case SD_BUS_TYPE_UINT32:
-                case SD_BUS_TYPE_UNIX_FD: {
-                        uint32_t x;
-			int ok;
+	if (check_table(L, op, idx, lua_type(L, idx)) < 0)
+		return -1;
 
-			static_assert(sizeof(int32_t) == sizeof(int), "int != int32_t");
+	/* sd-bus doesn't support appending boolean arrays in one go */
+	if (size > 0 && elem->type != SD_BUS_TYPE_BOOLEAN && table_is_raw(L, idx))
+		return append_trivial_array(L, m, op, idx, size);
 
-			x = lua_tointegerx(L, stpos, &ok);
+	r = sd_bus_message_open_container(m, SD_BUS_TYPE_ARRAY, op->contents);
+	if (r < 0) {
+		lua_pushfstring(L, "failed to open array container for a%s: %s",
+				op->contents, strerror(-r));
+		return r;
+	}
 
-			if (!ok) {
-				lua_pushfstring(L, "failed to convert arg #%d (integer expected, got %s)",
-						stpos, lua_typename(L, lua_type(L, stpos)));
-				return -1;
+	if (elem->type == SD_BUS_TYPE_DICT_ENTRY_BEGIN) {
+		lua_pushnil(L);
+		while (lua_next(L, idx) != 0) {			/* key, val */
+			r = sd_bus_message_open_container(m, SD_BUS_TYPE_DICT_ENTRY, elem->contents);
+			if (r < 0) {
+				lua_pushfstring(L, "failed to open dict container for {%s}: %s",
+						elem->contents, strerror(-r));
+				return r;
 			}
 
-			dbg("append uint/int/fd %u", x);
-			r = sd_bus_message_append_basic(m, *t, &x);
-			lua_remove(L, stpos);
-                        break;
-                }
+			/* convert a copy to not disturb lua_next */
+			lua_pushvalue(L, -2);			/* key, val, key */
+			r = append_value(L, m, elem + 1, lua_gettop(L), depth + 1, flags);
+			if (r < 0)
+				return r;
+			lua_pop(L, 1);				/* key, val */
 
-                case SD_BUS_TYPE_INT16:
-                case SD_BUS_TYPE_UINT16: {
-			int ok;
-                        uint16_t x;
-			x = lua_tointegerx(L, stpos, &ok);
+			r = append_value(L, m, elem + 2, lua_gettop(L), depth + 1, flags);
+			if (r < 0)
+				return r;
+			lua_pop(L, 1);				/* key */
 
-			if (!ok) {
-				lua_pushfstring(L, "failed to convert arg #%d (integer expected, got %s)",
-						stpos, lua_typename(L, lua_type(L, stpos)));
-				return -1;
+			r = sd_bus_message_close_container(m);
+			if (r < 0) {
+				lua_pushfstring(L, "failed to close container %s", strerror(-r));
+				return r;
 			}
+		}
+	} else {
+		lua_len(L, idx);
+		len = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+
+		dbg("appending array a%s of size %lld", op->contents, len);
+
+		for (lua_Integer i=1; i<=len; i++) {
+			lua_geti(L, idx, i);
+			r = append_value(L, m, elem, lua_gettop(L), depth + 1, flags);
+			if (r < 0)
+				return r;
+			lua_pop(L, 1);
+		}
+	}
 
-			dbg("append UINT16 %u", x);
-                        r = sd_bus_message_append_basic(m, *t, &x);
-			lua_remove(L, stpos);
-                        break;
-                }
+	r = sd_bus_message_close_container(m);
+	if (r < 0) {
+		lua_pushfstring(L, "failed to close container %s", strerror(-r));
+		return r;
+	}
 
-                case SD_BUS_TYPE_INT64:
-                case SD_BUS_TYPE_UINT64: {
-			int ok;
-                        uint64_t x;
+	return 0;
+}
 
-			x = lua_tointegerx(L, stpos, &ok);
+static int append_struct(lua_State *L, sd_bus_message *m,
+			 const struct lsdbus_sigop *op, int idx, unsigned depth, uint32_t flags)
+{
+	int r;
+	const struct lsdbus_sigop *child = op + 1;
 
-			if (!ok) {
-				lua_pushfstring(L, "failed to convert arg #%d (integer expected, got %s)",
-						stpos, lua_typename(L, lua_type(L, stpos)));
-				return -1;
-			}
+	if (op->type == SD_BUS_TYPE_STRUCT_BEGIN && check_table(L, op, idx, lua_type(L, idx)) < 0)
+		return -1;
 
-                        dbg("append UINT64 %lu", x);
-                        r = sd_bus_message_append_basic(m, *t, &x);
-			lua_remove(L, stpos);
-                        break;
-                }
+	r = sd_bus_message_open_container(
+		m, op->type == SD_BUS_TYPE_STRUCT_BEGIN ? SD_BUS_TYPE_STRUCT : SD_BUS_TYPE_DICT_ENTRY,
+		op->contents);
 
-                case SD_BUS_TYPE_DOUBLE: {
-			int ok;
-                        double x;
+	if (r < 0) {
+		lua_pushfstring(L, "failed to open %s container for %s: %s",
+				op->type == SD_BUS_TYPE_STRUCT_BEGIN ? "struct" : "dict",
+				op->contents, strerror(-r));
+		return r;
+	}
 
-			x = lua_tonumberx(L, stpos, &ok);
+	for (unsigned i=1; i<=op->nchild; i++) {
+		lua_geti(L, idx, i);
+		r = append_value(L, m, child, lua_gettop(L), depth + 1, flags);
+		if (r < 0)
+			return r;
+		lua_pop(L, 1);
+		child += child->len;
+	}
 
-			if (!ok) {
-				lua_pushfstring(L, "failed to convert arg #%d (number expected, got %s)",
-						stpos, lua_typename(L, lua_type(L, stpos)));
-				return -1;
-			}
+	r = sd_bus_message_close_container(m);
+	if (r < 0) {
+		lua_pushfstring(L, "failed to close container %s", strerror(-r));
+		return r;
+	}
 
-			dbg("append DOUBLE %f", x);
-                        r = sd_bus_message_append_basic(m, *t, &x);
-			lua_remove(L, stpos);
-                        break;
-                }
+	return 0;
+}
 
-                case SD_BUS_TYPE_STRING:
-                case SD_BUS_TYPE_OBJECT_PATH:
-                case SD_BUS_TYPE_SIGNATURE: {
-			const char *x = lua_tolstring(L, stpos, NULL);
+static int append_variant(lua_State *L, sd_bus_message *m, int idx, unsigned depth, uint32_t flags)
+{
+	int r, ltype;
+	lua_Integer len;
+	const char *s;
+	const struct lsdbus_sig *sig;
 
-			if (x == NULL) {
-				lua_pushfstring(L, "bad argument #%d (string expected, got %s)",
-						stpos, lua_typename(L, lua_type(L, stpos)));
-				return -1;
-			}
+	ltype = lua_type(L, idx);
 
-			dbg("append string %s", x);
-                        r = sd_bus_message_append_basic(m, *t, x);
-			lua_remove(L, stpos);
-                        break;
-                }
+	if (ltype != LUA_TTABLE) {
+		lua_pushfstring(L, "invalid type %s of arg %d, expected table",
+				lua_typename(L,	ltype),	idx);
+		return -EINVAL;
+	}
 
-                case SD_BUS_TYPE_ARRAY: {
-                        size_t k;
+	lua_len(L, idx);
+	len = lua_tointeger(L, -1);
+	lua_pop(L, 1);
 
-                        r = signature_element_length(t + 1, &k);
-                        if (r < 0) {
-				lua_pushfstring(L, "invalid array type string %s", t);
-                                return r;
-			}
-                        {
-                                char s[k + 1];
-                                memcpy(s, t + 1, k);
-                                s[k] = 0;
-
-                                r = sd_bus_message_open_container(m, SD_BUS_TYPE_ARRAY, s);
-                                if (r < 0) {
-					lua_pushfstring(L, "failed to open array container for %s: %s",
-							t, strerror(-r));
-                                        return r;
-				}
-                        }
-
-                        if (n_array == (unsigned) -1) {
-                                types += k;
-                                n_struct -= k;
-                        }
-
-                        r = type_stack_push(stack, ELEMENTSOF(stack), &stack_ptr, types, n_struct, n_array, stpos);
-                        if (r < 0) {
-				lua_pushfstring(L, "container depth %u exceeded", BUS_CONTAINER_DEPTH);
-                                return r;
-			}
+	if (len != 2) {
+		lua_pushfstring(L, "invalid table at stpos %d", idx);
+		return -EINVAL;
+	}
 
-                        types = t + 1;
-                        n_struct = k;
+	lua_geti(L, idx, 1);					/* types */
+	s = lua_tostring(L, -1);
 
-			/* first array param is size of array */
-                        /* n_array = va_arg(ap, unsigned); */
+	if (s == NULL) {
+		lua_pushfstring(L, "invalid variant type of arg %d (string expected, got %s)",
+				idx, lua_typename(L, lua_type(L, -1)));
+		return -EINVAL;
+	}
 
-			if(t[1] == SD_BUS_TYPE_DICT_ENTRY_BEGIN) {
-				r = dict_explode(L, stpos, types-1);
-				n_array = r/2;
+	sig = sig_get(L, -1);					/* types, sig */
+	if (sig == NULL)
+		return -EINVAL;
 
-			} else {
-				r = table_explode(L, stpos, types-1);
-				n_array = r;
-			}
+	dbg("pushing variant of type %s", s);
 
-			if (r<0)
-				return r; /* error msg pushed by _explode function */
+	r = sd_bus_message_open_container(m, SD_BUS_TYPE_VARIANT, s);
+	if (r < 0 || sig->nargs != 1) {
+		lua_pushfstring(L, "failed to open variant container for typestr '%s': %s",
+				s, strerror(r < 0 ? -r : EINVAL));
+		return r < 0 ? r : -EINVAL;
+	}
 
-			dbg("appending container %c of size %u", t[1], n_array);
+	lua_geti(L, idx, 2);					/* types, sig, val */
+	r = append_value(L, m, &sig->ops[0], lua_gettop(L), depth + 1, flags);
+	if (r < 0)
+		return r;
+	lua_pop(L, 3);
 
-			stpos =	lua_absindex(L,	-r);
-                        break;
-                }
+	r = sd_bus_message_close_container(m);
+	if (r < 0) {
+		lua_pushfstring(L, "failed to close container %s", strerror(-r));
+		return r;
+	}
 
-                case SD_BUS_TYPE_VARIANT: {
-			const char* s="v";
+	return 0;
+}
 
-			int ltype = lua_type(L, stpos);
+/* true if all keys of the table at idx are integers */
+static bool table_is_array(lua_State *L, int idx)
+{
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		lua_pop(L, 1);
+		if (!lua_isinteger(L, -1)) {
+			lua_pop(L, 1);
+			return false;
+		}
+	}
+	return true;
+}
 
-			if (ltype != LUA_TTABLE) {
-				lua_pushfstring(L, "invalid type %s of arg %d, expected table",
-						lua_typename(L,	ltype),	stpos);
-				return -EINVAL;
-			}
+static int append_auto_variant(lua_State *L, sd_bus_message *m, int idx, unsigned depth);
+
+/* true if the table at idx is a lsdbus.variant {types, value} table */
+static bool table_is_variant(lua_State *L, int idx)
+{
+	bool ret;
 
-			r = table_explode(L, stpos, s);
+	if (!lua_getmetatable(L, idx))
+		return false;
 
-			if (r != 2) {
-				lua_pushfstring(L, "invalid table at stpos %d", stpos);
+	luaL_getmetatable(L, VARIANT_MT);
+	ret = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return ret;
+}
+
+/* append the table at idx as a{iv} or a{sv} variant */
+static int append_auto_dict(lua_State *L, sd_bus_message *m, int idx, unsigned depth)
+{
+	int r;
+	bool is_array = table_is_array(L, idx);
+	const char *types = is_array ? "a{iv}" : "a{sv}";
+
+	r = sd_bus_message_open_container(m, SD_BUS_TYPE_VARIANT, types);
+	if (r < 0)
+		goto fail_open;
+
+	r = sd_bus_message_open_container(m, SD_BUS_TYPE_ARRAY, types + 1);
+	if (r < 0)
+		goto fail_open;
+
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {				/* key, val */
+		r = sd_bus_message_open_container(m, SD_BUS_TYPE_DICT_ENTRY, is_array ? "iv" : "sv");
+		if (r < 0)
+			goto fail_open;
+
+		if (is_array) {
+			int32_t i = lua_tointeger(L, -2);
+			r = sd_bus_message_append_basic(m, SD_BUS_TYPE_INT32, &i);
+		} else {
+			/* convert a copy to not disturb lua_next */
+			lua_pushvalue(L, -2);			/* key, val, key */
+			const char *k = lua_tostring(L, -1);
+
+			if (k == NULL) {
+				lua_pushfstring(L, "invalid key type %s in variant a{sv}",
+						luaL_typename(L, -1));
 				return -EINVAL;
 			}
+			r = sd_bus_message_append_basic(m, SD_BUS_TYPE_STRING, k);
+			lua_pop(L, 1);				/* key, val */
+		}
 
-			s = luaL_checkstring(L, -2);
-			lua_remove(L, -2);
+		if (r < 0) {
+			lua_pushfstring(L, "failed to append key of %s: %s", types, strerror(-r));
+			return r;
+		}
 
-			dbg("pushing variant of type %s", s);
+		r = append_auto_variant(L, m, lua_gettop(L), depth + 1);
+		if (r < 0)
+			return r;
+		lua_pop(L, 1);					/* key */
 
-                        r = sd_bus_message_open_container(m, SD_BUS_TYPE_VARIANT, s);
-                        if (r < 0) {
-				lua_pushfstring(L, "failed to open variant container for typestr '%s', val: %s: %s", s, t, strerror(-r));
-                                return r;
-			}
+		r = sd_bus_message_close_container(m);
+		if (r < 0)
+			goto fail_close;
+	}
 
-                        r = type_stack_push(stack, ELEMENTSOF(stack), &stack_ptr, types, n_struct, n_array, stpos);
-                        if (r < 0) {
-				lua_pushfstring(L, "container depth %u exceeded", BUS_CONTAINER_DEPTH);
-                                return r;
-			}
+	r = sd_bus_message_close_container(m);
+	if (r < 0)
+		goto fail_close;
 
-			types = s;
-			n_struct = strlen(s);
-			n_array = (unsigned) -1;
-			stpos =	lua_absindex(L,	-1);
-			dbg("appending variant %s of size %u", types, n_struct);
+	r = sd_bus_message_close_container(m);
+	if (r < 0)
+		goto fail_close;
 
-                        break;
-                }
+	return 0;
 
-                case SD_BUS_TYPE_STRUCT_BEGIN:
-                case SD_BUS_TYPE_DICT_ENTRY_BEGIN: {
-                        size_t k;
+fail_open:
+	lua_pushfstring(L, "failed to open container for variant %s: %s", types, strerror(-r));
+	return r;
+fail_close:
+	lua_pushfstring(L, "failed to close container %s", strerror(-r));
+	return r;
+}
 
-                        r = signature_element_length(t, &k);
-                        if (r < 0) {
-				lua_pushfstring(L, "invalid %s type string %s",
-						*t == SD_BUS_TYPE_STRUCT_BEGIN ? "struct" : "dict", t);
-                                return r;
-			}
+/*
+ * append the plain Lua value at idx as a variant (LSDBUS_MSG_AUTO_VARIANT).
+ * The type is inferred like lsdbus.tovariant does: integers as x,
+ * other numbers as d, strings as s, booleans as b, tables with only
+ * integer keys as a{iv} and other tables as a{sv}. Tables with the
+ * lsdbus.variant metatable are appended with their explicit type.
+ */
+static int append_auto_variant(lua_State *L, sd_bus_message *m, int idx, unsigned depth)
+{
+	int r;
+	char type;
+
+	union {
+		int64_t s64;
+		double d64;
+		int i;
+		const char *string;
+	} basic;
+
+	if (depth >= BUS_CONTAINER_DEPTH || !lua_checkstack(L, 4)) {
+		lua_pushfstring(L, "container depth %d exceeded", BUS_CONTAINER_DEPTH);
+		return -EINVAL;
+	}
 
-                        {
-                                char s[k - 1];
+	switch (lua_type(L, idx)) {
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, idx)) {
+			type = SD_BUS_TYPE_INT64;
+			basic.s64 = lua_tointeger(L, idx);
+		} else {
+			type = SD_BUS_TYPE_DOUBLE;
+			basic.d64 = lua_tonumber(L, idx);
+		}
+		break;
+	case LUA_TSTRING:
+		type = SD_BUS_TYPE_STRING;
+		basic.string = lua_tostring(L, idx);
+		break;
+	case LUA_TBOOLEAN:
+		type = SD_BUS_TYPE_BOOLEAN;
+		basic.i = lua_toboolean(L, idx);
+		break;
+	case LUA_TTABLE:
+		if (table_is_variant(L, idx))
+			return append_variant(L, m, idx, depth, LSDBUS_MSG_AUTO_VARIANT);
+		return append_auto_dict(L, m, idx, depth);
+	default:
+		lua_pushfstring(L, "unsupported type %s of arg %d for variant",
+				luaL_typename(L, idx), idx);
+		return -EINVAL;
+	}
 
-                                memcpy(s, t + 1, k - 2);
-                                s[k - 2] = 0;
+	char types[2] = { type, '\0' };
 
-                                r = sd_bus_message_open_container(m, *t == SD_BUS_TYPE_STRUCT_BEGIN ? SD_BUS_TYPE_STRUCT : SD_BUS_TYPE_DICT_ENTRY, s);
-                                if (r < 0) {
-					lua_pushfstring(L, "failed to open %s container for %s: %s",
-							*t == SD_BUS_TYPE_STRUCT_BEGIN ? "struct" : "dict",
-							t, strerror(-r));
+	r = sd_bus_message_open_container(m, SD_BUS_TYPE_VARIANT, types);
+	if (r >= 0)
+		r = sd_bus_message_append_basic(m, type, type == SD_BUS_TYPE_STRING ?
+						(const void*) basic.string : &basic);
+	if (r >= 0)
+		r = sd_bus_message_close_container(m);
 
-                                        return r;
-				}
-                        }
+	if (r < 0) {
+		lua_pushfstring(L, "failed to append variant %c: %s", type, strerror(-r));
+		return r;
+	}
 
-                        if (n_array == (unsigned) -1) {
-                                types += k - 1;
-                                n_struct -= k - 1;
-                        }
+	return 0;
+}
 
-                        r = type_stack_push(stack, ELEMENTSOF(stack), &stack_ptr, types, n_struct, n_array, stpos);
-                        if (r < 0) {
-				lua_pushfstring(L, "container depth %u exceeded", BUS_CONTAINER_DEPTH);
-                                return r;
-			}
+/*
+ * append the value at absolute stack index idx of the complete type
+ * op to the message.
+ */
+static int append_value(lua_State *L, sd_bus_message *m,
+			const struct lsdbus_sigop *op, int idx, unsigned depth, uint32_t flags)
+{
+	int r, ok;
+
+	union {
+		uint8_t u8;
+		uint16_t u16;
+		uint32_t u32;
+		uint64_t u64;
+		double d64;
+		int i;
+	} basic;
+
+	if (depth >= BUS_CONTAINER_DEPTH || !lua_checkstack(L, 4)) {
+		lua_pushfstring(L, "container depth %d exceeded", BUS_CONTAINER_DEPTH);
+		return -EINVAL;
+	}
 
-                        types = t + 1;
-                        n_struct = k - 2;
-                        n_array = (unsigned) -1;
-
-			dbg("struct: %c", *t);
-			if (*t == SD_BUS_TYPE_STRUCT_BEGIN) {
-				r = table_explode(L, stpos, t);
-				if (r<0) {
-					return r;
-				}
-				stpos =	lua_absindex(L,	-r);
-			}
+	switch (op->type) {
+	case SD_BUS_TYPE_BYTE:
+		basic.u8 = lua_tointegerx(L, idx, &ok);
+		goto check_integer;
+
+	case SD_BUS_TYPE_INT16:
+	case SD_BUS_TYPE_UINT16:
+		basic.u16 = lua_tointegerx(L, idx, &ok);
+		goto check_integer;
+
+	case SD_BUS_TYPE_INT32:
+	case SD_BUS_TYPE_UINT32:
+	case SD_BUS_TYPE_UNIX_FD:
+		static_assert(sizeof(int32_t) == sizeof(int), "int != int32_t");
+		basic.u32 = lua_tointegerx(L, idx, &ok);
+		goto check_integer;
+
+	case SD_BUS_TYPE_INT64:
+	case SD_BUS_TYPE_UINT64:
+		basic.u64 = lua_tointegerx(L, idx, &ok);
+
+	check_integer:
+		if (!ok) {
+			lua_pushfstring(L, "failed to convert arg #%d (integer expected, got %s)",
+					idx, lua_typename(L, lua_type(L, idx)));
+			return -1;
+		}
+		break;
 
-                        break;
-                }
+	case SD_BUS_TYPE_DOUBLE:
+		basic.d64 = lua_tonumberx(L, idx, &ok);
 
-                default:
-			lua_pushfstring(L, "invalid or unexpected typestring '%c'", *t);
-                        r = -EINVAL;
-                }
+		if (!ok) {
+			lua_pushfstring(L, "failed to convert arg #%d (number expected, got %s)",
+					idx, lua_typename(L, lua_type(L, idx)));
+			return -1;
+		}
+		break;
+
+	case SD_BUS_TYPE_BOOLEAN: {
+		int type = lua_type(L, idx);
+		if (type != LUA_TBOOLEAN) {
+			lua_pushfstring(L, "bad argument #%d (boolean expected, got %s)",
+					idx, lua_typename(L, type));
+			return -1;
+		}
+		basic.i = lua_toboolean(L, idx);
+		break;
+	}
 
-                if (r < 0)
-                        return r;
-        }
+	case SD_BUS_TYPE_STRING:
+	case SD_BUS_TYPE_OBJECT_PATH:
+	case SD_BUS_TYPE_SIGNATURE: {
+		const char *x = lua_tolstring(L, idx, NULL);
+
+		if (x == NULL) {
+			lua_pushfstring(L, "bad argument #%d (string expected, got %s)",
+					idx, lua_typename(L, lua_type(L, idx)));
+			return -1;
+		}
+
+		dbg("append string %s", x);
+		r = sd_bus_message_append_basic(m, op->type, x);
+		goto check_append;
+	}
+
+	case SD_BUS_TYPE_ARRAY:
+		return append_array(L, m, op, idx, depth, flags);
+
+	case SD_BUS_TYPE_STRUCT_BEGIN:
+	case SD_BUS_TYPE_DICT_ENTRY_BEGIN:
+		return append_struct(L, m, op, idx, depth, flags);
+
+	case SD_BUS_TYPE_VARIANT:
+		if (flags & LSDBUS_MSG_AUTO_VARIANT)
+			return append_auto_variant(L, m, idx, depth);
+		return append_variant(L, m, idx, depth, flags);
+
+	default:
+		lua_pushfstring(L, "invalid or unexpected typestring '%c'", op->type);
+		return -EINVAL;
+	}
+
+	r = sd_bus_message_append_basic(m, op->type, &basic);
+
+check_append:
+	if (r < 0) {
+		lua_pushfstring(L, "failed to append %c: %s", op->type, strerror(-r));
+		return r;
+	}
+
+	return 0;
+}
 
+/*
+ * push an error message for the missing argument idx of type op
+ */
+static int missing_arg(lua_State *L, const struct lsdbus_sigop *op, int idx)
+{
+	switch (op->type) {
+	case SD_BUS_TYPE_ARRAY:
+	case SD_BUS_TYPE_STRUCT_BEGIN:
+		return check_table(L, op, idx, LUA_TNONE);
+	case SD_BUS_TYPE_VARIANT:
+		lua_pushfstring(L, "invalid type no value of arg %d, expected table", idx);
+		return -EINVAL;
+	case SD_BUS_TYPE_BOOLEAN:
+		lua_pushfstring(L, "bad argument #%d (boolean expected, got no value)", idx);
+		return -1;
+	case SD_BUS_TYPE_STRING:
+	case SD_BUS_TYPE_OBJECT_PATH:
+	case SD_BUS_TYPE_SIGNATURE:
+		lua_pushfstring(L, "bad argument #%d (string expected, got no value)", idx);
+		return -1;
+	default:
+		lua_pushfstring(L, "failed to convert arg #%d (%s expected, got no value)", idx,
+				op->type == SD_BUS_TYPE_DOUBLE ? "number" : "integer");
+		return -1;
+	}
+}
+
+static int __msg_fromlua(lua_State *L, sd_bus_message *m,
+			 const struct lsdbus_sig *sig, int stpos, int last, uint32_t flags)
+{
+	int r;
+	const struct lsdbus_sigop *op = sig->ops;
+
+	for (int i=0; i<sig->nargs; i++) {
+		if (stpos + i > last)
+			return missing_arg(L, op, stpos + i);
+
+		r = append_value(L, m, op, stpos + i, 0, flags);
+		if (r < 0)
+			return r;
+		op += op->len;
+	}
+
+	return 0;
+}
+
+/**
+ * msg_fromlua_sig
+ *
+ * @param L
+ * @param m message to fill with Lua data
+ * @sig compiled dbus type string
+ * @stpos stack position where message data starts
+ * @flags LSDBUS_MSG_* flags (only LSDBUS_MSG_AUTO_VARIANT is used)
+ *
+ * The arguments are left on the stack.
+ *
+ * @return 0 if OK, <0 if not. In case of error, an error message is
+ * pushed to the top of the stack.
+ */
+int msg_fromlua_sig(lua_State *L, sd_bus_message *m, const struct lsdbus_sig *sig,
+		    int stpos, uint32_t flags)
+{
+	return __msg_fromlua(L, m, sig, lua_absindex(L, stpos), lua_gettop(L), flags);
+}
+
+/**
+ * msg_fromlua
+ *
+ * @param L
+ * @param m message to fill with Lua data
+ * @types dbus type string
+ * @stpos stack position where message data starts
+ * @flags LSDBUS_MSG_* flags
+ *
+ * Like msg_fromlua_sig, but looks up the compiled signature of types
+ * in the signature cache first.
+ *
+ * @return 0 if OK, <0 if not. In case of error, an error message is
+ * pushed to the top of the stack.
+ */
+int msg_fromlua(lua_State *L, sd_bus_message *m, const char *types, int stpos, uint32_t flags)
+{
+	int r, top;
+	const struct lsdbus_sig *sig;
+
+	stpos = lua_absindex(L, stpos);
+	top = lua_gettop(L);
+	sig = sig_getstr(L, types);
+
+	if (sig == NULL)
+		return -EINVAL;
+
+	/* the sig is kept above the args while in use */
+	r = __msg_fromlua(L, m, sig, stpos, top, flags);
+
+	/* drop the sig (below an error msg) */
+	lua_remove(L, r < 0 ? -2 : -1);
+
+	return r;
+}
+
+/* push {types, value} like tovariant for the value at idx */
+static void tovariant(lua_State *L, int idx, unsigned depth)
+{
+	const char *types;
+
+	if (depth >= BUS_CONTAINER_DEPTH)
+		luaL_error(L, "tovariant: nesting depth %d exceeded", BUS_CONTAINER_DEPTH);
+
+	luaL_checkstack(L, 6, "tovariant");
+
+	switch (lua_type(L, idx)) {
+	case LUA_TNUMBER:
+		types = lua_isinteger(L, idx) ? "x" : "d";
+		break;
+	case LUA_TSTRING:
+		types = "s";
+		break;
+	case LUA_TBOOLEAN:
+		types = "b";
+		break;
+	case LUA_TTABLE:
+		types = table_is_array(L, idx) ? "a{iv}" : "a{sv}";
+		break;
+	default:
+		luaL_error(L, "unsupported type %s", luaL_typename(L, idx));
+		return;
+	}
+
+	lua_createtable(L, 2, 0);
+	lua_pushstring(L, types);
+	lua_rawseti(L, -2, 1);
+
+	if (types[0] != 'a') {
+		lua_pushvalue(L, idx);
+	} else {
+		lua_newtable(L);				/* var, res */
+		lua_pushnil(L);
+		while (lua_next(L, idx) != 0) {			/* var, res, key, val */
+			tovariant(L, lua_gettop(L), depth + 1);	/* var, res, key, val, var2 */
+			lua_remove(L, -2);			/* var, res, key, var2 */
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);			/* var, res, key, key, var2 */
+			lua_rawset(L, -4);			/* var, res, key */
+		}
+	}
+
+	lua_rawseti(L, -2, 2);
+}
+
+/**
+ * lsdbus.tovariant(value)
+ *
+ * encode an arbitrary Lua value into a {types, value} variant table
+ */
+int lsdbus_tovariant(lua_State *L)
+{
+	luaL_checkany(L, 1);
+	tovariant(L, 1, 0);
+	return 1;
+}
+
+/**
+ * lsdbus.variant(types, value)
+ *
+ * return a {types, value} variant table with the lsdbus.variant
+ * metatable, which is appended with the given type also with
+ * LSDBUS_MSG_AUTO_VARIANT.
+ */
+int lsdbus_variant(lua_State *L)
+{
+	luaL_checkstring(L, 1);
+	luaL_checkany(L, 2);
+
+	lua_createtable(L, 2, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, 2);
+	luaL_setmetatable(L, VARIANT_MT);
+	return 1;
+}
+
+/**
+ * lsdbus.tovariant2(value)
+ *
+ * like tovariant, but only return the value of the variant table
+ */
+int lsdbus_tovariant2(lua_State *L)
+{
+	luaL_checkany(L, 1);
+	tovariant(L, 1, 0);
+	lua_rawgeti(L, -1, 2);
 	return 1;
 }
 
-static int __msg_tolua(lua_State *L, sd_bus_message* m, char ctype, int raw)
+/*
+ * decoder state shared by all nesting levels of one msg_tolua call:
+ * the conversion flags and the stack indices of the metatables and
+ * the string cache table, which are looked up once instead of once
+ * per container or string.
+ */
+struct tolua_ctx {
+	uint32_t flags;
+	int array_mt;
+	int struct_mt;
+	int variant_mt;
+	int str_cache;
+	struct lsdbus_str_cache *sc;
+};
+
+/*
+ * an open container of the decoder: its type (0 for the top level)
+ * and the index of the last element stored into its table. Raw
+ * variants start at 1, since the type is stored first.
+ */
+struct tolua_frame {
+	char ctype;
+	lua_Integer n;
+};
+
+/* set the cached metatable at mtidx on the table at the top */
+static inline void setmt(lua_State *L, int mtidx)
+{
+	lua_pushvalue(L, mtidx);
+	lua_setmetatable(L, -2);
+}
+
+/*
+ * count the elements of the array container that was just entered
+ * and rewind to its start.
+ */
+static int count_elements(sd_bus_message *m, size_t *n)
 {
 	int r;
 
-        for (;;) {
-                /* _cleanup_free_ char *prefix = NULL; */
-                const char *contents = NULL;
-                char type;
-                union {
-                        uint8_t u8;
-                        uint16_t u16;
-                        int16_t s16;
-                        uint32_t u32;
-                        int32_t s32;
-                        uint64_t u64;
-                        int64_t s64;
-                        double d64;
-			const char *string;
-                        int i;
-                } basic;
-
-                r = sd_bus_message_peek_type(m, &type, &contents);
+	*n = 0;
 
-                if (r < 0)
-                        luaL_error(L, "msg_tolua: peek_type failed: %s", strerror(-r));
+	while ((r = sd_bus_message_peek_type(m, NULL, NULL)) > 0) {
+		r = sd_bus_message_skip(m, NULL);
+		if (r < 0)
+			return r;
+		(*n)++;
+	}
 
-                if (r == 0) {
-			if(ctype==0)
-				return 0;
+	if (r < 0)
+		return r;
 
-                        r = sd_bus_message_exit_container(m);
-                        if (r < 0)
-				luaL_error(L, "msg_tolua: failed to exit container: %s", strerror(-r));
+	return sd_bus_message_rewind(m, 0);
+}
 
-			dbg("exit container ctype %c", ctype);
-                        return 0;
-                }
+/* count the complete types of a struct contents signature */
+static int count_fields(const char *contents)
+{
+	int n = 0;
+	size_t l;
 
-		if (type == SD_BUS_TYPE_ARRAY || type == SD_BUS_TYPE_STRUCT) {
-			dbg("enter ARRAY/STRUCT container: %c", type);
+	for (const char *p = contents; *p; p += l, n++) {
+		if (signature_element_length(p, &l) < 0)
+			return 0;
+	}
 
-                        r = sd_bus_message_enter_container(m, type, contents);
+	return n;
+}
 
-                        if (r < 0)
-				luaL_error(L, "msg_tolua: failed to enter container: %s", strerror(-r));
+#define DRAIN_ARRAY(ctype, push)			\
+	for (size_t i=0; i<n; i++) {			\
+		push(L, ((const ctype*) p)[i]);		\
+		lua_rawseti(L, -2, i + 1);		\
+	}
+
+/*
+ * read an array of fixed size basic types with one
+ * sd_bus_message_read_array call and push it as a table
+ */
+static int push_trivial_array(lua_State *L, sd_bus_message *m, char type,
+			      const struct tolua_ctx *ctx)
+{
+	int r;
+	size_t n, size;
+	const void *p;
+
+	r = sd_bus_message_read_array(m, type, &p, &size);
+	if (r < 0) {
+		lua_pushfstring(L, "msg_tolua: failed to read array a%c: %s", type, strerror(-r));
+		return r;
+	}
+
+	n = size / bus_type_trivial_size(type);
+	dbg("read trivial array a%c of size %zu", type, n);
+
+	lua_createtable(L, n, 0);
+	setmt(L, ctx->array_mt);
+
+	switch (type) {
+	case SD_BUS_TYPE_BYTE:
+		DRAIN_ARRAY(uint8_t, lua_pushinteger); break;
+	case SD_BUS_TYPE_INT16:
+		DRAIN_ARRAY(int16_t, lua_pushinteger); break;
+	case SD_BUS_TYPE_UINT16:
+		DRAIN_ARRAY(uint16_t, lua_pushinteger); break;
+	case SD_BUS_TYPE_INT32:
+		DRAIN_ARRAY(int32_t, lua_pushinteger); break;
+	case SD_BUS_TYPE_UINT32:
+		DRAIN_ARRAY(uint32_t, lua_pushinteger); break;
+	case SD_BUS_TYPE_INT64:
+		DRAIN_ARRAY(int64_t, lua_pushinteger); break;
+	case SD_BUS_TYPE_UINT64:
+		DRAIN_ARRAY(uint64_t, lua_pushinteger); break;
+	case SD_BUS_TYPE_DOUBLE:
+		DRAIN_ARRAY(double, lua_pushnumber); break;
+	case SD_BUS_TYPE_BOOLEAN:
+		DRAIN_ARRAY(int32_t, lua_pushboolean); break;
+	}
+
+	return 0;
+}
+
+/*
+ * read an array of fixed size basic types into a new lsdbus.buffer
+ */
+static int push_buffer(lua_State *L, sd_bus_message *m, char type)
+{
+	int r;
+	size_t size;
+	const void *p;
+	struct lsdbus_buffer *buf;
+
+	r = sd_bus_message_read_array(m, type, &p, &size);
+	if (r < 0) {
+		lua_pushfstring(L, "msg_tolua: failed to read array a%c: %s", type, strerror(-r));
+		return r;
+	}
+
+	buf = lsdbus_buffer_push(L, type, size / bus_type_trivial_size(type));
+	if (size > 0)
+		memcpy(buf->data, p, size);
+
+	return 0;
+}
+
+/*
+ * read an ay with one sd_bus_message_read_array call and push it as
+ * a Lua string
+ */
+static int push_byte_string(lua_State *L, sd_bus_message *m)
+{
+	int r;
+	size_t size;
+	const void *p;
+
+	r = sd_bus_message_read_array(m, SD_BUS_TYPE_BYTE, &p, &size);
+	if (r < 0) {
+		lua_pushfstring(L, "msg_tolua: failed to read array ay: %s", strerror(-r));
+		return r;
+	}
+
+	lua_pushlstring(L, size ? p : "", size);
+	return 0;
+}
+
+/* read and push the basic type value of type */
+static int push_basic(lua_State *L, sd_bus_message *m, char type,
+		      const struct tolua_ctx *ctx)
+{
+	int r;
+
+	union {
+		uint8_t u8;
+		uint16_t u16;
+		int16_t s16;
+		uint32_t u32;
+		int32_t s32;
+		uint64_t u64;
+		int64_t s64;
+		double d64;
+		const char *string;
+		int i;
+	} basic;
+
+	r = sd_bus_message_read_basic(m, type, &basic);
+	if (r < 0) {
+		lua_pushfstring(L, "msg_tolua: read_basic error: %s", strerror(-r));
+		return r;
+	}
+
+	assert(r > 0);
+
+	switch (type) {
+	case SD_BUS_TYPE_BYTE:
+		dbg("push BYTE");
+		lua_pushinteger(L, basic.u8);
+		break;
+
+	case SD_BUS_TYPE_BOOLEAN:
+		dbg("push BOOLEAN");
+		lua_pushboolean(L, basic.i);
+		break;
+
+	case SD_BUS_TYPE_INT16:
+		dbg("push INT16");
+		lua_pushinteger(L, basic.s16);
+		break;
+
+	case SD_BUS_TYPE_UINT16:
+		dbg("push UINT16");
+		lua_pushinteger(L, basic.u16);
+		break;
+
+	case SD_BUS_TYPE_INT32:
+	case SD_BUS_TYPE_UNIX_FD:
+		dbg("push INT32/FD %i", basic.s32);
+		lua_pushinteger(L, basic.s32);
+		break;
+
+	case SD_BUS_TYPE_UINT32:
+		dbg("push UINT32");
+		lua_pushinteger(L, basic.u32);
+		break;
+
+	case SD_BUS_TYPE_INT64:
+		dbg("push INT64");
+		lua_pushinteger(L, basic.s64);
+		break;
+
+	case SD_BUS_TYPE_UINT64:
+		dbg("push UINT64");
+		lua_pushinteger(L, basic.u64);
+		break;
+
+	case SD_BUS_TYPE_DOUBLE:
+		dbg("push DOUBLE");
+		lua_pushnumber(L, basic.d64);
+		break;
+
+	case SD_BUS_TYPE_STRING:
+	case SD_BUS_TYPE_OBJECT_PATH:
+	case SD_BUS_TYPE_SIGNATURE:
+		dbg("push STRING/OBJ/sig %s", basic.string);
+		str_cache_push(L, ctx->sc, ctx->str_cache, basic.string);
+		break;
+
+	default:
+		lua_pushfstring(L, "msg_tolua: unknown basic type: %c", type);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int __msg_tolua(lua_State *L, sd_bus_message* m, const struct tolua_ctx *ctx, int max);
+
+/*
+ * decode an array of structs a(...) column wise: push a table with
+ * one array (or buffer with LSDBUS_MSG_BUFFER) per struct field.
+ */
+static int push_columns(lua_State *L, sd_bus_message *m, const char *contents,
+			const struct tolua_ctx *ctx)
+{
+	int r, top, colidx;
+	size_t n = 0;
+	unsigned nf;
+	const struct lsdbus_sig *sig;
+	const struct lsdbus_sigop *op;
+
+	r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, contents);
+	if (r < 0) {
+		lua_pushfstring(L, "msg_tolua: failed to enter container: %s", strerror(-r));
+		return r;
+	}
+
+	/* count the rows to presize the columns */
+	r = count_elements(m, &n);
+	if (r < 0) {
+		lua_pushfstring(L, "msg_tolua: failed to count a%s: %s", contents, strerror(-r));
+		return r;
+	}
+
+	sig = sig_getstr(L, contents);				/* sig */
+	if (sig == NULL)
+		return -EINVAL;
+
+	nf = sig->ops[0].nchild;
+	if (!lua_checkstack(L, nf * 2 + 4)) {
+		lua_pushliteral(L, "msg_tolua: too many struct fields");
+		return -EINVAL;
+	}
+
+	struct lsdbus_buffer *bufs[nf];
+
+	lua_createtable(L, nf, 0);				/* sig, cols */
+	setmt(L, ctx->struct_mt);
+	colidx = lua_gettop(L) + 1;
+
+	op = &sig->ops[1];
+	for (unsigned i=0; i<nf; i++) {
+		if ((ctx->flags & LSDBUS_MSG_BUFFER) && buffer_type_is_valid(op->type)) {
+			bufs[i] = lsdbus_buffer_push(L, op->type, n);
+		} else {
+			bufs[i] = NULL;
+			lua_createtable(L, n, 0);
+			setmt(L, ctx->array_mt);
+		}
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, colidx - 1, i + 1);		/* sig, cols, col1..coli */
+		op += op->len;
+	}
+
+	top = lua_gettop(L);
+
+	for (size_t row=0; row<n; row++) {
+		r = sd_bus_message_enter_container(m, SD_BUS_TYPE_STRUCT, sig->ops[0].contents);
+		if (r < 0) {
+			lua_pushfstring(L, "msg_tolua: failed to enter container: %s", strerror(-r));
+			return r;
+		}
+
+		/* push the fields like top level values */
+		r = __msg_tolua(L, m, ctx, 0);
+		if (r < 0)
+			return r;
+
+		r = sd_bus_message_exit_container(m);
+		if (r < 0) {
+			lua_pushfstring(L, "msg_tolua: failed to exit container: %s", strerror(-r));
+			return r;
+		}
+
+		for (unsigned i=0; i<nf; i++) {
+			if (bufs[i]) {
+				buffer_setelem(L, bufs[i], row, top + 1 + i);
+			} else {
+				lua_pushvalue(L, top + 1 + i);
+				lua_rawseti(L, colidx + i, row + 1);
+			}
+		}
+		lua_settop(L, top);
+	}
+
+	r = sd_bus_message_exit_container(m);
+	if (r < 0) {
+		lua_pushfstring(L, "msg_tolua: failed to exit container: %s", strerror(-r));
+		return r;
+	}
+
+	lua_settop(L, colidx - 1);				/* sig, cols */
+	lua_remove(L, -2);					/* cols */
+	return 0;
+}
+
+/*
+ * convert the values of the current container until its end, or at
+ * most max values if max > 0, and push them (the fields of a struct
+ * that was entered or the top level arguments of a message).
+ *
+ * This works iteratively: entering a container pushes a frame and,
+ * for arrays, structs and raw variants, a presized table; each
+ * complete value is then stored into the table of the innermost
+ * frame. Hence C and Lua stack use is bounded by the nesting depth
+ * and not by the number of elements.
+ *
+ * @return 0 or <0 in case of error, in which case an error message is
+ * pushed.
+ */
+static int __msg_tolua(lua_State *L, sd_bus_message* m, const struct tolua_ctx *ctx, int max)
+{
+	int r, depth = 0;
+	const uint32_t flags = ctx->flags;
+	struct tolua_frame stack[BUS_CONTAINER_DEPTH + 1];
+	struct tolua_frame *f = stack;
+
+	f->ctype = 0;
+	f->n = 0;
+
+	for (;;) {
+		const char *contents = NULL;
+		char type;
+
+		r = sd_bus_message_peek_type(m, &type, &contents);
+
+		if (r < 0) {
+			lua_pushfstring(L, "msg_tolua: peek_type failed: %s", strerror(-r));
+			return r;
+		}
+
+		if (r == 0) {
+			if (depth == 0)
+				return 0;
+
+			r = sd_bus_message_exit_container(m);
+			if (r < 0) {
+				lua_pushfstring(L, "msg_tolua: failed to exit container: %s", strerror(-r));
+				return r;
+			}
 
-			lua_newtable(L);
+			dbg("exit container ctype %c", f->ctype);
+			type = f->ctype;
+			f = &stack[--depth];
 
-			if (type == SD_BUS_TYPE_ARRAY)
-				luaL_setmetatable(L, ARRAY_MT);
-			else
-				luaL_setmetatable(L, STRUCT_MT);
+			if (type == SD_BUS_TYPE_DICT_ENTRY) {
+				dbg("rawset into parent at -3");
+				lua_rawset(L, -3);
+				continue;
+			}
 
-			__msg_tolua(L, m, type, raw);
+			/* the container table (or the value of a variant) is complete */
 			goto update_table;
+		}
 
-		} else if (type == SD_BUS_TYPE_DICT_ENTRY) {
-			dbg("enter DICT_ENTRY container: %c", type);
+		/* each top level value takes a slot */
+		if (depth == 0 && !lua_checkstack(L, 4)) {
+			lua_pushliteral(L, "msg_tolua: too many arguments");
+			return -ENOMEM;
+		}
 
-                        r = sd_bus_message_enter_container(m, type, contents);
+		if (type == SD_BUS_TYPE_ARRAY && (flags & LSDBUS_MSG_AY_STRING) &&
+		    contents[0] == SD_BUS_TYPE_BYTE && contents[1] == '\0') {
+			r = push_byte_string(L, m);
 
-                        if (r < 0)
-				luaL_error(L, "msg_tolua: failed to enter container: %s", strerror(-r));
+		} else if (type == SD_BUS_TYPE_ARRAY && (flags & LSDBUS_MSG_BUFFER) &&
+			   contents[1] == '\0' && buffer_type_is_valid(contents[0])) {
+			r = push_buffer(L, m, contents[0]);
 
-			__msg_tolua(L, m, type, raw);
-			dbg("rawset into parent at -3");
-			lua_rawset(L, -3);
-			continue;
+		} else if (type == SD_BUS_TYPE_ARRAY && contents[1] == '\0' &&
+			   bus_type_trivial_size(contents[0]) > 0) {
+			r = push_trivial_array(L, m, contents[0], ctx);
+
+		} else if (type == SD_BUS_TYPE_ARRAY && (flags & LSDBUS_MSG_COLUMNAR) &&
+			   contents[0] == SD_BUS_TYPE_STRUCT_BEGIN) {
+			r = push_columns(L, m, contents, ctx);
 
-		} else if (type == SD_BUS_TYPE_VARIANT) {
-			dbg("enter VARIANT container: %c", type);
+		} else if (bus_type_is_container(type)) {
+			dbg("enter container: %c", type);
+
+			if (depth >= BUS_CONTAINER_DEPTH || !lua_checkstack(L, 4)) {
+				lua_pushfstring(L, "msg_tolua: container depth %d exceeded",
+						BUS_CONTAINER_DEPTH);
+				return -EINVAL;
+			}
 
 			r = sd_bus_message_enter_container(m, type, contents);
+			if (r < 0) {
+				lua_pushfstring(L, "msg_tolua: failed to enter container: %s", strerror(-r));
+				return r;
+			}
 
-                        if (r < 0)
-				luaL_error(L, "msg_tolua: failed to enter container: %s", strerror(-r));
-			if (raw) {
+			f = &stack[++depth];
+			f->ctype = type;
+			f->n = 0;
+
+			if (type == SD_BUS_TYPE_ARRAY) {
 				lua_newtable(L);
-				luaL_setmetatable(L, VARIANT_MT);
-				lua_pushstring(L, contents);
-				lua_rawseti(L, -2, 1);
+				setmt(L, ctx->array_mt);
+			} else if (type == SD_BUS_TYPE_STRUCT) {
+				lua_createtable(L, count_fields(contents), 0);
+				setmt(L, ctx->struct_mt);
+			} else if (type == SD_BUS_TYPE_VARIANT && (flags & LSDBUS_MSG_RAW)) {
+				lua_createtable(L, 2, 0);
+				setmt(L, ctx->variant_mt);
+				str_cache_push(L, ctx->sc, ctx->str_cache, contents);
+				lua_rawseti(L, -2, ++f->n);
 			}
+			continue;
 
-			__msg_tolua(L, m, type, raw);
-			goto update_table;
+		} else {
+			r = push_basic(L, m, type, ctx);
 		}
 
-                r = sd_bus_message_read_basic(m, type, &basic);
-                if (r < 0)
-			luaL_error(L, "msg_tolua: read_basic error: %s", strerror(-r));
-
-                assert(r > 0);
-
-                switch (type) {
-                case SD_BUS_TYPE_BYTE:
-			dbg("push BYTE");
-			lua_pushinteger(L, basic.u8);
-                        break;
-
-                case SD_BUS_TYPE_BOOLEAN:
-			dbg("push BOOLEAN");
-			lua_pushboolean(L, basic.i);
-                        break;
-
-                case SD_BUS_TYPE_INT16:
-			dbg("push INT16");
-			lua_pushinteger(L, basic.s16);
-			break;
-
-                case SD_BUS_TYPE_UINT16:
-			dbg("push UINT16");
-			lua_pushinteger(L, basic.u16);
-                        break;
-
-                case SD_BUS_TYPE_INT32:
-                case SD_BUS_TYPE_UNIX_FD:
-			dbg("push INT32/FD %i", basic.s32);
-			lua_pushinteger(L, basic.s32);
-			break;
-
-                case SD_BUS_TYPE_UINT32:
-			dbg("push UINT32");
-			lua_pushinteger(L, basic.u32);
-                        break;
-
-                case SD_BUS_TYPE_INT64:
-			dbg("push INT64");
-			lua_pushinteger(L, basic.s64);
-			break;
-
-                case SD_BUS_TYPE_UINT64:
-			dbg("push UINT64");
-			lua_pushinteger(L, basic.u64);
-                        break;
-
-                case SD_BUS_TYPE_DOUBLE:
-			dbg("push DOUBLE");
-			lua_pushnumber(L, basic.d64);
-                        break;
-
-                case SD_BUS_TYPE_STRING:
-                case SD_BUS_TYPE_OBJECT_PATH:
-                case SD_BUS_TYPE_SIGNATURE:
-			dbg("push STRING/OBJ/sig %s", basic.string);
-			lua_pushstring(L, basic.string);
-                        break;
-
-                default:
-                        luaL_error(L, "msg_tolua: unknown basic type: %c", type);
-                }
+		if (r < 0)
+			return r;
 
 	update_table:
-		if (ctype == SD_BUS_TYPE_ARRAY ||
-		    ctype == SD_BUS_TYPE_STRUCT ||
-		    (raw && ctype == SD_BUS_TYPE_VARIANT)) {
-			if (lua_type(L, -2) != LUA_TTABLE)
-				luaL_error(L, "%c rawseti: not table at -2", ctype);
-
-			dbg("rawseti t[%lu]", lua_rawlen(L, -2) + 1);
-			lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		if (f->ctype == SD_BUS_TYPE_ARRAY ||
+		    f->ctype == SD_BUS_TYPE_STRUCT ||
+		    ((flags & LSDBUS_MSG_RAW) && f->ctype == SD_BUS_TYPE_VARIANT)) {
+			assert(lua_type(L, -2) == LUA_TTABLE);
+			dbg("rawseti t[%lld]", (long long) f->n + 1);
+			lua_rawseti(L, -2, ++f->n);
+		} else if (depth == 0 && --max == 0) {
+			return 0;
 		}
-        }
+	}
+}
+
+/**
+ * msg_tolua_max - convert the message m starting at its current position
+ *
+ * @param max maximum number of values to convert or <= 0 for all
+ * @return the number of values pushed or <0 in case of error, in
+ * which case an error message is pushed onto the stack.
+ */
+int msg_tolua_max(lua_State *L, sd_bus_message* m, uint32_t flags, int max)
+{
+	int r, top = lua_gettop(L);
+	struct tolua_ctx ctx = { .flags = flags };
+
+	luaL_checkstack(L, 8, "msg_tolua: stack overflow");
+
+	luaL_getmetatable(L, ARRAY_MT);
+	ctx.array_mt = lua_gettop(L);
+	luaL_getmetatable(L, STRUCT_MT);
+	ctx.struct_mt = lua_gettop(L);
+	luaL_getmetatable(L, VARIANT_MT);
+	ctx.variant_mt = lua_gettop(L);
+	ctx.sc = str_cache_get(L);
+	ctx.str_cache = lua_gettop(L);
+
+	r = __msg_tolua(L, m, &ctx, max);
+
+	if (r < 0) {
+		/* drop the partial results below the error message */
+		lua_replace(L, top + 1);
+		lua_settop(L, top + 1);
+		return r;
+	}
+
+	/* drop the metatables and the string cache below the results */
+	lua_rotate(L, ctx.array_mt, -4);
+	lua_pop(L, 4);
 
-        return 0;
+	return lua_gettop(L) - top;
 }
 
-int msg_tolua(lua_State *L, sd_bus_message* m, int raw)
+int msg_tolua(lua_State *L, sd_bus_message* m, uint32_t flags)
 {
-	int ret, nargs;
-	nargs = lua_gettop(L);
-	ret = __msg_tolua(L, m, 0, raw);
-	if (ret < 0)
-		return ret;
-	return lua_gettop(L) - nargs;
+	return msg_tolua_max(L, m, flags, 0);
 }
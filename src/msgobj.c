@@ -0,0 +1,190 @@
+#include "lsdbus.h"
+
+/*
+ * lsdbus.msg: a reference to a received sd_bus_message, passed to
+ * callbacks with LSDBUS_MSG_LAZY instead of the converted
+ * arguments. Header fields are read directly from the message and
+ * arguments are only converted on demand, skipping over the ones
+ * before without converting them.
+ */
+
+/**
+ * push a new message object holding a reference to m [-0, +1, m]
+ *
+ * @param flags LSDBUS_MSG_* flags used for converting the arguments
+ */
+int lsdbus_msg_push(lua_State *L, sd_bus_message *m, uint32_t flags)
+{
+	struct lsdbus_msg *msg = lua_newuserdata(L, sizeof(struct lsdbus_msg));
+
+	msg->m = sd_bus_message_ref(m);
+	msg->flags = flags & ~LSDBUS_MSG_LAZY;
+	luaL_setmetatable(L, MSG_MT);
+	return 1;
+}
+
+static struct lsdbus_msg *checkmsg(lua_State *L, int idx)
+{
+	struct lsdbus_msg *msg = luaL_checkudata(L, idx, MSG_MT);
+
+	if (msg->m == NULL)
+		luaL_error(L, "message already released");
+
+	return msg;
+}
+
+/* rewind to the first argument and skip the n following ones */
+static int msg_skip(sd_bus_message *m, lua_Integer n)
+{
+	int r = sd_bus_message_rewind(m, 1);
+
+	for (; r >= 0 && n > 0; n--) {
+		r = sd_bus_message_skip(m, NULL);
+		if (r == 0)
+			return -ENXIO;
+	}
+
+	return r < 0 ? r : 0;
+}
+
+/**
+ * msg:arg(i)
+ *
+ * convert and return the i-th argument or nil if there are less.
+ */
+static int msg_arg(lua_State *L)
+{
+	int r;
+	struct lsdbus_msg *msg = checkmsg(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, i >= 1, 2, "index must be >= 1");
+
+	r = msg_skip(msg->m, i - 1);
+	if (r == -ENXIO) {
+		lua_pushnil(L);
+		return 1;
+	} else if (r < 0) {
+		luaL_error(L, "failed to skip to arg %d: %s", (int) i, strerror(-r));
+	}
+
+	r = msg_tolua_max(L, msg->m, msg->flags, 1);
+	if (r < 0)
+		lua_error(L);
+
+	if (r == 0)
+		lua_pushnil(L);
+
+	return 1;
+}
+
+/**
+ * msg:args()
+ *
+ * convert and return all arguments.
+ */
+static int msg_args(lua_State *L)
+{
+	int r;
+	struct lsdbus_msg *msg = checkmsg(L, 1);
+
+	r = sd_bus_message_rewind(msg->m, 1);
+	if (r < 0)
+		luaL_error(L, "failed to rewind message: %s", strerror(-r));
+
+	r = msg_tolua(L, msg->m, msg->flags);
+	if (r < 0)
+		lua_error(L);
+
+	return r;
+}
+
+#define MSG_STRING_GETTER(field)					\
+	static int msg_##field(lua_State *L)				\
+	{								\
+		struct lsdbus_msg *msg = checkmsg(L, 1);		\
+		struct lsdbus_str_cache *sc = str_cache_get(L);	\
+		str_cache_push(L, sc, lua_gettop(L), sd_bus_message_get_##field(msg->m)); \
+		lua_remove(L, -2);					\
+		return 1;						\
+	}
+
+MSG_STRING_GETTER(sender)
+MSG_STRING_GETTER(destination)
+MSG_STRING_GETTER(path)
+MSG_STRING_GETTER(interface)
+MSG_STRING_GETTER(member)
+
+static int msg_signature(lua_State *L)
+{
+	struct lsdbus_msg *msg = checkmsg(L, 1);
+	push_string_or_nil(L, sd_bus_message_get_signature(msg->m, 1));
+	return 1;
+}
+
+static int msg_serial(lua_State *L)
+{
+	uint64_t cookie;
+	struct lsdbus_msg *msg = checkmsg(L, 1);
+
+	if (sd_bus_message_get_cookie(msg->m, &cookie) < 0)
+		lua_pushnil(L);
+	else
+		lua_pushinteger(L, cookie);
+
+	return 1;
+}
+
+/* return the error table {name, message} of error replies or nil */
+static int msg_error(lua_State *L)
+{
+	struct lsdbus_msg *msg = checkmsg(L, 1);
+	const sd_bus_error *e = sd_bus_message_get_error(msg->m);
+
+	if (push_sd_bus_error(L, e) < 0)
+		lua_pushnil(L);
+
+	return 1;
+}
+
+static int msg_tostring(lua_State *L)
+{
+	struct lsdbus_msg *msg = luaL_checkudata(L, 1, MSG_MT);
+
+	if (msg->m == NULL) {
+		lua_pushfstring(L, "msg <%p> [released]", msg);
+		return 1;
+	}
+
+	lua_pushfstring(L, "msg <%p> [%s.%s(%s)]", msg,
+			sd_bus_message_get_interface(msg->m) ?: "-",
+			sd_bus_message_get_member(msg->m) ?: "-",
+			sd_bus_message_get_signature(msg->m, 1));
+	return 1;
+}
+
+static int msg_gc(lua_State *L)
+{
+	struct lsdbus_msg *msg = luaL_checkudata(L, 1, MSG_MT);
+	msg->m = sd_bus_message_unref(msg->m);
+	return 0;
+}
+
+const luaL_Reg lsdbus_msg_m [] = {
+	{ "arg", msg_arg },
+	{ "args", msg_args },
+	{ "sender", msg_sender },
+	{ "destination", msg_destination },
+	{ "path", msg_path },
+	{ "interface", msg_interface },
+	{ "member", msg_member },
+	{ "signature", msg_signature },
+	{ "serial", msg_serial },
+	{ "error", msg_error },
+	{ "__tostring", msg_tostring },
+	{ "__gc", msg_gc },
+#if LUA_VERSION_NUM >= 504
+	{ "__close", msg_gc },
+#endif
+	{ NULL, NULL }
+};
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include "lsdbus.h"
+
+/*
+ * lsdbus.prepared: a method call prepared with bus:prepare. The
+ * destination, path, interface and member are validated and the
+ * type string is compiled once, so that repeated calls only need to
+ * create, fill and send the message.
+ *
+ * The bus object and the compiled signature are referenced from the
+ * uservalue table of the userdata, which keeps them alive as long as
+ * the prepared call.
+ */
+
+struct lsdbus_prepared {
+	sd_bus *b;
+	struct lsdbus_bus *bus;		/* for the default msg flags */
+	const struct lsdbus_sig *sig;	/* NULL if no args */
+	const char *dest;
+	const char *path;
+	const char *intf;
+	const char *memb;
+	const char *types;
+	uint64_t timeout;		/* 0: bus default */
+	char strings[];
+};
+
+static struct lsdbus_prepared *checkprepared(lua_State *L, int idx)
+{
+	return luaL_checkudata(L, idx, PREPARED_MT);
+}
+
+/* copy s to *p and advance it */
+static const char *copystr(char **p, const char *s)
+{
+	const char *ret = *p;
+	size_t len = strlen(s) + 1;
+
+	memcpy(*p, s, len);
+	*p += len;
+	return ret;
+}
+
+/**
+ * bus:prepare(dest, path, intf, member, types, timeout)
+ *
+ * validate the arguments and return a prepared call object. The
+ * optional timeout (in us) applies to all calls.
+ */
+int lsdbus_prepare(lua_State *L)
+{
+	char *p;
+	struct lsdbus_prepared *pc;
+	const struct lsdbus_sig *sig = NULL;
+	struct lsdbus_bus *bus = luaL_checkudata(L, 1, BUS_MT);
+	const char *dest = luaL_checkservice(L, 2);
+	const char *path = luaL_checkpath(L, 3);
+	const char *intf = luaL_checkintf(L, 4);
+	const char *memb = luaL_checkmember(L, 5);
+	const char *types = luaL_optstring(L, 6, "");
+	lua_Integer timeout = luaL_optinteger(L, 7, 0);
+
+	if (timeout < 0)
+		luaL_error(L, "invalid timeout: must not be negative");
+
+	lua_settop(L, 6);
+
+	if (types[0] != '\0') {
+		sig = sig_get(L, 6);				/* sig */
+		if (sig == NULL)
+			lua_error(L);
+	} else {
+		lua_pushnil(L);
+	}
+
+	pc = lua_newuserdata(L, sizeof(struct lsdbus_prepared) + strlen(dest) + strlen(path) +
+			     strlen(intf) + strlen(memb) + strlen(types) + 5);
+	pc->b = sd_bus_ref(bus->b);
+	pc->bus = bus;
+	pc->sig = sig;
+	pc->timeout = timeout;
+
+	p = pc->strings;
+	pc->dest = copystr(&p, dest);
+	pc->path = copystr(&p, path);
+	pc->intf = copystr(&p, intf);
+	pc->memb = copystr(&p, memb);
+	pc->types = copystr(&p, types);
+
+	luaL_setmetatable(L, PREPARED_MT);			/* sig, pc */
+
+	lua_createtable(L, 2, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, -3);
+	lua_rawseti(L, -2, 2);
+	lua_setuservalue(L, -2);
+
+	return 1;
+}
+
+/* create the call message and append the args starting at stpos */
+static sd_bus_message *prepared_msg(lua_State *L, struct lsdbus_prepared *pc, int stpos,
+				    uint32_t flags)
+{
+	int ret;
+	sd_bus_message *m;
+
+	ret = sd_bus_message_new_method_call(pc->b, &m, pc->dest, pc->path, pc->intf, pc->memb);
+
+	if (ret < 0)
+		luaL_error(L, "failed to create call message: %s", strerror(-ret));
+
+	if (pc->sig != NULL) {
+		ret = msg_fromlua_sig(L, m, pc->sig, stpos, flags);
+
+		if (ret < 0) {
+			sd_bus_message_unref(m);
+			lua_error(L);
+		}
+	}
+
+	return m;
+}
+
+/* pc:call(...) */
+static int prepared_call(lua_State *L)
+{
+	struct lsdbus_prepared *pc = checkprepared(L, 1);
+	sd_bus_message *m = prepared_msg(L, pc, 2, 0);
+
+	return lsdbus_call_msg(L, pc->b, m, pc->bus->msg_flags &
+			       ~(LSDBUS_MSG_LAZY|LSDBUS_MSG_AUTO_VARIANT), pc->timeout);
+}
+
+/* pc:callr(...) */
+static int prepared_callr(lua_State *L)
+{
+	struct lsdbus_prepared *pc = checkprepared(L, 1);
+	sd_bus_message *m = prepared_msg(L, pc, 2, 0);
+
+	return lsdbus_call_msg(L, pc->b, m, (pc->bus->msg_flags &
+			       ~(LSDBUS_MSG_LAZY|LSDBUS_MSG_AUTO_VARIANT)) | LSDBUS_MSG_RAW, pc->timeout);
+}
+
+/* pc:callf(flags, ...) */
+static int prepared_callf(lua_State *L)
+{
+	struct lsdbus_prepared *pc = checkprepared(L, 1);
+	uint32_t flags = luaL_checkinteger(L, 2);
+	sd_bus_message *m = prepared_msg(L, pc, 3, flags);
+
+	return lsdbus_call_msg(L, pc->b, m, flags, pc->timeout);
+}
+
+/* pc:call_async(callback, ...) */
+static int prepared_call_async(lua_State *L)
+{
+	struct lsdbus_prepared *pc = checkprepared(L, 1);
+	sd_bus_message *m;
+
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	m = prepared_msg(L, pc, 3, 0);
+
+	return lsdbus_call_async_msg(L, pc->b, m, 2, pc->timeout);
+}
+
+static int prepared_tostring(lua_State *L)
+{
+	struct lsdbus_prepared *pc = checkprepared(L, 1);
+
+	lua_pushfstring(L, "prepared <%p> [%s %s %s.%s(%s)]", pc,
+			pc->dest, pc->path, pc->intf, pc->memb, pc->types);
+	return 1;
+}
+
+static int prepared_gc(lua_State *L)
+{
+	struct lsdbus_prepared *pc = checkprepared(L, 1);
+	pc->b = sd_bus_unref(pc->b);
+	return 0;
+}
+
+const luaL_Reg lsdbus_prepared_m [] = {
+	{ "call", prepared_call },
+	{ "callr", prepared_callr },
+	{ "callf", prepared_callf },
+	{ "call_async", prepared_call_async },
+	{ "__call", prepared_call },
+	{ "__tostring", prepared_tostring },
+	{ "__gc", prepared_gc },
+	{ NULL, NULL }
+};
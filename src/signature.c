@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include "lsdbus.h"
+
+/*
+ * Compiled signature cache
+ *
+ * Parsing a D-Bus type string (validation, computing the element
+ * length of containers and extracting their contents signatures) is
+ * done once per distinct signature. The result is a flat, pre-order
+ * array of ops stored in a userdata, which is cached in the registry
+ * table REG_SIG_CACHE keyed by the signature string. The stats of the
+ * cache are kept in a userdata stored at REG_SIG_CACHE[1].
+ */
+
+#define SIG_MAXOPS		255	/* max D-Bus signature length */
+#define SIG_CACHE_MAX		512	/* flush the cache beyond this */
+
+struct sig_cache_stats {
+	lua_Integer hits;
+	lua_Integer misses;
+	lua_Integer flushes;
+	int entries;
+};
+
+struct sig_compiler {
+	unsigned nops;
+	size_t strsz;
+	struct lsdbus_sigop ops[SIG_MAXOPS];
+	size_t clen[SIG_MAXOPS];	/* length of contents */
+};
+
+/*
+ * compile the single complete type at s into c. Returns the length
+ * of the type in characters or <0 in case of error, in which case an
+ * error message is pushed onto the stack.
+ */
+static int compile_type(lua_State *L, struct sig_compiler *c, const char *s)
+{
+	int r;
+	size_t k;
+	const char *p;
+	unsigned self = c->nops;
+	struct lsdbus_sigop *op = &c->ops[self];
+
+	if (c->nops >= SIG_MAXOPS) {
+		lua_pushfstring(L, "signature too long (max %d)", SIG_MAXOPS);
+		return -EINVAL;
+	}
+
+	c->nops++;
+	op->type = *s;
+	op->nchild = 0;
+	op->len = 1;
+	op->contents = NULL;
+	c->clen[self] = 0;
+
+	if (bus_type_is_basic(*s) || *s == SD_BUS_TYPE_VARIANT)
+		return 1;
+
+	switch (*s) {
+	case SD_BUS_TYPE_ARRAY:
+		r = signature_element_length(s + 1, &k);
+		if (r < 0) {
+			lua_pushfstring(L, "invalid array type string %s", s);
+			return r;
+		}
+
+		op->contents = s + 1;
+		c->clen[self] = k;
+		c->strsz += k + 1;
+
+		r = compile_type(L, c, s + 1);
+		if (r < 0)
+			return r;
+
+		op->nchild = 1;
+		op->len = c->nops - self;
+		return k + 1;
+
+	case SD_BUS_TYPE_STRUCT_BEGIN:
+	case SD_BUS_TYPE_DICT_ENTRY_BEGIN:
+		r = signature_element_length(s, &k);
+		if (r < 0) {
+			lua_pushfstring(L, "invalid %s type string %s",
+					*s == SD_BUS_TYPE_STRUCT_BEGIN ? "struct" : "dict", s);
+			return r;
+		}
+
+		op->contents = s + 1;
+		c->clen[self] = k - 2;
+		c->strsz += k - 1;
+
+		for (p = s + 1; p < s + k - 1; p += r) {
+			r = compile_type(L, c, p);
+			if (r < 0)
+				return r;
+			op->nchild++;
+		}
+
+		op->len = c->nops - self;
+		return k;
+
+	default:
+		lua_pushfstring(L, "invalid or unexpected typestring '%c'", *s);
+		return -EINVAL;
+	}
+}
+
+/*
+ * compile types into a new userdata which is pushed onto the
+ * stack. In case of error, NULL is returned and an error message is
+ * pushed instead.
+ */
+static struct lsdbus_sig *sig_compile(lua_State *L, const char *types)
+{
+	int r;
+	unsigned nargs = 0;
+	const char *p;
+	char *str;
+	struct lsdbus_sig *sig;
+	struct sig_compiler *c;
+
+	c = malloc(sizeof(struct sig_compiler));
+
+	if (c == NULL) {
+		lua_pushliteral(L, "sig_compile: out of memory");
+		return NULL;
+	}
+
+	c->nops = 0;
+	c->strsz = 0;
+
+	for (p = types; *p; p += r, nargs++) {
+		r = compile_type(L, c, p);
+		if (r < 0) {
+			free(c);
+			return NULL;
+		}
+	}
+
+	sig = lua_newuserdata(L, sizeof(struct lsdbus_sig) +
+			      c->nops * sizeof(struct lsdbus_sigop) + c->strsz);
+
+	sig->nops = c->nops;
+	sig->nargs = nargs;
+	memcpy(sig->ops, c->ops, c->nops * sizeof(struct lsdbus_sigop));
+
+	/* copy the contents signatures behind the ops */
+	str = (char*) &sig->ops[sig->nops];
+
+	for (unsigned i=0; i<sig->nops; i++) {
+		if (sig->ops[i].contents == NULL)
+			continue;
+		memcpy(str, sig->ops[i].contents, c->clen[i]);
+		str[c->clen[i]] = '\0';
+		sig->ops[i].contents = str;
+		str += c->clen[i] + 1;
+	}
+
+	free(c);
+	return sig;
+}
+
+/**
+ * sig_get - lookup or compile the signature at stack index idx
+ *
+ * @param L
+ * @param idx stack index of the signature string
+ * @return compiled signature. The userdata holding it is pushed onto
+ * the stack and must be kept there while in use [-0, +1, m]. In case
+ * of error, NULL is returned and an error message is pushed instead.
+ */
+struct lsdbus_sig *sig_get(lua_State *L, int idx)
+{
+	struct lsdbus_sig *sig;
+	struct sig_cache_stats *st;
+
+	idx = lua_absindex(L, idx);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, REG_SIG_CACHE);	/* cache */
+	lua_rawgeti(L, -1, 1);					/* cache, stats */
+	st = lua_touserdata(L, -1);
+	lua_pop(L, 1);						/* cache */
+
+	lua_pushvalue(L, idx);					/* cache, types */
+
+	if (lua_rawget(L, -2) == LUA_TUSERDATA) {		/* cache, sig */
+		st->hits++;
+		lua_remove(L, -2);				/* sig */
+		return lua_touserdata(L, -1);
+	}
+
+	lua_pop(L, 1);						/* cache */
+	st->misses++;
+
+	sig = sig_compile(L, lua_tostring(L, idx));		/* cache, sig|err */
+
+	if (sig == NULL) {
+		lua_remove(L, -2);				/* err */
+		return NULL;
+	}
+
+	if (st->entries >= SIG_CACHE_MAX) {
+		/* clearing existing fields is allowed during traversal */
+		lua_pushnil(L);
+		while (lua_next(L, -3) != 0) {
+			lua_pop(L, 1);
+			if (lua_type(L, -1) != LUA_TSTRING)
+				continue;
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, -5);
+		}
+		st->entries = 0;
+		st->flushes++;
+	}
+
+	lua_pushvalue(L, idx);					/* cache, sig, types */
+	lua_pushvalue(L, -2);					/* cache, sig, types, sig */
+	lua_rawset(L, -4);					/* cache, sig */
+	lua_remove(L, -2);					/* sig */
+	st->entries++;
+
+	return sig;
+}
+
+/**
+ * sig_getstr - like sig_get, but for a C string
+ */
+struct lsdbus_sig *sig_getstr(lua_State *L, const char *types)
+{
+	struct lsdbus_sig *sig;
+
+	lua_pushstring(L, types);
+	sig = sig_get(L, -1);
+	lua_remove(L, -2);
+	return sig;
+}
+
+/* create the REG_SIG_CACHE table. This must be run during module init. */
+void init_reg_sig_cache(lua_State *L)
+{
+	struct sig_cache_stats *st;
+
+	lua_newtable(L);
+	st = lua_newuserdata(L, sizeof(struct sig_cache_stats));
+	memset(st, 0, sizeof(struct sig_cache_stats));
+	lua_rawseti(L, -2, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, REG_SIG_CACHE);
+}
+
+/**
+ * return a table with the signature cache statistics
+ */
+int lsdbus_sig_cache_stats(lua_State *L)
+{
+	struct sig_cache_stats *st;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, REG_SIG_CACHE);
+	lua_rawgeti(L, -1, 1);
+	st = lua_touserdata(L, -1);
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, st->hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, st->misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, st->entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, st->flushes);
+	lua_setfield(L, -2, "flushes");
+	return 1;
+}
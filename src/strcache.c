@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include "lsdbus.h"
+
+/*
+ * String cache
+ *
+ * Signal heavy processes receive the same object paths, interface
+ * and member names and dictionary keys over and over again. Pushing
+ * them with lua_pushstring hashes (and for long strings allocates
+ * and copies) each one again. This cache maps the contents of a C
+ * string to a Lua string created before, so that a hit only costs
+ * hashing and comparing the C string.
+ *
+ * The cache is a 2-way set associative array of entries, replacing
+ * the least recently used entry of a set on a miss. The Lua strings
+ * are kept in the registry table REG_STR_CACHE at the index of their
+ * entry, which keeps the string (and thus the entry's pointer to its
+ * contents) alive until the entry is replaced. The entries and the
+ * stats are kept in a userdata stored at REG_STR_CACHE[0].
+ */
+
+#define STR_CACHE_MAXLEN	DBUS_NAME_MAXLEN	/* don't cache longer strings */
+#define STR_CACHE_DEFSIZE	256			/* default number of entries */
+#define STR_CACHE_MAXSIZE	65536
+
+struct str_cache_ent {
+	uint32_t hash;
+	uint32_t len;
+	const char *s;		/* contents of the cached Lua string */
+};
+
+struct str_cache_set {
+	struct str_cache_ent way[2];
+	unsigned mru;		/* index of the most recently used way */
+};
+
+struct lsdbus_str_cache {
+	lua_Integer hits;
+	lua_Integer misses;
+	unsigned entries;
+	unsigned nsets;		/* power of two, 0 if disabled */
+	struct str_cache_set sets[];
+};
+
+/* FNV-1a */
+static inline uint32_t str_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t) s[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/**
+ * str_cache_get - push the string cache table [-0, +1, -]
+ *
+ * @return the cache, which may be used with str_cache_push as long as
+ * the table is kept on the stack.
+ */
+struct lsdbus_str_cache *str_cache_get(lua_State *L)
+{
+	struct lsdbus_str_cache *c;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, REG_STR_CACHE);
+	lua_rawgeti(L, -1, 0);
+	c = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return c;
+}
+
+/**
+ * str_cache_push - push s via the cache [-0, +1, m]
+ *
+ * @param c cache returned by str_cache_get
+ * @param tabidx absolute stack index of the cache table
+ * @param s string to push. NULL pushes nil.
+ */
+void str_cache_push(lua_State *L, struct lsdbus_str_cache *c, int tabidx, const char *s)
+{
+	size_t len;
+	uint32_t h;
+	unsigned w;
+	struct str_cache_set *set;
+	struct str_cache_ent *e;
+
+	if (s == NULL) {
+		lua_pushnil(L);
+		return;
+	}
+
+	len = strlen(s);
+
+	if (c->nsets == 0 || len > STR_CACHE_MAXLEN) {
+		lua_pushlstring(L, s, len);
+		return;
+	}
+
+	h = str_hash(s, len);
+	set = &c->sets[h & (c->nsets - 1)];
+
+	for (w = 0; w < 2; w++) {
+		e = &set->way[w];
+		if (e->s && e->hash == h && e->len == len && memcmp(e->s, s, len) == 0) {
+			c->hits++;
+			set->mru = w;
+			lua_rawgeti(L, tabidx, (set - c->sets) * 2 + w + 1);
+			return;
+		}
+	}
+
+	/* miss: replace the least recently used way */
+	c->misses++;
+	w = !set->mru;
+	e = &set->way[w];
+
+	if (e->s == NULL)
+		c->entries++;
+
+	lua_pushlstring(L, s, len);
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, tabidx, (set - c->sets) * 2 + w + 1);
+
+	e->s = lua_tostring(L, -1);
+	e->hash = h;
+	e->len = len;
+	set->mru = w;
+}
+
+/* create a new empty cache table with nsets sets and store it in the registry */
+static void str_cache_create(lua_State *L, unsigned nsets)
+{
+	struct lsdbus_str_cache *c;
+	size_t sz = sizeof(struct lsdbus_str_cache) + nsets * sizeof(struct str_cache_set);
+
+	lua_createtable(L, nsets * 2, 1);
+	c = lua_newuserdata(L, sz);
+	memset(c, 0, sz);
+	c->nsets = nsets;
+	lua_rawseti(L, -2, 0);
+	lua_setfield(L, LUA_REGISTRYINDEX, REG_STR_CACHE);
+}
+
+/* create the REG_STR_CACHE table. This must be run during module init. */
+void init_reg_str_cache(lua_State *L)
+{
+	str_cache_create(L, STR_CACHE_DEFSIZE / 2);
+}
+
+/**
+ * lsdbus.str_cache_resize(size)
+ *
+ * drop the cache and create a new one with room for size strings
+ * (rounded up to a power of two). 0 disables the cache.
+ */
+int lsdbus_str_cache_resize(lua_State *L)
+{
+	unsigned nsets = 0;
+	lua_Integer size = luaL_checkinteger(L, 1);
+
+	luaL_argcheck(L, size >= 0 && size <= STR_CACHE_MAXSIZE, 1,
+		      "size out of range");
+
+	if (size > 0)
+		for (nsets = 1; nsets * 2 < size; nsets *= 2);
+
+	str_cache_create(L, nsets);
+	return 0;
+}
+
+/**
+ * return a table with the string cache statistics
+ */
+int lsdbus_str_cache_stats(lua_State *L)
+{
+	struct lsdbus_str_cache *c = str_cache_get(L);
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, c->hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, c->misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, c->entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, c->nsets * 2);
+	lua_setfield(L, -2, "size");
+	return 1;
+}
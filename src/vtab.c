@@ -80,34 +80,41 @@ void init_reg_vtab_user(lua_State *L)
 	lua_setfield(L, LUA_REGISTRYINDEX, REG_VTAB_USER_ARG);
 }
 
+/*
+ * dispatch data of a vtable member. The offset field of each vtable
+ * entry is set to the offset of its vtab_entry in the array of
+ * entries, which is the userdata passed to sd-bus. Therefore the
+ * handlers receive their vtab_entry as userdata and reach the Lua
+ * handler without any lookup by member name.
+ *
+ * The first entry (of the vtable start) holds the interface level
+ * data: the optional getall function, the interface name (in types)
+ * and the vtable itself.
+ */
+struct vtab_entry {
+	lua_State *L;
+	int ref;			/* method handler, property getter or getall */
+	int setref;			/* property setter */
+	int sigref;			/* compiled sig userdata */
+	const struct lsdbus_sig *sig;	/* method result or property type */
+	const char *types;		/* the same as string */
+	const sd_bus_vtable *vt;	/* first entry only */
+};
+
 static int prop_get_handler(sd_bus *bus,
 			    const char *path, const char *interface, const char *property,
 			    sd_bus_message *reply, void *userdata, sd_bus_error *ret_error)
 {
-	int ret, top;
-	const char *type;
-	lua_State *L = (lua_State *) userdata;
-	top = lua_gettop(L);
+	int ret;
+	struct vtab_entry *e = (struct vtab_entry*) userdata;
+	lua_State *L = e->L;
+	int top = lua_gettop(L);
 	sd_bus_slot *slot = sd_bus_get_current_slot(bus);
 
 	dbg("%s, %s, %s, slot: %p", path, interface, property, slot);
 
-	regtab_get(L, REG_SLOT_TABLE, slot);                    /* slottab */
-
-	lua_pushfstring(L, "p#%s", property);
-	ret = lua_rawget(L, -2);		                /* slottab, {type,get,set} */
-	assert(ret == LUA_TTABLE);
-
-	ret = lua_rawgeti(L, -1, 1);			        /* slottab, {type,get,set}, type */
-	assert(ret == LUA_TSTRING);
-
-	type = lua_tostring(L, -1);
-	lua_pop(L, 1);						/* slottab, {type,get,set} */
-
-	ret = lua_rawgeti(L, -1, 2);				/* slottab, {type,get,set}, get */
-	assert(ret  == LUA_TFUNCTION);
-
-	regtab_get(L, REG_VTAB_USER_ARG, slot);                 /* slottab, {type,get,set}, get, user-arg */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, e->ref);		/* get */
+	regtab_get(L, REG_VTAB_USER_ARG, slot);                 /* get, user-arg */
 
 	ret = lua_pcall(L, 1, 1, 0);
 
@@ -116,11 +123,11 @@ static int prop_get_handler(sd_bus *bus,
 		goto out;
 	}
 
-	ret = msg_fromlua(L, reply, type, -1);
+	ret = msg_fromlua_sig(L, reply, e->sig, -1, lsdbus_slot_msg_flags(L, bus, slot));
 
 	if(ret<0) {
 		fprintf(stderr, "property %s get: failed to convert result to %s: %s\n",
-			property, type, lua_tostring(L, -1));
+			property, e->types, lua_tostring(L, -1));
 		sd_bus_error_set(ret_error, SD_BUS_ERROR_FAILED, "invalid return value");
 	}
 	ret = 1;
@@ -140,28 +147,22 @@ static int prop_set_handler(sd_bus *bus,
 			    sd_bus_message *value, void *userdata, sd_bus_error *ret_error)
 {
 	int ret, nargs;
-	lua_State *L = (lua_State *) userdata;
+	struct vtab_entry *e = (struct vtab_entry*) userdata;
+	lua_State *L = e->L;
 	int top = lua_gettop(L);
 	sd_bus_slot *slot = sd_bus_get_current_slot(bus);
 	(void) path, (void) interface;
 
 	dbg("%s, %s, %s, slot: %p", path, interface, property, slot);
 
-	regtab_get(L, REG_SLOT_TABLE, slot);                    /* slottab */
-	lua_pushfstring(L, "p#%s", property);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, e->setref);		/* setter */
+	regtab_get(L, REG_VTAB_USER_ARG, slot);                 /* setter, user-arg */
 
-	ret = lua_rawget(L, -2);				/* slottab, {type,get,set} */
-	assert(ret == LUA_TTABLE);
-
-	ret = lua_rawgeti(L, -1, 3);				/* slottab, {type,get,set}, setter */
-	assert(ret == LUA_TFUNCTION);
-
-	regtab_get(L, REG_VTAB_USER_ARG, slot);                 /* slottab, {type,get,set}, setter, user-arg */
-
-	nargs = msg_tolua(L, value, 0);
+	nargs = msg_tolua(L, value, lsdbus_slot_msg_flags(L, bus, slot));
 
 	if(nargs<0) {
-		fprintf(stderr, "property %s set: failed to convert arg to Lua\n", property);
+		fprintf(stderr, "property %s set: failed to convert arg to Lua: %s\n",
+			property, lua_tostring(L, -1));
 		ret = sd_bus_error_set(ret_error, SD_BUS_ERROR_FAILED, "invalid arg");
 		goto out;
 	}
@@ -181,57 +182,31 @@ out:
 	return ret;
 }
 
-/**
- * lookup the REG_VTAB[slot] table t, push the the handler t[3] and
- * the user_vtable onto the stack. Assign the signature typestring
- * t[1] if it non-nil.
- */
-static void push_method(lua_State *L, sd_bus_slot *slot, const char* member, const char **result)
-{
-	int ret;
-	dbg("getting slottab with slot %p", slot);
-
-	regtab_get(L, REG_SLOT_TABLE, slot);                    /* slottab */
-	lua_pushfstring(L, "m#%s", member);			/* slottab, "m#member" */
-	ret = lua_rawget(L, -2);		                /* slottab, {sig,res,hdlr} */
-	assert(ret == LUA_TTABLE);
-
-	ret = lua_rawgeti(L, -1, 2);                            /* slottab, {sig,res,hdlr}, res-typestr */
-
-	if (ret==LUA_TSTRING)
-		*result = lua_tostring(L, -1);
-	else
-		*result = NULL;
-
-	lua_pop(L, 1);						/* slottab, {sig,res,hdrl} */
-
-	ret = lua_rawgeti(L, -1, 3);				/* slottab, {sig,res,hdlr}, handler */
-	assert(ret == LUA_TFUNCTION);
-
-	regtab_get(L, REG_VTAB_USER_ARG, slot);                 /* slottab, {type,get,set}, handler, user-arg */
-	/* remove slottab and memtab */
-	lua_remove(L, -3);
-	lua_remove(L, -3);					/* handler, {} */
-}
-
 static int method_handler(sd_bus_message *call, void *userdata, sd_bus_error *ret_error)
 {
 	int ret, nargs, top;
+	uint32_t flags;
 	sd_bus_message *reply = NULL;
-	const char *result;
 
-	lua_State *L = (lua_State *) userdata;
+	struct vtab_entry *e = (struct vtab_entry*) userdata;
+	lua_State *L = e->L;
 	top = lua_gettop(L);
 	sd_bus *b = sd_bus_message_get_bus(call);
 	sd_bus_slot *slot = sd_bus_get_current_slot(b);
-	const char *mem = sd_bus_message_get_member(call);
 
-	push_method(L, slot, mem, &result);
+	flags = lsdbus_slot_msg_flags(L, b, slot);
 
-	nargs = msg_tolua(L, call, 0);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, e->ref);		/* handler */
+	regtab_get(L, REG_VTAB_USER_ARG, slot);                 /* handler, user-arg */
+
+	if (flags & LSDBUS_MSG_LAZY)
+		nargs = lsdbus_msg_push(L, call, flags);
+	else
+		nargs = msg_tolua(L, call, flags);
 
 	if(nargs<0) {
-		fprintf(stderr, "method %s: failed to convert arg to Lua\n", mem);
+		fprintf(stderr, "method %s: failed to convert arg to Lua: %s\n",
+			sd_bus_message_get_member(call), lua_tostring(L, -1));
 		sd_bus_error_set(ret_error, SD_BUS_ERROR_FAILED, "invalid arg");
 		goto out;
         }
@@ -242,7 +217,13 @@ static int method_handler(sd_bus_message *call, void *userdata, sd_bus_error *re
 		return handle_error(L, "method",
 				    sd_bus_message_get_path(call),
 				    sd_bus_message_get_interface(call),
-				    mem, ret_error);
+				    sd_bus_message_get_member(call), ret_error);
+	}
+
+	/* the handler returned a deferred reply, which is sent later */
+	if (lua_gettop(L) == top+1 && luaL_testudata(L, top+1, REPLY_MT) != NULL) {
+		dbg("reply deferred");
+		goto out;
 	}
 
         if (!sd_bus_message_get_expect_reply(call)) {
@@ -253,17 +234,18 @@ static int method_handler(sd_bus_message *call, void *userdata, sd_bus_error *re
         ret = sd_bus_message_new_method_return(call, &reply);
 
         if (ret < 0) {
-		fprintf(stderr, "method %s: failed to create return message\n", mem);
+		fprintf(stderr, "method %s: failed to create return message\n",
+			sd_bus_message_get_member(call));
 		sd_bus_error_set(ret_error, SD_BUS_ERROR_FAILED, "failed to create return message");
 		goto out;
 	}
 
-	if (result != NULL) {
-		ret = msg_fromlua(L, reply, result, top+1);
+	if (e->sig != NULL) {
+		ret = msg_fromlua_sig(L, reply, e->sig, top+1, flags);
 
 		if(ret<0) {
 			fprintf(stderr, "method %s: failed to convert result to %s: %s\n",
-				mem, result, lua_tostring(L, -1));
+				sd_bus_message_get_member(call), e->types, lua_tostring(L, -1));
 			sd_bus_error_set(ret_error, SD_BUS_ERROR_INVALID_ARGS, "invalid return value");
 			goto out_unref;
 		}
@@ -272,7 +254,8 @@ static int method_handler(sd_bus_message *call, void *userdata, sd_bus_error *re
         ret = sd_bus_send(b, reply, NULL);
 
 	if(ret<0) {
-		fprintf(stderr, "method %s: sd_bus_send failed: %s\n", mem, strerror(-ret));
+		fprintf(stderr, "method %s: sd_bus_send failed: %s\n",
+			sd_bus_message_get_member(call), strerror(-ret));
 		sd_bus_error_set(ret_error, SD_BUS_ERROR_FAILED, "sending reply failed");
 		goto out_unref;
 	}
@@ -286,6 +269,166 @@ out:
 	return 1;
 }
 
+/*
+ * deferred method replies: instead of its results, a method handler
+ * can return the object created by bus:defer_reply(). The call is
+ * then answered later by reply:reply(...) or reply:error(name, msg),
+ * e.g. from the callback of an asynchronous call or an event source.
+ * It holds a reference to the call message and to the compiled
+ * result signature of the method.
+ */
+struct lsdbus_reply {
+	sd_bus_message *call;		/* NULL once answered */
+	const struct lsdbus_sig *sig;	/* method result or NULL */
+	int sigref;
+	uint32_t flags;
+};
+
+static void reply_release(lua_State *L, struct lsdbus_reply *r)
+{
+	r->call = sd_bus_message_unref(r->call);
+	luaL_unref(L, LUA_REGISTRYINDEX, r->sigref);
+	r->sigref = LUA_NOREF;
+	r->sig = NULL;
+}
+
+static struct lsdbus_reply *reply_check_pending(lua_State *L)
+{
+	struct lsdbus_reply *r = luaL_checkudata(L, 1, REPLY_MT);
+
+	if (r->call == NULL)
+		luaL_error(L, "reply already sent");
+
+	return r;
+}
+
+/**
+ * bus:defer_reply()
+ *
+ * create a deferred reply for the call of the current method
+ * handler, which must return it as its only result.
+ */
+int lsdbus_defer_reply(lua_State *L)
+{
+	struct vtab_entry *e;
+	struct lsdbus_reply *r;
+
+	sd_bus *b = lua_checksdbus(L, 1);
+	sd_bus_message *call = sd_bus_get_current_message(b);
+
+	if (call == NULL || sd_bus_get_current_handler(b) != method_handler)
+		return luaL_error(L, "defer_reply: not called from a method handler");
+
+	e = sd_bus_get_current_userdata(b);
+
+	r = lua_newuserdata(L, sizeof(struct lsdbus_reply));
+	r->call = sd_bus_message_ref(call);
+	r->sig = e->sig;
+	r->flags = lsdbus_slot_msg_flags(L, b, sd_bus_get_current_slot(b));
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, e->sigref);
+	r->sigref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	luaL_setmetatable(L, REPLY_MT);
+	return 1;
+}
+
+/* reply:reply(...) */
+static int reply_reply(lua_State *L)
+{
+	int ret;
+	sd_bus_message *reply = NULL;
+	struct lsdbus_reply *r = reply_check_pending(L);
+
+	if (!sd_bus_message_get_expect_reply(r->call))
+		goto out;
+
+	ret = sd_bus_message_new_method_return(r->call, &reply);
+
+	if (ret < 0)
+		return luaL_error(L, "reply: failed to create return message: %s", strerror(-ret));
+
+	if (r->sig != NULL && msg_fromlua_sig(L, reply, r->sig, 2, r->flags) < 0) {
+		sd_bus_message_unref(reply);
+		return luaL_error(L, "reply %s: failed to convert result: %s",
+				  sd_bus_message_get_member(r->call), lua_tostring(L, -1));
+	}
+
+	ret = sd_bus_send(NULL, reply, NULL);
+	sd_bus_message_unref(reply);
+
+	if (ret < 0)
+		return luaL_error(L, "reply %s: sd_bus_send failed: %s",
+				  sd_bus_message_get_member(r->call), strerror(-ret));
+out:
+	reply_release(L, r);
+	return 0;
+}
+
+/* reply:error(name, message) */
+static int reply_error(lua_State *L)
+{
+	int ret;
+	struct lsdbus_reply *r = reply_check_pending(L);
+	const char *name = luaL_checkstring(L, 2);
+	const char *message = luaL_optstring(L, 3, NULL);
+	sd_bus_error error = SD_BUS_ERROR_MAKE_CONST(name, message);
+
+	if (sd_bus_interface_name_is_valid(name) <= 0)
+		return luaL_error(L, "reply: invalid error name %s", name);
+
+	ret = sd_bus_reply_method_error(r->call, &error);
+
+	if (ret < 0)
+		return luaL_error(L, "reply %s: sending error failed: %s",
+				  sd_bus_message_get_member(r->call), strerror(-ret));
+
+	reply_release(L, r);
+	return 0;
+}
+
+static int reply_pending(lua_State *L)
+{
+	struct lsdbus_reply *r = luaL_checkudata(L, 1, REPLY_MT);
+	lua_pushboolean(L, r->call != NULL);
+	return 1;
+}
+
+static int reply_tostring(lua_State *L)
+{
+	struct lsdbus_reply *r = luaL_checkudata(L, 1, REPLY_MT);
+
+	if (r->call == NULL)
+		lua_pushfstring(L, "reply <%p> (sent)", r);
+	else
+		lua_pushfstring(L, "reply <%p> [%s] (pending)", r,
+				sd_bus_message_get_member(r->call));
+	return 1;
+}
+
+/* a reply that was never sent is answered with NoReply */
+static int reply_gc(lua_State *L)
+{
+	struct lsdbus_reply *r = luaL_checkudata(L, 1, REPLY_MT);
+
+	if (r->call == NULL)
+		return 0;
+
+	dbg("reply for %s dropped", sd_bus_message_get_member(r->call));
+	sd_bus_reply_method_errorf(r->call, SD_BUS_ERROR_NO_REPLY, "reply dropped");
+	reply_release(L, r);
+	return 0;
+}
+
+const luaL_Reg lsdbus_reply_m [] = {
+	{ "reply", reply_reply },
+	{ "error", reply_error },
+	{ "pending", reply_pending },
+	{ "__tostring", reply_tostring },
+	{ "__gc", reply_gc },
+	{ NULL, NULL }
+};
+
 #ifdef DEBUG
 static void vtable_dump(sd_bus_vtable *vt)
 {
@@ -318,12 +461,29 @@ static void vtable_dump(sd_bus_vtable *vt)
 }
 #endif
 
-static void vtable_free(sd_bus_vtable *vt)
+/* release the refs of the entries and free them */
+static void entries_free(struct vtab_entry *ents, size_t len)
 {
+	if (!ents)
+		return;
+
+	for (size_t i=0; i<len; i++) {
+		luaL_unref(ents[i].L, LUA_REGISTRYINDEX, ents[i].ref);
+		luaL_unref(ents[i].L, LUA_REGISTRYINDEX, ents[i].setref);
+		luaL_unref(ents[i].L, LUA_REGISTRYINDEX, ents[i].sigref);
+	}
+	free((char*)ents[0].types);
+	free(ents);
+}
+
+static void vtable_free(sd_bus_vtable *vt, struct vtab_entry *ents)
+{
+	int i;
+
 	if (!vt)
 		return;
 
-	for (int i=1; vt[i].type != _SD_BUS_VTABLE_END; i++) {
+	for (i=1; vt[i].type != _SD_BUS_VTABLE_END; i++) {
 		if (vt[i].type == _SD_BUS_VTABLE_METHOD) {
 			free((char*)vt[i].x.method.member);
 			free((char*)vt[i].x.method.signature);
@@ -339,22 +499,63 @@ static void vtable_free(sd_bus_vtable *vt)
 			free((char*)vt[i].x.property.signature);
 		}
 	}
+	entries_free(ents, i+1);
 	free(vt);
 }
 
-/* resize the given vtable to size i (excluding start and stop entries). */
-static void vtable_resize(lua_State *L, sd_bus_vtable **vtp, int i)
+/* resize the given vtable and its entries to size i (excluding start
+ * and stop entries). */
+static void vtable_resize(lua_State *L, sd_bus_vtable **vtp, struct vtab_entry **entsp, int i)
 {
 	sd_bus_vtable *vt = realloc(*vtp, sizeof(struct sd_bus_vtable) * (i+2));
 
 	if(!vt) {
-		vtable_free(*vtp);
+		vtable_free(*vtp, *entsp);
 		luaL_error(L, "vtable allocation failed");
 	}
 
+	*vtp = vt;
+
+	struct vtab_entry *ents = realloc(*entsp, sizeof(struct vtab_entry) * (i+2));
+
+	if(!ents) {
+		vtable_free(*vtp, *entsp);
+		luaL_error(L, "vtable allocation failed");
+	}
+
+	*entsp = ents;
+
 	vt[0] = (sd_bus_vtable)	SD_BUS_VTABLE_START(0);
+	if (i > 0)
+		memset(&vt[i], 0, sizeof(struct sd_bus_vtable));
 	vt[i+1] = (sd_bus_vtable) SD_BUS_VTABLE_END;
-	*vtp = vt;
+
+	for (int k=i; k<i+2; k++)
+		ents[k] = (struct vtab_entry) { lsdbus_main_thread(L), LUA_NOREF, LUA_NOREF, LUA_NOREF,
+						NULL, NULL, NULL };
+}
+
+/*
+ * compile the signature types for the entry e. Empty types are not
+ * compiled.
+ * @return: 0 if OK, -1 otherwise and an error message at the top of the stack
+ */
+static int entry_set_sig(lua_State *L, struct vtab_entry *e, const char *types, const char *member)
+{
+	e->types = types;
+
+	if (types[0] == '\0')
+		return 0;
+
+	e->sig = sig_getstr(L, types);
+
+	if (e->sig == NULL) {
+		lua_pushfstring(L, "%s: %s", member, lua_tostring(L, -1));
+		return -1;
+	}
+
+	e->sigref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 0;
 }
 
 /* like lua_getfield, but expects the value to be a string of which a
@@ -400,7 +601,7 @@ char* lua_getstrfield(lua_State *L, int index,
 	return res;
 }
 
-static int vtable_add_signal(lua_State *L, sd_bus_vtable *vt, int slotref)
+static int vtable_add_signal(lua_State *L, sd_bus_vtable *vt)
 {
 
 	char *sig=NULL, *names=NULL, *member = NULL;
@@ -421,15 +622,6 @@ static int vtable_add_signal(lua_State *L, sd_bus_vtable *vt, int slotref)
 
 	*vt = (sd_bus_vtable) SD_BUS_SIGNAL_WITH_NAMES(member, sig, names, 0);
 
-	/* populate slottab */
-	lua_rawgeti(L, LUA_REGISTRYINDEX, slotref); /* slottab @ 7 */
-
-	lua_pushfstring(L, "s#%s", member);	/* slottab key @8 */
-	lua_pushstring(L, sig);			/* ptab @9 */
-
-	lua_rawset(L, 7);                       /* slottab[p#member] = sig */
-	lua_pop(L, 1);                          /* pop slottab */
-
 	/* all ok */
 	lua_settop(L, top);
 	return 0;
@@ -441,16 +633,55 @@ fail:
 	return -1;
 }
 
+#define EMITS_CHANGED_ANNOTATION "org.freedesktop.DBus.Property.EmitsChangedSignal"
+
+/**
+ * get the vtable flags for the EmitsChangedSignal annotation of the
+ * property table at index 6.
+ * @return: 0 if OK, -1 otherwise and an error message at the top of the stack
+ */
+static int property_emits_flags(lua_State *L, const char *member, uint64_t *flags)
+{
+	const char *val;
+
+	*flags = SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE;
+
+	if (lua_getfield(L, 6, "annotations") != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	lua_getfield(L, -1, EMITS_CHANGED_ANNOTATION);
+	val = lua_tostring(L, -1);
+
+	if (val == NULL || !strcmp(val, "true"))
+		*flags = SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE;
+	else if (!strcmp(val, "invalidates"))
+		*flags = SD_BUS_VTABLE_PROPERTY_EMITS_INVALIDATION;
+	else if (!strcmp(val, "const"))
+		*flags = SD_BUS_VTABLE_PROPERTY_CONST;
+	else if (!strcmp(val, "false"))
+		*flags = 0;
+	else {
+		lua_pushfstring(L, "%s: invalid %s value %s", member, EMITS_CHANGED_ANNOTATION, val);
+		return -1;
+	}
+
+	lua_pop(L, 2);
+	return 0;
+}
+
 /**
  * populate a vtable entry from the property on the stack
  * expects property name at -2 and method arg table at -1
  * @return: 0 if OK, -1 otherwise and an error message at the top of the stack
  */
-static int vtable_add_property(lua_State *L, sd_bus_vtable *vt, int slotref)
+static int vtable_add_property(lua_State *L, sd_bus_vtable *vt, struct vtab_entry *e)
 {
 	int typ, top;
 	char *type=NULL, *member=NULL;
 	const char *access;
+	uint64_t emits;
 
 	sd_bus_property_get_t getter = NULL;
 	sd_bus_property_set_t setter = NULL;
@@ -482,15 +713,14 @@ static int vtable_add_property(lua_State *L, sd_bus_vtable *vt, int slotref)
 		goto fail;
 	}
 
-	type = lua_getstrfield(L, 6, "type", NULL, member);
-
-	lua_rawgeti(L, LUA_REGISTRYINDEX, slotref); /* slottab @ 7 */
+	if (property_emits_flags(L, member, &emits) < 0)
+		goto fail;
 
-	lua_pushfstring(L, "p#%s", member);	/* slottab key @8 */
-	lua_newtable(L);			/* ptab @9 */
+	if ((type = lua_getstrfield(L, 6, "type", NULL, member)) == NULL)
+		goto fail;
 
-	lua_pushstring(L, type);
-	lua_rawseti(L, -2, 1);                   /* ptab[1] = type */
+	if (entry_set_sig(L, e, type, member) < 0)
+		goto fail;
 
 	if(getter) {
 		typ = lua_getfield(L, 6, "get");
@@ -501,7 +731,7 @@ static int vtable_add_property(lua_State *L, sd_bus_vtable *vt, int slotref)
 			goto fail;
 		}
 
-		lua_rawseti(L, -2, 2);                   /* ptab[2] = get */
+		e->ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	}
 
 	if(setter) {
@@ -513,24 +743,18 @@ static int vtable_add_property(lua_State *L, sd_bus_vtable *vt, int slotref)
 			goto fail;
 		}
 
-		lua_rawseti(L, -2, 3);			/* ptab[3] = set */
+		e->setref = luaL_ref(L, LUA_REGISTRYINDEX);
 	}
 
 	dbg("adding property %s (%s)", member, access);
 
 	if(!setter) {
-		*vt = (sd_bus_vtable) SD_BUS_PROPERTY( member, type, getter, 0,
-						       SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE);
+		*vt = (sd_bus_vtable) SD_BUS_PROPERTY( member, type, getter, 0, emits);
 	} else {
 		*vt = (sd_bus_vtable) SD_BUS_WRITABLE_PROPERTY( member, type, getter, setter, 0,
-								SD_BUS_VTABLE_UNPRIVILEGED |
-								SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE);
+								SD_BUS_VTABLE_UNPRIVILEGED | emits);
 	}
 
-	/* populate slottab */
-	lua_rawset(L, 7);                           /* slottab[p#member] = ptab */
-	lua_pop(L, 1);                              /* pop slottab */
-
 	/* all ok */
 	lua_settop(L, top);
 	return 0;
@@ -545,7 +769,7 @@ fail:
  * expects method name at -2 and method arg table at -1
  * @return: 0 if OK, -1 otherwise and an error message at the top of the stack
  */
-static int vtable_add_method(lua_State *L, sd_bus_vtable *vt, int slotref)
+static int vtable_add_method(lua_State *L, sd_bus_vtable *vt, struct vtab_entry *e)
 {
 	int typ;
 	char *member=NULL, *sig=NULL, *res=NULL, *names=NULL;
@@ -566,19 +790,8 @@ static int vtable_add_method(lua_State *L, sd_bus_vtable *vt, int slotref)
 	if ((names = lua_getstrfield(L, 6, "names", NULL, member)) == NULL)
 		goto fail;
 
-	*vt = (sd_bus_vtable) SD_BUS_METHOD(member, sig, res, method_handler, SD_BUS_VTABLE_UNPRIVILEGED);
-	vt->x.method.names = names;
-
-	/* store information in slottab */
-	lua_rawgeti(L, LUA_REGISTRYINDEX, slotref); /* slottab @ 7 */
-	lua_pushfstring(L, "m#%s", member);         /* @ 8 */
-
-	lua_newtable(L);                            /* mtab @ 9 */
-	lua_pushstring(L, sig);                     /* sig @ 10  */
-	lua_rawseti(L, -2, 1);                      /* mtab[1] = sig */
-
-	lua_pushstring(L, res);
-	lua_rawseti(L, -2, 2);                      /* mtab[2] = res */
+	if (entry_set_sig(L, e, res, member) < 0)
+		goto fail;
 
 	typ = lua_getfield(L, 6, "handler");
 
@@ -589,9 +802,11 @@ static int vtable_add_method(lua_State *L, sd_bus_vtable *vt, int slotref)
 				member, lua_typename(L, typ));
 		goto fail;
 	}
-	lua_rawseti(L, -2, 3);                      /* mtab[3] = handler */
-	lua_rawset(L, 7);                           /* slottab[m#member] = mtab */
-	lua_pop(L, 1);                              /* pop slottab */
+
+	e->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	*vt = (sd_bus_vtable) SD_BUS_METHOD(member, sig, res, method_handler, SD_BUS_VTABLE_UNPRIVILEGED);
+	vt->x.method.names = names;
 
 	return 0;
 
@@ -603,30 +818,217 @@ fail:
 	return -1;
 }
 
-/* create and populate a vtable from the equivalent Lua table at the
- * index idx of the stack. */
-int lsdbus_add_object_vtable(lua_State *L)
+/**
+ * lookup the object of a fallback vtable: call the Lua find function
+ * stored in the slottab of slot with the path and interface. If it
+ * returns a value, this becomes the user-arg of the handlers of this
+ * path. It is anchored in the slottab until the next lookup.
+ * @return: 1 if found, 0 if not and < 0 on error
+ */
+static int fallback_lookup(lua_State *L, sd_bus_slot *slot, const char *path,
+			   const char *interface, sd_bus_error *ret_error)
 {
-	int ret, slotref;
-	sd_bus_slot *slot;
-	struct lsdbus_slot *s;
-	const char *interface, *path;
+	int ret;
+	int top = lua_gettop(L);
 
-	sd_bus *b = lua_checksdbus(L, 1);
-	path = luaL_checkpath (L, 2);
-	luaL_checktype (L, 3, LUA_TTABLE);
+	regtab_get(L, REG_SLOT_TABLE, slot);			/* slottab */
+	ret = lua_getfield(L, -1, "#find");			/* slottab, find */
+	assert(ret == LUA_TFUNCTION);
+
+	lua_pushstring(L, path);
+	lua_pushstring(L, interface);				/* slottab, find, path, intf */
+
+	ret = lua_pcall(L, 2, 1, 0);				/* slottab, obj */
+
+	if (ret != LUA_OK) {
+		ret = handle_error(L, "find", path, interface, "-", ret_error);
+		goto out;
+	}
+
+	if (!lua_toboolean(L, -1)) {
+		ret = 0;
+		goto out;
+	}
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -3, "#obj");
+	regtab_store(L, REG_VTAB_USER_ARG, slot, -1);
+
+	ret = 1;
+out:
+	lua_settop(L, top);
+	return ret;
+}
+
+/* find callback of fallback vtables */
+static int fallback_find(sd_bus *bus, const char *path, const char *interface,
+			 void *userdata, void **ret_found, sd_bus_error *ret_error)
+{
+	struct vtab_entry *ents = (struct vtab_entry*) userdata;
+	int ret = fallback_lookup(ents->L, sd_bus_get_current_slot(bus), path, interface, ret_error);
+
+	if (ret > 0)
+		*ret_found = ents;
+
+	return ret;
+}
+
+/*
+ * object callback of vtables with a getall function, its userdata is
+ * the vtable slot. A Properties.GetAll of the interface is answered
+ * with a single call of getall(user-arg), which returns a table with
+ * the property values. Readable properties missing in this table are
+ * read with their getter. All other messages are left to sd-bus.
+ */
+static int getall_handler(sd_bus_message *call, void *userdata, sd_bus_error *ret_error)
+{
+	int ret, vals, fallback;
+	uint32_t flags;
+	const char *path, *intf, *member;
+	sd_bus_message *reply = NULL;
+
+	sd_bus_slot *slot = (sd_bus_slot*) userdata;
+	struct vtab_entry *e, *ents = sd_bus_slot_get_userdata(slot);
+	const sd_bus_vtable *vt = ents->vt;
+	lua_State *L = ents->L;
+	int top = lua_gettop(L);
+	sd_bus *b = sd_bus_message_get_bus(call);
+
+	if (!sd_bus_message_is_method_call(call, "org.freedesktop.DBus.Properties", "GetAll"))
+		return 0;
+
+	ret = sd_bus_message_read(call, "s", &intf);
+	sd_bus_message_rewind(call, 1);
+
+	if (ret < 0 || strcmp(intf, ents->types))
+		return 0;
+
+	path = sd_bus_message_get_path(call);
+
+	regtab_get(L, REG_SLOT_TABLE, slot);
+	fallback = lua_getfield(L, -1, "#find") == LUA_TFUNCTION;
+	lua_settop(L, top);
+
+	if (fallback) {
+		ret = fallback_lookup(L, slot, path, intf, ret_error);
+		if (ret <= 0)
+			return ret;
+	}
+
+	flags = lsdbus_slot_msg_flags(L, b, slot);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ents->ref);		/* getall */
+	regtab_get(L, REG_VTAB_USER_ARG, slot);                 /* getall, user-arg */
+
+	ret = lua_pcall(L, 1, 1, 0);				/* values */
+
+	if (ret != LUA_OK) {
+		ret = handle_error(L, "getall", path, intf, "GetAll", ret_error);
+		goto out;
+	}
+
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		fprintf(stderr, "getall %s: expected table but got %s\n",
+			intf, luaL_typename(L, -1));
+		ret = sd_bus_error_set(ret_error, SD_BUS_ERROR_FAILED, "invalid return value");
+		goto out;
+	}
+
+	vals = lua_gettop(L);
+
+	if ((ret = sd_bus_message_new_method_return(call, &reply)) < 0)
+		goto out;
+
+	if ((ret = sd_bus_message_open_container(reply, 'a', "{sv}")) < 0)
+		goto out_unref;
+
+	for (int i=1; vt[i].type != _SD_BUS_VTABLE_END; i++) {
+		if ((vt[i].type != _SD_BUS_VTABLE_PROPERTY &&
+		     vt[i].type != _SD_BUS_VTABLE_WRITABLE_PROPERTY) ||
+		    vt[i].x.property.get == NULL)
+			continue;
+
+		e = &ents[i];
+		member = vt[i].x.property.member;
+
+		if (lua_getfield(L, vals, member) == LUA_TNIL) {
+			lua_pop(L, 1);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, e->ref);	/* get */
+			regtab_get(L, REG_VTAB_USER_ARG, slot);		/* get, user-arg */
+
+			if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+				ret = handle_error(L, "property get", path, intf, member, ret_error);
+				goto out_unref;
+			}
+		}
+
+		if ((ret = sd_bus_message_open_container(reply, 'e', "sv")) < 0 ||
+		    (ret = sd_bus_message_append(reply, "s", member)) < 0 ||
+		    (ret = sd_bus_message_open_container(reply, 'v', e->types)) < 0)
+			goto out_unref;
+
+		if (msg_fromlua_sig(L, reply, e->sig, -1, flags) < 0) {
+			fprintf(stderr, "getall %s: failed to convert %s to %s: %s\n",
+				intf, member, e->types, lua_tostring(L, -1));
+			ret = sd_bus_error_set(ret_error, SD_BUS_ERROR_FAILED, "invalid return value");
+			goto out_unref;
+		}
+
+		if ((ret = sd_bus_message_close_container(reply)) < 0 ||
+		    (ret = sd_bus_message_close_container(reply)) < 0)
+			goto out_unref;
+
+		lua_settop(L, vals);
+	}
+
+	if ((ret = sd_bus_message_close_container(reply)) < 0)
+		goto out_unref;
+
+	if ((ret = sd_bus_send(b, reply, NULL)) < 0)
+		goto out_unref;
+
+	ret = 1;
+
+out_unref:
+	sd_bus_message_unrefp(&reply);
+out:
+	lua_settop(L, top);
+	return ret;
+}
+
+/*
+ * register the getall handler for the vtable slot if its entries
+ * have a getall function. Otherwise *gslot is set to NULL.
+ */
+static int add_getall(sd_bus *b, sd_bus_slot **gslot, const char *path,
+		      sd_bus_slot *slot, struct vtab_entry *ents, int fallback)
+{
+	*gslot = NULL;
+
+	if (ents->ref == LUA_NOREF)
+		return 0;
+
+	if (fallback)
+		return sd_bus_add_fallback(b, gslot, path, getall_handler, slot);
+
+	return sd_bus_add_object(b, gslot, path, getall_handler, slot);
+}
+
+/*
+ * build a vtable and its entries from the Lua table at index 3 of the
+ * stack (top must be 3). Returns the vtable, the entries and the
+ * interface name, which is valid as long as the table at index 3, or
+ * NULL and an error message at the top of the stack.
+ */
+static sd_bus_vtable *vtable_build(lua_State *L, struct vtab_entry **entsp, const char **interface)
+{
+	int ret;
 
 	/* initialize vtable */
 	size_t vt_len = 0;
 	struct sd_bus_vtable *vt = NULL;
-	vtable_resize(L, &vt, vt_len);
-
-	/* eventually the data belonging to this vtable will be stored
-	 * in the REG_SLOT_TABLE. Until we get a slot ptr, we store it
-	 * under the a ref in the registry */
-
-	lua_newtable(L);
-	slotref = luaL_ref(L, LUA_REGISTRYINDEX);
+	struct vtab_entry *ents = NULL;
+	vtable_resize(L, &vt, &ents, vt_len);
 
 	/* methods */
 	ret = lua_getfield(L, 3, "methods");
@@ -645,8 +1047,8 @@ int lsdbus_add_object_vtable(lua_State *L)
 					lua_tostring(L, -2), lua_typename(L, ret));
 			goto fail;
 		}
-		vtable_resize(L, &vt, ++vt_len);
-		if (vtable_add_method(L, &vt[vt_len], slotref) != 0)
+		vtable_resize(L, &vt, &ents, ++vt_len);
+		if (vtable_add_method(L, &vt[vt_len], &ents[vt_len]) != 0)
 			goto fail;
 
 		lua_pop(L, 1); /* pop method table */
@@ -674,8 +1076,8 @@ do_props:
 			goto fail;
 		}
 
-		vtable_resize(L, &vt, ++vt_len);
-		if (vtable_add_property(L, &vt[vt_len], slotref) != 0)
+		vtable_resize(L, &vt, &ents, ++vt_len);
+		if (vtable_add_property(L, &vt[vt_len], &ents[vt_len]) != 0)
 			goto fail;
 		lua_pop(L, 1); /* pop property table */
 	}
@@ -703,8 +1105,8 @@ do_sigs:
 			goto fail;
 		}
 
-		vtable_resize(L, &vt, ++vt_len);
-		if (vtable_add_signal(L, &vt[vt_len], slotref) != 0)
+		vtable_resize(L, &vt, &ents, ++vt_len);
+		if (vtable_add_signal(L, &vt[vt_len]) != 0)
 			goto fail;
 		lua_pop(L, 1); /* pop signal table */
 	}
@@ -721,13 +1123,90 @@ reg_vtab:
 		goto fail;
 	}
 
-	interface = lua_tostring(L, -1);
+	*interface = lua_tostring(L, -1);
+
+	if (sd_bus_interface_name_is_valid(*interface) <= 0) {
+		lua_pushfstring(L, "invalid interface %s", *interface);
+		goto fail;
+	}
+
+	if ((ents->types = strdup(*interface)) == NULL) {
+		lua_pushfstring(L, "failed to allocate memory for interface %s", *interface);
+		goto fail;
+	}
+
+	lua_pop(L, 1); /* interface */
+
+	/* optional getall function */
+	ret = lua_getfield(L, 3, "getall");
 
-	if (sd_bus_interface_name_is_valid(interface) <= 0) {
-		lua_pushfstring(L, "invalid interface %s", interface);
+	if (ret == LUA_TFUNCTION) {
+		ents->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	} else if (ret != LUA_TNIL) {
+		lua_pushfstring(L, "getall: expected function but got %s", lua_typename(L, ret));
 		goto fail;
+	} else {
+		lua_pop(L, 1);
+	}
+
+	ents->vt = vt;
+
+	/* the handlers get the entry of their member as userdata */
+	for (size_t i=1; i<=vt_len; i++) {
+		if (vt[i].type == _SD_BUS_VTABLE_METHOD)
+			vt[i].x.method.offset = i * sizeof(struct vtab_entry);
+		else if (vt[i].type == _SD_BUS_VTABLE_PROPERTY ||
+			 vt[i].type == _SD_BUS_VTABLE_WRITABLE_PROPERTY)
+			vt[i].x.property.offset = i * sizeof(struct vtab_entry);
 	}
 
+	*entsp = ents;
+	return vt;
+
+fail:
+	vtable_free(vt, ents);
+	return NULL;
+}
+
+/* create and populate a vtable from the equivalent Lua table at
+ * index 3 of the stack. If fallback is set, register it as a
+ * fallback vtable with the find function at index 4. */
+static int add_vtable(lua_State *L, int fallback)
+{
+	int ret, slotref;
+	sd_bus_slot *slot, *gslot;
+	struct lsdbus_slot *s;
+	struct sd_bus_vtable *vt;
+	struct vtab_entry *ents;
+	const char *interface, *path;
+
+	sd_bus *b = lua_checksdbus(L, 1);
+	path = luaL_checkpath (L, 2);
+	luaL_checktype (L, 3, LUA_TTABLE);
+
+	if (fallback)
+		luaL_checktype (L, 4, LUA_TFUNCTION);
+
+	/* eventually the slottab will be stored in the REG_SLOT_TABLE.
+	 * Until we get a slot ptr, we store it under the a ref in the
+	 * registry. It holds the find function and the current object
+	 * of fallback vtables */
+
+	lua_newtable(L);
+
+	if (fallback) {
+		lua_pushvalue(L, 4);
+		lua_setfield(L, -2, "#find");
+	}
+
+	slotref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_settop(L, 3);
+
+	vt = vtable_build(L, &ents, &interface);
+
+	if (vt == NULL)
+		goto fail;
+
 #ifdef DEBUG
 	dbg("adding obj vtab: <%p> path: %s, intf: %s", vt, path, interface);
 	dbg("------- vtable_dump -------");
@@ -735,16 +1214,27 @@ reg_vtab:
 	dbg("------- vtable_dump end ------- ");
 #endif
 
-	ret = sd_bus_add_object_vtable(b, &slot, path, interface, vt, L);
+	if (fallback)
+		ret = sd_bus_add_fallback_vtable(b, &slot, path, interface, vt, fallback_find, ents);
+	else
+		ret = sd_bus_add_object_vtable(b, &slot, path, interface, vt, ents);
 
 	if (ret < 0) {
+		vtable_free(vt, ents);
 		lua_pushfstring(L, "failed to add vtable: %s", strerror(-ret));
 		goto fail;
 	}
 
 	dbg("sd_bus_add_object_vtable slot <%p>", slot);
 
-	lua_pop(L, 1); /* interface */
+	ret = add_getall(b, &gslot, path, slot, ents, fallback);
+
+	if (ret < 0) {
+		sd_bus_slot_unref(slot);
+		vtable_free(vt, ents);
+		lua_pushfstring(L, "failed to add getall handler: %s", strerror(-ret));
+		goto fail;
+	}
 
 	/* move the slottab from the registry to REG_SLOT_TABLE[slot] */
 	lua_rawgeti(L, LUA_REGISTRYINDEX, slotref);
@@ -752,17 +1242,326 @@ reg_vtab:
 	/* save user arg (to be passed to hooks) */
 	regtab_store(L, REG_VTAB_USER_ARG, slot, 3);
 
+	/* optional message flags for the handlers */
+	if (lua_getfield(L, 3, "msg_flags") == LUA_TNUMBER)
+		regtab_store(L, REG_SLOT_MSG_FLAGS, slot, -1);
+	else
+		regtab_clear(L, REG_SLOT_MSG_FLAGS, slot);
+	lua_pop(L, 1);
+
 	regtab_store(L, REG_SLOT_TABLE, slot, -1);
 	luaL_unref(L, LUA_REGISTRYINDEX, slotref);
 
 	s = __lsdbus_slot_push(L, slot, LSDBUS_SLOT_TYPE_VTAB);
 	s->vt = vt;
+	s->ents = ents;
+	s->getall = gslot;
 	return 1;
 fail:
-	vtable_free(vt);
+	luaL_unref(L, LUA_REGISTRYINDEX, slotref);
 	return lua_error(L);
 }
 
+/*
+ * lsdbus.vtable: a vtable compiled once by lsdbus.vtable(vtab_raw),
+ * which can be registered at any number of paths. All objects share
+ * the sd_bus_vtable and its entries. The slottab is the uservalue of
+ * the userdata and references it in turn. Since the slottab is stored
+ * in REG_SLOT_TABLE for each registered slot, the vtable lives as
+ * long as it is registered somewhere.
+ */
+struct lsdbus_vtable {
+	sd_bus_vtable *vt;
+	struct vtab_entry *ents;
+	char interface[];
+};
+
+/* lsdbus.vtable(vtab_raw) */
+int lsdbus_vtable_new(lua_State *L)
+{
+	const char *interface;
+	struct sd_bus_vtable *vt;
+	struct vtab_entry *ents;
+	struct lsdbus_vtable *cvt;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+
+	/* vtable_build expects the table at index 3 */
+	lua_pushnil(L);
+	lua_insert(L, 1);
+	lua_pushnil(L);
+	lua_insert(L, 1);
+
+	vt = vtable_build(L, &ents, &interface);
+
+	if (vt == NULL)
+		return lua_error(L);
+
+	cvt = lua_newuserdata(L, sizeof(struct lsdbus_vtable) + strlen(interface) + 1);
+	cvt->vt = vt;
+	cvt->ents = ents;
+	strcpy(cvt->interface, interface);
+	luaL_setmetatable(L, VTABLE_MT);			/* cvt @ 4 */
+
+	lua_newtable(L);					/* cvt, slottab */
+	lua_pushvalue(L, 4);
+	lua_setfield(L, -2, "#vtable");
+
+	if (lua_getfield(L, 3, "msg_flags") == LUA_TNUMBER)
+		lua_setfield(L, -2, "#msg_flags");
+	else
+		lua_pop(L, 1);
+
+	lua_setuservalue(L, 4);
+	return 1;
+}
+
+/* register the compiled vtable at index 3 at path with the user-arg
+ * at index 4 */
+static int add_compiled_vtable(lua_State *L, sd_bus *b, const char *path)
+{
+	int ret;
+	sd_bus_slot *slot, *gslot;
+	struct lsdbus_slot *s;
+	struct lsdbus_vtable *cvt = luaL_checkudata(L, 3, VTABLE_MT);
+
+	lua_settop(L, 4);
+
+	ret = sd_bus_add_object_vtable(b, &slot, path, cvt->interface, cvt->vt, cvt->ents);
+
+	if (ret < 0)
+		luaL_error(L, "failed to add vtable: %s", strerror(-ret));
+
+	ret = add_getall(b, &gslot, path, slot, cvt->ents, 0);
+
+	if (ret < 0) {
+		sd_bus_slot_unref(slot);
+		luaL_error(L, "failed to add getall handler: %s", strerror(-ret));
+	}
+
+	regtab_store(L, REG_VTAB_USER_ARG, slot, 4);
+
+	lua_getuservalue(L, 3);					/* slottab @ 5 */
+
+	if (lua_getfield(L, 5, "#msg_flags") == LUA_TNUMBER)
+		regtab_store(L, REG_SLOT_MSG_FLAGS, slot, -1);
+	else
+		regtab_clear(L, REG_SLOT_MSG_FLAGS, slot);
+	lua_pop(L, 1);
+
+	regtab_store(L, REG_SLOT_TABLE, slot, 5);
+
+	s = __lsdbus_slot_push(L, slot, LSDBUS_SLOT_TYPE_VTAB);
+	s->vt = NULL;	/* owned by cvt */
+	s->ents = NULL;
+	s->getall = gslot;
+	return 1;
+}
+
+static int vtable_tostring(lua_State *L)
+{
+	struct lsdbus_vtable *cvt = luaL_checkudata(L, 1, VTABLE_MT);
+	lua_pushfstring(L, "vtable <%p> [%s]", cvt, cvt->interface);
+	return 1;
+}
+
+static int vtable_gc(lua_State *L)
+{
+	struct lsdbus_vtable *cvt = luaL_checkudata(L, 1, VTABLE_MT);
+	vtable_free(cvt->vt, cvt->ents);
+	cvt->vt = NULL;
+	cvt->ents = NULL;
+	return 0;
+}
+
+const luaL_Reg lsdbus_vtable_m [] = {
+	{ "__tostring", vtable_tostring },
+	{ "__gc", vtable_gc },
+	{ NULL, NULL }
+};
+
+/**
+ * bus:add_object_vtable(path, vtab_raw)
+ * bus:add_object_vtable(path, vtable, user_arg)
+ *
+ * register a vtable from the raw Lua table, which is also passed as
+ * user-arg to the handlers, or a compiled vtable with the given
+ * user-arg.
+ */
+int lsdbus_add_object_vtable(lua_State *L)
+{
+	if (luaL_testudata(L, 3, VTABLE_MT) != NULL)
+		return add_compiled_vtable(L, lua_checksdbus(L, 1), luaL_checkpath(L, 2));
+
+	return add_vtable(L, 0);
+}
+
+/**
+ * bus:add_fallback_vtable(prefix, vtab_raw, find)
+ *
+ * add a vtable for all objects at and below prefix. For each access,
+ * find(path, interface) is called and must return the object to be
+ * passed to the handlers, or nil if path does not exist.
+ */
+int lsdbus_add_fallback_vtable(lua_State *L)
+{
+	return add_vtable(L, 1);
+}
+
+/* call the Lua node enumerator and return its paths as a strv */
+static int node_enumerator(sd_bus *bus, const char *prefix, void *userdata,
+			   char ***ret_nodes, sd_bus_error *ret_error)
+{
+	int ret;
+	size_t len;
+	char **nodes = NULL;
+	lua_State *L = (lua_State *) userdata;
+	int top = lua_gettop(L);
+	sd_bus_slot *slot = sd_bus_get_current_slot(bus);
+
+	regtab_get(L, REG_SLOT_TABLE, slot);			/* enumerator */
+	lua_pushstring(L, prefix);
+
+	ret = lua_pcall(L, 1, 1, 0);				/* paths */
+
+	if (ret != LUA_OK) {
+		ret = handle_error(L, "node enumerator", prefix, "-", "-", ret_error);
+		goto out;
+	}
+
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		fprintf(stderr, "node enumerator %s: expected table but got %s\n",
+			prefix, luaL_typename(L, -1));
+		ret = sd_bus_error_set(ret_error, SD_BUS_ERROR_FAILED, "invalid node enumerator result");
+		goto out;
+	}
+
+	len = lua_rawlen(L, -1);
+	nodes = calloc(len + 1, sizeof(char*));
+
+	if (nodes == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (size_t i=0; i<len; i++) {
+		lua_rawgeti(L, -1, i+1);
+		const char *path = lua_tostring(L, -1);
+
+		if (path == NULL || !sd_bus_object_path_is_valid(path)) {
+			fprintf(stderr, "node enumerator %s: invalid path at index %zu\n", prefix, i+1);
+			ret = sd_bus_error_set(ret_error, SD_BUS_ERROR_FAILED, "invalid node enumerator result");
+			goto out_free;
+		}
+
+		if ((nodes[i] = strdup(path)) == NULL) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+		lua_pop(L, 1);
+	}
+
+	*ret_nodes = nodes;
+	ret = 0;
+	goto out;
+
+out_free:
+	for (size_t i=0; nodes[i] != NULL; i++)
+		free(nodes[i]);
+	free(nodes);
+out:
+	lua_settop(L, top);
+	return ret;
+}
+
+/**
+ * bus:add_node_enumerator(prefix, callback)
+ *
+ * callback(prefix) must return a table with the paths of the child
+ * objects below prefix. Used for introspection and by the
+ * ObjectManager.
+ */
+int lsdbus_add_node_enumerator(lua_State *L)
+{
+	int ret;
+	sd_bus_slot *slot;
+	sd_bus *b = lua_checksdbus(L, 1);
+	const char *prefix = luaL_checkpath(L, 2);
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+
+	ret = sd_bus_add_node_enumerator(b, &slot, prefix, node_enumerator, lsdbus_main_thread(L));
+
+	if (ret < 0)
+		luaL_error(L, "add_node_enumerator failed: %s", strerror(-ret));
+
+	regtab_store(L, REG_SLOT_TABLE, slot, 3);
+	return lsdbus_slot_push(L, slot, LSDBUS_SLOT_TYPE_NODE_ENUM);
+}
+
+/**
+ * bus:add_object_manager(path)
+ *
+ * add an org.freedesktop.DBus.ObjectManager for the subtree of path
+ */
+int lsdbus_add_object_manager(lua_State *L)
+{
+	int ret;
+	sd_bus_slot *slot;
+	sd_bus *b = lua_checksdbus(L, 1);
+	const char *path = luaL_checkpath(L, 2);
+
+	ret = sd_bus_add_object_manager(b, &slot, path);
+
+	if (ret < 0)
+		luaL_error(L, "add_object_manager failed: %s", strerror(-ret));
+
+	return lsdbus_slot_push(L, slot, LSDBUS_SLOT_TYPE_OBJMGR);
+}
+
+/*
+ * emit InterfacesAdded or InterfacesRemoved for the interfaces at
+ * index 3 to top or for all interfaces of the object if none given.
+ */
+static int emit_interfaces(lua_State *L, int added)
+{
+	int ret;
+	int nintf = lua_gettop(L) - 2;
+	sd_bus *b = lua_checksdbus(L, 1);
+	const char *path = luaL_checkpath(L, 2);
+	const char* intfs[nintf+1];
+
+	for (int i=0; i<nintf; i++)
+		intfs[i] = luaL_checkintf(L, i+3);
+
+	intfs[nintf] = NULL;
+
+	if (nintf == 0)
+		ret = added ? sd_bus_emit_object_added(b, path) :
+			sd_bus_emit_object_removed(b, path);
+	else
+		ret = added ? sd_bus_emit_interfaces_added_strv(b, path, (char**) intfs) :
+			sd_bus_emit_interfaces_removed_strv(b, path, (char**) intfs);
+
+	if (ret < 0)
+		luaL_error(L, "emit_interfaces_%s failed: %s", added ? "added" : "removed",
+			   strerror(-ret));
+
+	return 0;
+}
+
+/* bus:emit_interfaces_added(path, intf...) */
+int lsdbus_emit_interfaces_added(lua_State *L)
+{
+	return emit_interfaces(L, 1);
+}
+
+/* bus:emit_interfaces_removed(path, intf...) */
+int lsdbus_emit_interfaces_removed(lua_State *L)
+{
+	return emit_interfaces(L, 0);
+}
+
 int lsdbus_emit_prop_changed(lua_State *L)
 {
 	int ret;
@@ -801,7 +1600,7 @@ int lsdbus_emit_signal(lua_State *L)
 		goto out;
 
 	if (sig) {
-		ret = msg_fromlua(L, message, sig, 6);
+		ret = msg_fromlua(L, message, sig, 6, 0);
 
 		if (ret < 0)
 			goto out;
@@ -925,14 +1724,24 @@ int lsdbus_slot_gc(lua_State *L)
 	switch(type) {
 	case LSDBUS_SLOT_TYPE_VTAB:
 	case LSDBUS_SLOT_TYPE_ASYNC:
+	case LSDBUS_SLOT_TYPE_OBJMGR:
+	case LSDBUS_SLOT_TYPE_NODE_ENUM:
 		regtab_clear(L,	REG_SLOT_TABLE, s->slot);
+		regtab_clear(L,	REG_SLOT_MSG_FLAGS, s->slot);
+
+		if (type == LSDBUS_SLOT_TYPE_VTAB) {
+			sd_bus_slot_unref(s->getall);
+			s->getall = NULL;
+		}
+
 		sd_bus_slot_unref(s->slot);
 
 		if (type == LSDBUS_SLOT_TYPE_VTAB)
-			vtable_free(s->vt);
+			vtable_free(s->vt, s->ents);
 
 		s->slot = NULL;
 		s->vt = NULL;
+		s->ents = NULL;
 		break;
 	case LSDBUS_SLOT_TYPE_MATCH:
 		int ret = sd_bus_slot_set_floating(s->slot, 1);
@@ -965,14 +1774,24 @@ int lsdbus_slot_unref(lua_State *L)
 	case LSDBUS_SLOT_TYPE_VTAB:
 	case LSDBUS_SLOT_TYPE_ASYNC:
 	case LSDBUS_SLOT_TYPE_MATCH:
+	case LSDBUS_SLOT_TYPE_OBJMGR:
+	case LSDBUS_SLOT_TYPE_NODE_ENUM:
 		regtab_clear(L,	REG_SLOT_TABLE, s->slot);
+		regtab_clear(L,	REG_SLOT_MSG_FLAGS, s->slot);
+
+		if (type == LSDBUS_SLOT_TYPE_VTAB) {
+			sd_bus_slot_unref(s->getall);
+			s->getall = NULL;
+		}
+
 		sd_bus_slot_unref(s->slot);
 
 		if (type == LSDBUS_SLOT_TYPE_VTAB)
-			vtable_free(s->vt);
+			vtable_free(s->vt, s->ents);
 
 		s->slot = NULL;
 		s->vt = NULL;
+		s->ents = NULL;
 		break;
 	default:
 		dbg("invalid slot type (flags 0x%x)", s->flags);
@@ -985,6 +1804,33 @@ int lsdbus_slot_unref(lua_State *L)
 	return 0;
 }
 
+/**
+ * slot:set_msg_flags(flags)
+ *
+ * set the LSDBUS_MSG_* flags for messages dispatched to this slot,
+ * overriding the bus defaults. nil restores the defaults.
+ */
+int lsdbus_slot_set_msg_flags(lua_State *L)
+{
+	struct lsdbus_slot *s = (struct lsdbus_slot*) luaL_checkudata(L, 1, SLOT_MT);
+
+	if (lua_isnoneornil(L, 2)) {
+		regtab_clear(L, REG_SLOT_MSG_FLAGS, s->slot);
+	} else {
+		luaL_checkinteger(L, 2);
+		regtab_store(L, REG_SLOT_MSG_FLAGS, s->slot, 2);
+	}
+	return 0;
+}
+
+/* slot:get_msg_flags(): return the msg flags set for this slot or nil */
+int lsdbus_slot_get_msg_flags(lua_State *L)
+{
+	struct lsdbus_slot *s = (struct lsdbus_slot*) luaL_checkudata(L, 1, SLOT_MT);
+	regtab_get(L, REG_SLOT_MSG_FLAGS, s->slot);
+	return 1;
+}
+
 const char* slot_flags_tostr(int32_t flags)
 {
 	uint8_t t = flags & LSDBUS_SLOT_TYPE_MASK;
@@ -993,6 +1839,8 @@ const char* slot_flags_tostr(int32_t flags)
 	case LSDBUS_SLOT_TYPE_VTAB: return "vtab";
 	case LSDBUS_SLOT_TYPE_MATCH: return "match";
 	case LSDBUS_SLOT_TYPE_ASYNC: return "async";
+	case LSDBUS_SLOT_TYPE_OBJMGR: return "objmgr";
+	case LSDBUS_SLOT_TYPE_NODE_ENUM: return "node_enum";
 	}
 	return "unknown";
 }
@@ -1007,6 +1855,8 @@ int lsdbus_slot_tostring(lua_State *L)
 
 const luaL_Reg lsdbus_slot_m [] = {
 	{ "unref", lsdbus_slot_unref },
+	{ "set_msg_flags", lsdbus_slot_set_msg_flags },
+	{ "get_msg_flags", lsdbus_slot_get_msg_flags },
 	{ "rawslot", lsdbus_rawslot },
 	{ "__tostring", lsdbus_slot_tostring },
 	{ "__gc", lsdbus_slot_gc },
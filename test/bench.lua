@@ -0,0 +1,339 @@
+#!/usr/bin/env lua
+--
+-- lsdbus micro benchmarks
+--
+-- usage: lua bench.lua [-b BUS] [-n NUM] [PATTERN]
+--
+-- Each benchmark runs NUM iterations (default: 10) and prints the
+-- mean and the minimum time per iteration. Only benchmarks whose name
+-- matches the optional Lua PATTERN are run.
+--
+
+local lsdb = require("lsdbus")
+
+local busname = 'default'
+local iter = 10
+local pattern
+
+local i = 1
+while i <= #arg do
+   if arg[i] == '-b' then busname = arg[i+1]; i = i + 1
+   elseif arg[i] == '-n' then iter = tonumber(arg[i+1]); i = i + 1
+   else pattern = arg[i] end
+   i = i + 1
+end
+
+local b = lsdb.open(busname)
+
+local function printf(fmt, ...) print(string.format(fmt, ...)) end
+
+local benchmarks = {}
+
+local function bench(name, setup, run)
+   benchmarks[#benchmarks+1] = { name=name, setup=setup, run=run }
+end
+
+local function gen_as(n)
+   local t = {}
+   for i=1,n do t[i] = "string" .. i end
+   return t
+end
+
+local function gen_asv(n)
+   local t = {}
+   for i=1,n do
+      if i % 2 == 0 then
+	 t["key" .. i] = { 's', "value" .. i }
+      else
+	 t["key" .. i] = { 'u', i }
+      end
+   end
+   return t
+end
+
+--
+-- message conversion
+--
+bench("testmsg as 100k", function() return gen_as(100000) end,
+      function(t) b:testmsg('as', t) end)
+
+bench("testmsg ao 100k (100 distinct)", function()
+	 local t = {}
+	 for i=1,100000 do
+	    t[i] = string.format("/org/freedesktop/NetworkManager/Devices/%d/Settings", i % 100)
+	 end
+	 return t
+      end,
+      function(t) b:testmsg('ao', t) end)
+
+bench("testmsg a{sv} 100k", function() return gen_asv(100000) end,
+      function(t) b:testmsg('a{sv}', t) end)
+
+bench("testmsg aa{sv} 10k x 10", function()
+	 local t = {}
+	 for i=1,10000 do t[i] = gen_asv(10) end
+	 return t
+      end,
+      function(t) b:testmsg('aa{sv}', t) end)
+
+bench("testmsg a(sxd) 100k", function()
+	 local t = {}
+	 for i=1,100000 do t[i] = { "row" .. i, i, i * 0.5 } end
+	 return t
+      end,
+      function(t) b:testmsg('a(sxd)', t) end)
+
+local function gen_bag(n)
+   local t = {}
+   for i=1,n do
+      t["key" .. i] = (i % 3 == 0) and "value" .. i or (i % 3 == 1) and i or { i, i * 0.5 }
+   end
+   return t
+end
+
+bench("tovariant a{sv} 100k", function() return gen_bag(100000) end,
+      function(t) b:testmsg('a{sv}', lsdb.tovariant2(t)) end)
+
+bench("testmsgf AUTO_VARIANT a{sv} 100k", function() return gen_bag(100000) end,
+      function(t) b:testmsgf(lsdb.MSG_AUTO_VARIANT, 'a{sv}', t) end)
+
+--
+-- signal dispatch: the callback only looks at the first argument
+--
+local function sig_bench(flags)
+   local path, intf, member = "/bench", "lsdbus.bench", "Sig"..flags
+   local nsig, payload = 1000, gen_asv(50)
+   local cnt = 0
+
+   local function cb(_, ...)
+      cnt = cnt + 1
+   end
+
+   local function cb_lazy(_, msg)
+      if msg:arg(1) == "x" then cnt = cnt + 1 end
+   end
+
+   return function()
+	 local slot = b:match_signal(nil, path, intf, member,
+				     flags == lsdb.MSG_LAZY and cb_lazy or cb)
+	 slot:set_msg_flags(flags)
+	 return slot
+      end,
+      function()
+	 cnt = 0
+	 for _=1,nsig do b:emit_signal(path, intf, member, "sa{sv}", "x", payload) end
+	 while cnt < nsig do b:run(1000) end
+      end
+end
+
+bench("signal a{sv} 1k", sig_bench(0))
+bench("signal a{sv} 1k lazy", sig_bench(lsdb.MSG_LAZY))
+
+--
+-- server object registration
+--
+local reg_intf = {
+   name="lsdbus.bench.reg",
+   methods={
+      Mul={
+	 { direction="in", name="x", type="u" },
+	 { direction="out", name="res", type="u" },
+	 handler=function(o, x) return o.id * x end
+      }
+   },
+   properties={
+      Id={ access="read", type="u", get=function(o) return o.id end },
+   },
+}
+
+local function reg_bench(intf)
+   return function() end,
+      function()
+	 local objs = {}
+	 for i=1,10000 do objs[i] = lsdb.server.new(b, "/bench/reg/"..i, intf) end
+	 for i=1,10000 do objs[i]:unref() end
+      end
+end
+
+bench("server.new 10k", reg_bench(reg_intf))
+bench("server.new 10k compiled", reg_bench(lsdb.server.compile(reg_intf)))
+
+--
+-- server side dispatch: GetAll of an object with 100 properties and
+-- method calls, served and called on the same connection. With bulk,
+-- the interface has a getall function.
+--
+local dispatch_name = "lsdbus.bench.dispatch"
+local have_name = false
+
+local function dispatch_bench(member, bulk, ts, ...)
+   local args = { n=select('#', ...), ... }
+   local path = "/bench/dispatch/" .. member .. (bulk and "/bulk" or "")
+
+   return function()
+	 local intf = { name="lsdbus.bench.dispatch", properties={}, methods={
+			   Echo={ { direction="in", name="x", type="u" },
+				  { direction="out", name="res", type="u" },
+				  handler=function(_, x) return x end } } }
+	 for i=1,100 do
+	    intf.properties["Prop"..i] = { access="read", type="u", get=function() return i end }
+	 end
+	 if bulk then
+	    local vals = {}
+	    for i=1,100 do vals["Prop"..i] = i end
+	    intf.getall = function() return vals end
+	 end
+	 if not have_name then b:request_name(dispatch_name); have_name = true end
+	 return lsdb.server.new(b, path, intf)
+      end,
+      function()
+	 local cnt, slots = 0, {}
+	 local function cb(_, res)
+	    assert(res ~= '__error__', "dispatch bench call failed")
+	    cnt = cnt + 1
+	 end
+	 -- 10 calls in flight at a time
+	 for i=1,100 do
+	    slots[i] = b:call_async(cb, dispatch_name, path, args[1], member, ts,
+				    table.unpack(args, 2, args.n))
+	    if i % 10 == 0 then
+	       while cnt < i do b:run(1000) end
+	    end
+	 end
+      end
+end
+
+bench("server GetAll 100 props x100",
+      dispatch_bench('GetAll', false, 's', 'org.freedesktop.DBus.Properties', 'lsdbus.bench.dispatch'))
+bench("server GetAll 100 props getall",
+      dispatch_bench('GetAll', true, 's', 'org.freedesktop.DBus.Properties', 'lsdbus.bench.dispatch'))
+bench("server Get x100",
+      dispatch_bench('Get', false, 'ss', 'org.freedesktop.DBus.Properties', 'lsdbus.bench.dispatch', 'Prop1'))
+bench("server call Echo x100",
+      dispatch_bench('Echo', false, 'u', 'lsdbus.bench.dispatch', 42))
+
+--
+-- method calls against the peer test server (peer-testserver.lua),
+-- only if it is running
+--
+local function name_has_owner(name)
+   local ok, res = b:call('org.freedesktop.DBus', '/org/freedesktop/DBus',
+			  'org.freedesktop.DBus', 'NameHasOwner', 's', name)
+   return ok and res
+end
+
+if name_has_owner('lsdbus.test') then
+   local srv, path, intf = 'lsdbus.test', '/1', 'lsdbus.test.testintf0'
+   local ncall = 1000
+
+   bench("call thunk 1k", function() end,
+	 function()
+	    for _=1,ncall do b:call(srv, path, intf, 'thunk') end
+	 end)
+
+   bench("call_many thunk 1k", function()
+	    local calls = {}
+	    for i=1,ncall do calls[i] = { srv, path, intf, 'thunk' } end
+	    return calls
+	 end,
+	 function(calls) b:call_many(calls) end)
+
+   bench("prepared call thunk 1k", function() return b:prepare(srv, path, intf, 'thunk') end,
+	 function(pc)
+	    for _=1,ncall do pc:call() end
+	 end)
+
+   bench("proxy.new 100", function() end,
+	 function()
+	    for _=1,100 do lsdb.proxy.new(b, srv, path, intf) end
+	 end)
+
+   bench("proxy.new 100 uncached", function() end,
+	 function()
+	    for _=1,100 do lsdb.proxy.new(b, srv, path, intf, { cache=false }) end
+	 end)
+
+   bench("proxy get Bar 1k", function() return lsdb.proxy.new(b, srv, path, intf) end,
+	 function(p)
+	    for _=1,ncall do local _ = p.Bar end
+	 end)
+
+   bench("proxy get Bar 1k mirrored",
+	 function() return lsdb.proxy.new(b, srv, path, intf, { mirror=true }) end,
+	 function(p)
+	    for _=1,ncall do local _ = p.Bar end
+	 end)
+
+   bench("common.introspect tree", function() end,
+	 function() require("lsdbus.common").introspect(b, srv) end)
+
+   bench("objtree.new (introspected)", function() end,
+	 function() lsdb.objtree.new(b, srv):close() end)
+
+   -- 1k objects below the ObjectManager at /managed
+   local function add_managed()
+      local ok, objs = b:call(srv, '/managed', 'org.freedesktop.DBus.ObjectManager',
+			      'GetManagedObjects')
+      local n = 0
+      for _ in pairs(ok and objs or {}) do n = n + 1 end
+      if n < 1000 then b:call(srv, path, intf, 'AddManaged', 'u', 1000 - n) end
+   end
+
+   bench("objtree.new 1k (managed)", add_managed,
+	 function() lsdb.objtree.new(b, srv, '/managed'):close() end)
+
+   bench("proxy call pow 1k", function() return lsdb.proxy.new(b, srv, path, intf) end,
+	 function(p)
+	    for i=1,ncall do p('pow', i) end
+	 end)
+
+   -- 10 calls in flight at a time, awaited in a task
+   bench("co await_all pow 1k", function() return lsdb.proxy.new(b, srv, path, intf) end,
+	 function(p)
+	    lsdb.co.run(b, function()
+			   for i=1,ncall,10 do
+			      local futs = {}
+			      for k=0,9 do futs[#futs+1] = p:async('pow', i + k) end
+			      lsdb.co.await_all(futs)
+			   end
+			end)
+	 end)
+
+   -- 1k tasks reading the same property at the same time
+   local function get_tasks(p)
+      lsdb.co.run(b, function()
+		     local tasks = {}
+		     for i=1,ncall do tasks[i] = lsdb.co.spawn(function() return p.Bar end) end
+		     for i=1,ncall do tasks[i]:join() end
+		  end)
+   end
+
+   bench("co get Bar 1k tasks", function() return lsdb.proxy.new(b, srv, path, intf) end, get_tasks)
+   bench("co get Bar 1k tasks coalesced",
+	 function() return lsdb.proxy.new(b, srv, path, intf, { coalesce={} }) end, get_tasks)
+
+   bench("proxy calltt concat 1k", function() return lsdb.proxy.new(b, srv, path, intf) end,
+	 function(p)
+	    for _=1,ncall do p:calltt('concat', { a="foo", b="bar" }) end
+	 end)
+end
+
+for _,bm in ipairs(benchmarks) do
+   if not pattern or bm.name:match(pattern) then
+      local arg = bm.setup()
+      bm.run(arg) -- warm up
+      collectgarbage()
+      collectgarbage()
+
+      local min, sum = math.huge, 0
+      for _=1,iter do
+	 local t0 = os.clock()
+	 bm.run(arg)
+	 local dt = os.clock() - t0
+	 sum = sum + dt
+	 if dt < min then min = dt end
+      end
+
+      printf("%-30s %10.2f ms (min %.2f ms)", bm.name, sum / iter * 1000, min * 1000)
+   end
+end
@@ -0,0 +1,71 @@
+local lu=require("luaunit")
+local lsdb = require("lsdbus")
+
+local testconf = debug.getregistry()['lsdbus.testconfig']
+
+local b = lsdb.open(testconf.bus)
+
+local TestBuffer = {}
+
+local function typ(x) return (getmetatable(x) or {}).__name end
+
+function TestBuffer:TestNew()
+   local buf = lsdb.buffer('d', 3)
+   lu.assert_equals(#buf, 3)
+   lu.assert_equals(buf:type(), 'd')
+   lu.assert_equals(buf:totable(), {0, 0, 0})
+   lu.assert_equals(typ(buf), "lsdbus.buffer")
+
+   buf[2] = 3.5
+   lu.assert_equals(buf[2], 3.5)
+   lu.assert_nil(buf[0])
+   lu.assert_nil(buf[4])
+
+   lu.assert_error_msg_contains("out of range", function() buf[4] = 1 end)
+   lu.assert_error_msg_contains("invalid buffer type", lsdb.buffer, 's', 1)
+   lu.assert_error_msg_contains("invalid buffer type", lsdb.buffer, 'ai', 1)
+   lu.assert_error_msg_contains("negative size", lsdb.buffer, 'd', -1)
+   lu.assert_error_msg_contains("size too large", lsdb.buffer, 'd', 2^61)
+   lu.assert_error_msg_contains("size too large", lsdb.buffer, 'q', math.maxinteger or 2^63)
+end
+
+function TestBuffer:TestFromTable()
+   local buf = lsdb.buffer('n', {-1, 2, -3})
+   lu.assert_equals(buf:totable(), {-1, 2, -3})
+   lu.assert_error_msg_contains("number expected", lsdb.buffer, 'i', {1, "x"})
+end
+
+function TestBuffer:TestSub()
+   local buf = lsdb.buffer('i', {1, 2, 3, 4, 5})
+   lu.assert_equals(buf:sub(2, 4):totable(), {2, 3, 4})
+   lu.assert_equals(buf:sub(-2):totable(), {4, 5})
+   lu.assert_equals(#buf:sub(4, 2), 0)
+   lu.assert_equals(buf:sub():totable(), {1, 2, 3, 4, 5})
+end
+
+function TestBuffer:TestToString()
+   lu.assert_str_contains(tostring(lsdb.buffer('x', 7)), "[x:7]")
+end
+
+function TestBuffer:TestMsg()
+   local t = {}
+   for i=1,1000 do t[i] = i * 1.5 end
+   local buf = lsdb.buffer('d', t)
+
+   -- buffers are accepted for arrays of the same type
+   lu.assert_equals(b:testmsg('ad', buf), t)
+   lu.assert_equals(b:testmsg('a(ad)', {{buf}}), {{t}})
+   lu.assert_error_msg_contains("not a table or matching buffer", b.testmsg, b, 'ai', buf)
+
+   -- and returned with MSG_BUFFER
+   b:set_msg_flags(lsdb.MSG_BUFFER)
+   local ok, res1, res2 = pcall(b.testmsg, b, 'adai', buf, {1, 2, 3})
+   b:set_msg_flags(0)
+   lu.assert_true(ok, res1)
+   lu.assert_equals(typ(res1), "lsdbus.buffer")
+   lu.assert_equals(res1:totable(), t)
+   lu.assert_equals(res2:type(), 'i')
+   lu.assert_equals(res2:totable(), {1, 2, 3})
+end
+
+return TestBuffer
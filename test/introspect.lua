@@ -20,8 +20,12 @@ local testnode = {
 	    Mogrify={{direction="in", name="bar", type="(iiav)"}}
 	 },
 
-	 properties={Bar={access="readwrite", type="y"}},
-	 signals={Changed={{name="new_value", type="b"}}}
+	 properties={
+	    Bar={access="readwrite", type="y",
+		 annotations={["org.freedesktop.DBus.Property.EmitsChangedSignal"]="invalidates"}}
+	 },
+	 signals={Changed={{name="new_value", type="b"}}},
+	 annotations={["org.freedesktop.DBus.Property.EmitsChangedSignal"]="const"}
       },
    },
    nodes = {
@@ -38,4 +42,27 @@ function TestIntrospect:TestReadXML()
    lu.assertEquals(node, testnode)
 end
 
+function TestIntrospect:TestIncompleteAnnotation()
+   local xml = [[
+<node>
+  <interface name="com.example.Foo">
+    <annotation value="true"/>
+    <annotation name="org.freedesktop.DBus.Deprecated"/>
+    <property name="Bar" type="i" access="read">
+      <annotation name="org.freedesktop.DBus.Property.EmitsChangedSignal"/>
+    </property>
+    <property name="Baz" type="i" access="read">
+      <annotation value="const"/>
+      <annotation name="org.freedesktop.DBus.Property.EmitsChangedSignal" value="false"/>
+    </property>
+  </interface>
+</node>]]
+   local node = lsdb.xml_fromstr(xml)
+   local intf = node.interfaces[1]
+   lu.assertNil(intf.annotations)
+   lu.assertNil(intf.properties.Bar.annotations)
+   lu.assertEquals(intf.properties.Baz.annotations,
+		   {["org.freedesktop.DBus.Property.EmitsChangedSignal"]="false"})
+end
+
 return TestIntrospect
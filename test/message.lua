@@ -48,6 +48,42 @@ function TestMsg:TestArrayHuge()
    lu.assert_equals(ret, args)
 end
 
+function TestMsg:TestDeepNesting()
+   local function nest(n)
+      local v = {'i', 7}
+      for _=1,n do v = {'v', v} end
+      return v
+   end
+
+   lu.assert_equals(b:testmsg("v", nest(100)), 7)
+   lu.assert_equals(b:testmsgr("v", nest(20)), nest(20))
+   lu.assert_error_msg_contains("container depth 128 exceeded", b.testmsg, b, "v", nest(200))
+
+   local typ, val = "i", 3
+   for _=1,32 do typ = "a"..typ; val = { val } end
+   lu.assert_equals(b:testmsg(typ, val), val)
+end
+
+function TestMsg:TestArrayFixedSize()
+   local ad, ab = {}, {}
+   for i=1,10000 do ad[i] = i / 3; ab[i] = i % 3 == 0 end
+   lu.assert_equals(b:testmsg("ad", ad), ad)
+   lu.assert_equals(b:testmsg("ab", ab), ab)
+   lu.assert_equals(b:testmsg("ay", {0, 1, 255}), {0, 1, 255})
+   lu.assert_equals(b:testmsg("an", {-32768, 0, 32767}), {-32768, 0, 32767})
+   lu.assert_equals(b:testmsg("aq", {0, 65535}), {0, 65535})
+   lu.assert_equals(b:testmsg("ax", {-2147483649, 2147483648}), {-2147483649, 2147483648})
+   lu.assert_equals(b:testmsg("au", {}), {})
+
+   -- tables with metamethods take the generic path
+   local prx = setmetatable({}, { __index = function(_, i) return i * 2 end,
+				  __len = function() return 3 end })
+   lu.assert_equals(b:testmsg("ai", prx), {2, 4, 6})
+
+   lu.assert_error_msg_contains("failed to convert ai[3] (integer expected, got string)",
+				b.testmsg, b, "ai", {1, 2, "three"})
+end
+
 function TestMsg:TestArrayOfArray()
    local args = { {1,2,3}, {4,5,6}, {6,7,8} }
    local ret = b:testmsg("aai", args)
@@ -240,6 +276,70 @@ function TestMsg:TestArrayWithVariantNested2()
    lu.assert_equals(b:testmsgr("a{sv}", vin), vin)
 end
 
+function TestMsg:TestColumnar()
+   local rows = { {"one", 1, 1.5, true}, {"two", 2, 2.5, false}, {"three", 3, 3.5, true} }
+
+   b:set_msg_flags(lsdb.MSG_COLUMNAR)
+   local ok, res = pcall(b.testmsg, b, "a(sxdb)", rows)
+   b:set_msg_flags(0)
+   lu.assert_true(ok, res)
+   lu.assert_equals(res, { {"one", "two", "three"}, {1, 2, 3}, {1.5, 2.5, 3.5}, {true, false, true} })
+
+   b:set_msg_flags(lsdb.MSG_COLUMNAR + lsdb.MSG_BUFFER)
+   ok, res = pcall(b.testmsg, b, "a(sxdb)", rows)
+   b:set_msg_flags(0)
+   lu.assert_true(ok, res)
+   lu.assert_equals(res[1], {"one", "two", "three"})
+   lu.assert_equals(res[2]:type(), 'x')
+   lu.assert_equals(res[2]:totable(), {1, 2, 3})
+   lu.assert_equals(res[3]:totable(), {1.5, 2.5, 3.5})
+   lu.assert_equals(res[4], {true, false, true})
+
+   -- nested containers and empty arrays
+   b:set_msg_flags(lsdb.MSG_COLUMNAR)
+   local ok2, res1, res2, res3 = pcall(b.testmsg, b, "a(s(ii)ai)a(su)i",
+				       {{"a", {1, 2}, {3}}, {"b", {4, 5}, {}}}, {}, 7)
+   b:set_msg_flags(0)
+   lu.assert_true(ok2, res1)
+   lu.assert_equals(res1, { {"a", "b"}, {{1, 2}, {4, 5}}, {{3}, {}} })
+   lu.assert_equals(res2, { {}, {} })
+   lu.assert_equals(res3, 7)
+end
+
+function TestMsg:TestSigCache()
+   local st0 = lsdb.sig_cache_stats()
+   b:testmsg("a(xsb)", {{1, "one", true}})
+   local st1 = lsdb.sig_cache_stats()
+   b:testmsg("a(xsb)", {{2, "two", false}})
+   local st2 = lsdb.sig_cache_stats()
+
+   lu.assert_equals(st1.misses, st0.misses + 1)
+   lu.assert_equals(st2.misses, st1.misses)
+   lu.assert_equals(st2.hits, st1.hits + 1)
+   lu.assert_true(st2.entries >= 1)
+end
+
+function TestMsg:TestStrCache()
+   local paths = {}
+   for i=1,100 do paths[i] = "/org/lsdbus/test/a/rather/long/object/path/" .. i % 4 end
+
+   lsdb.str_cache_resize(64)
+   local st0 = lsdb.str_cache_stats()
+   lu.assert_equals(st0, { hits=0, misses=0, entries=0, size=64 })
+
+   lu.assert_equals(b:testmsg("ao", paths), paths)
+   local st1 = lsdb.str_cache_stats()
+   lu.assert_equals(st1.misses, 4)
+   lu.assert_equals(st1.hits, 96)
+   lu.assert_equals(st1.entries, 4)
+
+   lsdb.str_cache_resize(0)
+   lu.assert_equals(b:testmsg("ao", paths), paths)
+   lu.assert_equals(lsdb.str_cache_stats(), { hits=0, misses=0, entries=0, size=0 })
+
+   lsdb.str_cache_resize(256)
+end
+
 -- TODO:
 --   - test huge data sets
 --
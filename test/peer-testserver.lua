@@ -12,6 +12,8 @@ local function dbg(format, ...)
    if DEBUG then print(string.format(format, ...)) end
 end
 
+local add_managed, remove_managed
+
 local S = {
    srv='lsdbus.test',
    path='/',
@@ -115,7 +117,35 @@ local interface = {
               end
               return creds.euid, creds.pid
           end,
-      }
+      },
+
+      revbytes={
+	 {direction="in", name="bytes", type="ay"},
+	 {direction="out", name="result", type="ay"},
+	 handler=function(_,bytes)
+	    local res = {}
+	    for i=#bytes,1,-1 do res[#res+1] = bytes[i] end
+	    return res
+	 end
+      },
+      AddManaged={
+	 {direction="in", name="n", type="u"},
+	 handler=function(_,n) add_managed(n) end
+      },
+      RemoveManaged={
+	 {direction="in", name="id", type="u"},
+	 handler=function(_,id) remove_managed(id) end
+      },
+      Delay={
+	 {direction="in", name="ms", type="u"},
+	 {direction="out", name="ms", type="u"},
+	 handler=function(vt, ms)
+	    local r = vt._bus:defer_reply()
+	    local ev
+	    ev = vt._bus:add_periodic(ms * 1000, 1000, function() ev:unref(); r:reply(ms) end)
+	    return r
+	 end
+      },
    },
    properties={
       Bar={
@@ -167,6 +197,15 @@ local interface = {
 	    vt:emitPropertiesChanged("DictOfIntVar")
 	 end
       },
+      Blob={
+	 access="readwrite",
+	 type="ay",
+	 get=function(vt) return vt.Blob or "blob\0\1\2" end,
+	 set=function(vt, val)
+	    vt.Blob = string.char(table.unpack(val))
+	    vt:emitPropertiesChanged("Blob")
+	 end
+      },
       Time={
 	 access="read",
 	 type="x",
@@ -198,6 +237,28 @@ local interface = {
 	 get=function() error("lsdbus.test.testintf0.BOOM|") end,
 	 set=function(_,_) error("|just a message")end
       },
+      Counter={
+	 access="read",
+	 type="u",
+	 annotations={ ['org.freedesktop.DBus.Property.EmitsChangedSignal']='false' },
+	 get=function(vt) vt.counter = (vt.counter or 0) + 1; return vt.counter end,
+      },
+      Version={
+	 access="read",
+	 type="s",
+	 annotations={ ['org.freedesktop.DBus.Property.EmitsChangedSignal']='const' },
+	 get=function() return "1.0" end,
+      },
+      Level={
+	 access="readwrite",
+	 type="i",
+	 annotations={ ['org.freedesktop.DBus.Property.EmitsChangedSignal']='invalidates' },
+	 get=function(vt) return vt.level or 0 end,
+	 set=function(vt, val)
+	    vt.level = val
+	    vt:emitPropertiesChanged("Level")
+	 end
+      },
    },
 
    signals = {
@@ -217,6 +278,52 @@ end
 local b
 local vt1, vt2, vt3
 
+-- objects below /managed are announced by an ObjectManager. Each
+-- object implements two interfaces, which are added in one
+-- InterfacesAdded signal.
+local managed_intf = {
+   name="lsdbus.test.managed",
+   properties={
+      Id={ access="read", type="u", get=function(vt) return vt.id end },
+      Name={
+	 access="readwrite",
+	 type="s",
+	 get=function(vt) return vt.nam or "" end,
+	 set=function(vt, val)
+	    vt.nam = val
+	    vt:emitPropertiesChanged("Name")
+	 end
+      },
+   },
+}
+
+local managed_intf2 = {
+   name="lsdbus.test.managed2",
+   methods={
+      Hello={
+	 {direction="out", name="res", type="s"},
+	 handler=function() return "hello" end
+      },
+   },
+}
+
+local managed, nmanaged = {}, 0
+
+function add_managed(n)
+   for _=1,n do
+      nmanaged = nmanaged + 1
+      local path = "/managed/" .. nmanaged
+      local o = lsdb.server.new(b, path, managed_intf)
+      o.id = nmanaged
+      managed[nmanaged] = { o, lsdb.server.new(b, path, managed_intf2) }
+   end
+end
+
+function remove_managed(id)
+   for _,o in ipairs(managed[id] or {}) do o:unref() end
+   managed[id] = nil
+end
+
 local function reload()
    local function filter_props(p, _)
       if p:match("Fail.*") then return false end
@@ -237,6 +344,7 @@ end
 
 b = lsdb.open(os.getenv('LSDBUS_BUS') or 'default')
 b:request_name(S.srv)
+lsdb.server.add_object_manager(b, "/managed")
 reload()
 
 b:add_signal(lsdb.SIGINT, function () b:exit_loop() end)
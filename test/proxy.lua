@@ -20,6 +20,10 @@ function TestProxy:setup()
    end
 end
 
+function TestProxy:teardown()
+   if b then lsdb.intfcache.detach(b) end
+end
+
 function TestProxy:TestPing()
    local ret, err
 
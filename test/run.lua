@@ -19,6 +19,7 @@ TestSig = require("testsig")
 TestServer = require("testserver")
 TestEvSrc = require("testevsrc")
 TestCredentials = require("testcredentials")
+TestBuffer = require("buffer")
 
 runner = lu.LuaUnit.new()
 
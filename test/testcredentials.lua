@@ -16,6 +16,7 @@ function TestCredentials:setup()
 end
 
 function TestCredentials:teardown()
+	if self.b then lsdb.intfcache.detach(self.b) end
 	self.b = nil
 end
 
@@ -12,13 +12,10 @@ local b = lsdb.open(testconf.bus)
 
 local TestEvSrc = {}
 
-function TestEvSrc:setUp()
+function TestEvSrc:TestNoLeak()
    if not have_socket or not have_unistd then
       lu.skip("no luaposix")
    end
-end
-
-function TestEvSrc:TestNoLeak()
 
    collectgarbage()
    local mem1 = collectgarbage('count')
@@ -40,4 +37,33 @@ function TestEvSrc:TestNoLeak()
    lu.assert_false(mem2>mem1, string.format("mem2 > mem1 (%s>%s)", mem2, mem1))
 end
 
+function TestEvSrc:TestDefer()
+   local cnt = 0
+   local evsrc = b:add_defer(function() cnt = cnt + 1 end, false)
+
+   b:run(1000)
+   lu.assert_equals(cnt, 0)
+
+   -- oneshot: dispatched once per enable
+   evsrc:set_enabled(lsdb.SD_EVENT_ONESHOT)
+   b:run(1000)
+   b:run(1000)
+   lu.assert_equals(cnt, 1)
+   lu.assert_equals(evsrc:get_enabled(), lsdb.SD_EVENT_OFF)
+
+   evsrc:set_enabled(lsdb.SD_EVENT_ONESHOT)
+   b:run(1000)
+   lu.assert_equals(cnt, 2)
+
+   evsrc:unref()
+end
+
+function TestEvSrc:TestPeriodicUnrefInCallback()
+   local cnt, evsrc = 0, nil
+   evsrc = b:add_periodic(1000, 100, function() cnt = cnt + 1; evsrc:unref() end)
+
+   for _=1,5 do b:run(20000) end
+   lu.assert_equals(cnt, 1)
+end
+
 return TestEvSrc
@@ -23,6 +23,10 @@ function TestServer:setup()
    p3 = proxy.new(b, 'lsdbus.test', '/3', 'lsdbus.test.testintf0')
 end
 
+function TestServer:teardown()
+   lsdb.intfcache.detach(b)
+end
+
 function TestServer:TestPing()
    local ret, err
 
@@ -89,7 +93,7 @@ function TestServer:TestCallAsync()
    -- changes!
    assert_call_async(p1, 'Fail', {},
 		     { "__error__", { "org.freedesktop.DBus.Error.Failed",
-				      "test/peer-testserver.lua:96: unexpectedly messed up!"}})
+				      "test/peer-testserver.lua:98: unexpectedly messed up!"}})
 end
 
 function TestServer:TestCallVariant()
@@ -125,6 +129,15 @@ function TestServer:TestCallt()
    lu.assert_equals(p1:calltt('twoout', nil), {x=333, y={a='one',b='two',c='three'}})
    lu.assert_equals(p1:calltt('concat', {a='foo', b='bar'}), {result='foobar'})
    lu.assert_equals(p1:calltt('getarray', {size=3}), {result={"1","2","3"}})
+
+   lu.assert_error_msg_contains("callt: argument b missing", p1.calltt, p1, 'concat', {a='foo'})
+   lu.assert_error_msg_contains("callt: no method nope", p1.calltt, p1, 'nope', {})
+
+   -- methods added to the interface table after construction
+   p1._intf.methods.pow2 = { {direction="in", name="x", type="i"},
+			     {direction="out", name="result", type="i"} }
+   lu.assert_error_msg_contains("UnknownMethod", p1.calltt, p1, 'pow2', {x=2})
+   p1._intf.methods.pow2 = nil
 end
 
 function TestServer:TestGetArray()
@@ -159,6 +172,275 @@ function TestServer:TestGetArray()
    test_getarray(p3)
 end
 
+function TestServer:TestByteString()
+   lu.assert_equals(p1('revbytes', {1, 2, 3}), {3, 2, 1})
+   lu.assert_equals(p1('revbytes', "abc"), {99, 98, 97})
+   lu.assert_equals(p1:callf(lsdb.MSG_AY_STRING, 'revbytes', "ab\0c"), "c\0ba")
+   lu.assert_equals(p1:callf(lsdb.MSG_AY_STRING, 'revbytes', ""), "")
+
+   local b2 = lsdb.open(testconf.bus)
+   b2:set_msg_flags(lsdb.MSG_AY_STRING)
+   lu.assert_equals(b2:get_msg_flags(), lsdb.MSG_AY_STRING)
+   local p = proxy.new(b2, 'lsdbus.test', '/2', 'lsdbus.test.testintf0')
+   lu.assert_equals(p.Blob, "blob\0\1\2")
+   p.Blob = "\255\0new"
+   lu.assert_equals(p.Blob, "\255\0new")
+   lu.assert_equals(p1.Blob, {98, 108, 111, 98, 0, 1, 2})
+   lsdb.intfcache.detach(b2)
+end
+
+function TestServer:TestCallLazy()
+   local msg = p1:callf(lsdb.MSG_LAZY, 'pow', 4)
+   lu.assert_equals(msg:signature(), "i")
+   lu.assert_equals(msg:arg(1), 16)
+
+   -- the lazy flag is ignored for plain calls
+   local b2 = lsdb.open(testconf.bus)
+   b2:set_msg_flags(lsdb.MSG_LAZY)
+   lu.assert_equals(proxy.new(b2, 'lsdbus.test', '/1', 'lsdbus.test.testintf0')('pow', 5), 25)
+   b2:set_msg_flags(0)
+   lsdb.intfcache.detach(b2)
+end
+
+function TestServer:TestPrepared()
+   local pow = b:prepare('lsdbus.test', '/1', 'lsdbus.test.testintf0', 'pow', 'i')
+   lu.assert_equals({pow:call(3)}, {true, 9})
+   lu.assert_equals({pow(-4)}, {true, 16})
+   lu.assert_equals({pow:callr(5)}, {true, 25})
+   lu.assert_str_contains(tostring(pow), "lsdbus.test.testintf0.pow(i)")
+
+   lu.assert_error_msg_contains("integer expected", pow.call, pow, "x")
+
+   local raise = b:prepare('lsdbus.test', '/1', 'lsdbus.test.testintf0', 'FailWithDBusError')
+   lu.assert_equals({raise:call()}, {false, {"lsdbus.test.BananaPeelSlip", "argh!"}})
+
+   local res
+   pow:call_async(function(_, ...) res = {...} end, 7)
+   for _=1,10 do
+      if res then break end
+      b:run(100*1000)
+   end
+   lu.assert_equals(res, {49})
+
+   lu.assert_error_msg_contains("invalid object path",
+				b.prepare, b, 'lsdbus.test', 'x', 'lsdbus.test.testintf0', 'pow')
+   lu.assert_error_msg_contains("invalid interface",
+				b.prepare, b, 'lsdbus.test', '/1', 'x', 'pow')
+   lu.assert_error_msg_contains("invalid array type string",
+				b.prepare, b, 'lsdbus.test', '/1', 'lsdbus.test.testintf0', 'pow', 'a')
+end
+
+function TestServer:TestIntfCache()
+   local ic = lsdb.intfcache
+
+   ic.invalidate(b)
+   local st0 = ic.stats(b)
+
+   local q1 = proxy.new(b, 'lsdbus.test', '/1', 'lsdbus.test.testintf0')
+   local q2 = proxy.new(b, 'lsdbus.test', '/2', 'lsdbus.test.testintf0')
+   local st = ic.stats(b)
+
+   lu.assert_equals(st.misses - st0.misses, 1)
+   lu.assert_equals(st.hits - st0.hits, 1)
+   lu.assert_equals(st.services, 1)
+   lu.assert_is_true(q1._intf == q2._intf)
+   lu.assert_equals(q2('pow', 3), 9)
+
+   -- opting out introspects each time
+   local q3 = proxy.new(b, 'lsdbus.test', '/3', 'lsdbus.test.testintf0', { cache=false })
+   lu.assert_is_false(q3._intf == q1._intf)
+   lu.assert_equals(ic.stats(b).misses, st.misses)
+
+   lu.assert_error_msg_contains("no such interface", proxy.new,
+				b, 'lsdbus.test', '/1', 'lsdbus.test.nointf')
+
+   -- a hit doesn't check the object, so calls fail instead
+   local q5 = proxy.new(b, 'lsdbus.test', '/nosuchobj', 'lsdbus.test.testintf0')
+   lu.assert_is_true(q5._intf == q1._intf)
+   lu.assert_error_msg_contains("org.freedesktop.DBus.Error.Unknown", q5, 'pow', 3)
+   lu.assert_error_msg_contains("UnknownObject", proxy.new,
+				b, 'lsdbus.test', '/nosuchobj', 'lsdbus.test.testintf0', { cache=false })
+
+   -- snapshot
+   local file = os.tmpname()
+   ic.save(b, file)
+   ic.invalidate(b)
+   lu.assert_equals(ic.stats(b).services, 0)
+   lu.assert_is_true(ic.load(b, file))
+   os.remove(file)
+
+   st = ic.stats(b)
+   local q4 = proxy.new(b, 'lsdbus.test', '/1', 'lsdbus.test.testintf0')
+   lu.assert_equals(ic.stats(b).misses, st.misses)
+   lu.assert_equals(q4._intf.methods.pow, q1._intf.methods.pow)
+   lu.assert_equals(q4('pow', 4), 16)
+
+   lu.assert_is_false(ic.load(b, "/nonexistent/lsdbus.snapshot"))
+
+   -- owners are invalidated by NameOwnerChanged
+   local b3 = lsdb.open(testconf.bus)
+   b3:request_name("lsdbus.test.intfcache")
+   lu.assert_is_string(ic.owner(b, "lsdbus.test.intfcache"))
+   b3:release_name("lsdbus.test.intfcache")
+
+   for _=1,20 do
+      if not ic.owner(b, "lsdbus.test.intfcache") then break end
+      b:run(10000)
+   end
+   lu.assert_is_false(ic.owner(b, "lsdbus.test.intfcache"))
+end
+
+function TestServer:TestPropMirror()
+   local pm = proxy.new(b, 'lsdbus.test', '/2', 'lsdbus.test.testintf0', { mirror=true })
+
+   local function run_until(pred)
+      for _=1,20 do
+	 if pred() then return end
+	 b:run(10000)
+      end
+      lu.fail("timeout waiting for PropertiesChanged")
+   end
+
+   lu.assert_equals(pm:mirror_stats(), { hits=0, misses=0, updates=0, invalidations=0 })
+   lu.assert_nil(p1:mirror_stats())
+
+   -- GetAll fails due to the Fail properties, so values are fetched
+   -- on the first read
+   local bar = pm.Bar
+   lu.assert_equals(pm.Bar, bar)
+   lu.assert_equals(pm.Version, "1.0")
+   lu.assert_equals(pm.Version, "1.0")
+   lu.assert_equals(pm:mirror_stats().hits, 2)
+   lu.assert_equals(pm:mirror_stats().misses, 2)
+
+   -- EmitsChangedSignal=false is never mirrored
+   local cnt = pm.Counter
+   lu.assert_equals(pm.Counter, cnt + 1)
+   lu.assert_equals(pm:mirror_stats().hits, 2)
+
+   -- updated by PropertiesChanged
+   p2.Bar = bar + 1
+   run_until(function() return pm:mirror_stats().updates > 0 end)
+   lu.assert_equals(pm.Bar, bar + 1)
+   lu.assert_equals(pm:mirror_stats().misses, 2)
+
+   -- setting invalidates locally
+   pm.Bar = bar + 2
+   lu.assert_equals(pm.Bar, bar + 2)
+   lu.assert_equals(pm:mirror_stats().misses, 3)
+
+   -- EmitsChangedSignal=invalidates: fetched again after invalidation
+   lu.assert_equals(pm.Level, 0)
+   p2.Level = 42
+   run_until(function() return pm:mirror_stats().invalidations > 0 end)
+   local misses = pm:mirror_stats().misses
+   lu.assert_equals(pm.Level, 42)
+   lu.assert_equals(pm.Level, 42)
+   lu.assert_equals(pm:mirror_stats().misses, misses + 1)
+
+   p2.Level = 0
+   pm:mirror_close()
+   lu.assert_nil(pm:mirror_stats())
+   lu.assert_equals(pm.Bar, bar + 2)
+   p2.Bar = bar
+end
+
+function TestServer:TestObjTree()
+   local intf = 'lsdbus.test.testintf0'
+   local changes = 0
+   local t = lsdb.objtree.new(b, 'lsdbus.test', '/',
+			      { changed=function() changes = changes + 1 end })
+
+   -- the test server has no ObjectManager
+   lu.assert_is_false(t.managed)
+   lu.assert_equals(#t._slots, 1)
+   lu.assert_equals(t:paths(intf), { "/1", "/2", "/3" })
+   lu.assert_equals(t:interfaces("/2"), { "lsdbus.test.testintf0",
+					   "org.freedesktop.DBus.Introspectable",
+					   "org.freedesktop.DBus.Peer",
+					   "org.freedesktop.DBus.Properties" })
+   lu.assert_equals(t:get("/1", intf, "Version"), "1.0")
+   lu.assert_is_number(t:get("/3", intf, "Bar"))
+   lu.assert_nil(t:get("/3", intf, "Fail"))
+   lu.assert_nil(t:get("/4", intf))
+
+   local function run_until(pred)
+      for _=1,20 do
+	 if pred() then return end
+	 b:run(10000)
+      end
+      lu.fail("timeout waiting for PropertiesChanged")
+   end
+
+   local bar = p3.Bar
+   p3.Bar = bar + 1
+   run_until(function() return t:get("/3", intf, "Bar") == bar + 1 end)
+   lu.assert_equals(changes, 1)
+
+   -- invalidated properties are fetched again
+   p3.Level = 7
+   run_until(function() return t:get("/3", intf, "Level") == 7 end)
+   lu.assert_equals(changes, 2)
+
+   p3.Level = 0
+   p3.Bar = bar
+   t:close()
+end
+
+function TestServer:TestObjMgr()
+   local mintf, mintf2 = 'lsdbus.test.managed', 'lsdbus.test.managed2'
+   local added, removed = {}, {}
+   local t = lsdb.objtree.new(b, 'lsdbus.test', '/managed',
+			      { added=function(_, path, intfs) added[#added+1] = { path, intfs } end,
+				removed=function(_, path, intfs) removed[#removed+1] = { path, intfs } end })
+
+   local function run_until(pred)
+      for _=1,20 do
+	 if pred() then return end
+	 b:run(10000)
+      end
+      lu.fail("timeout waiting for signal")
+   end
+
+   lu.assert_is_true(t.managed)
+   lu.assert_equals(t.calls, 1)
+   lu.assert_equals(#t._slots, 3)
+
+   local before = #t:paths(mintf)
+
+   -- both interfaces of an object are announced in one signal
+   p1('AddManaged', 3)
+   run_until(function() return #added == 3 end)
+   b:run(10000)
+   lu.assert_equals(#added, 3)
+   lu.assert_equals(#t:paths(mintf), before + 3)
+   lu.assert_equals(#t:paths(mintf2), before + 3)
+
+   local path = added[3][1]
+   lu.assert_not_nil(added[3][2][mintf2])
+   lu.assert_equals(t:get(path, mintf, "Name"), "")
+   lu.assert_equals(t:interfaces(path), { mintf, mintf2 })
+
+   local id = t:get(path, mintf, "Id")
+   local p = proxy.new(b, 'lsdbus.test', path, mintf)
+   p.Name = "foo"
+   run_until(function() return t:get(path, mintf, "Name") == "foo" end)
+
+   p1('RemoveManaged', id)
+   run_until(function() return #removed == 1 end)
+   lu.assert_equals(removed[1][1], path)
+   lu.assert_equals(removed[1][2], { mintf, mintf2 })
+   lu.assert_nil(t.objects[path])
+
+   -- a new tree sees the same objects
+   local t2 = lsdb.objtree.new(b, 'lsdbus.test', '/managed')
+   lu.assert_equals(t2:paths(), t:paths())
+   lu.assert_equals(t2.calls, 1)
+
+   t2:close()
+   t:close()
+end
+
 function TestServer:TestGetDict()
    local function test_getdict(p)
       local d, size
@@ -428,4 +710,254 @@ function TestServer:TestCallAV()
 
 end
 
+function TestServer:TestCallbackBus()
+   -- callbacks get the bus and its msg flags also if run in a coroutine
+   local res, tick
+   b:set_msg_flags(lsdb.MSG_RAW)
+
+   coroutine.wrap(function()
+	 local slot = b:call_async(function(...) res = { ... } end,
+				   P.srv, '/1', 'org.freedesktop.DBus.Properties', 'Get', 'ss', P.intf, 'Bar')
+	 local ev = b:add_periodic(10*1000, 1000, function(bus) tick = bus end)
+	 while not res or not tick do b:run(1000*1000) end
+	 ev:unref()
+	 slot:unref()
+   end)()
+
+   b:set_msg_flags(0)
+   lu.assert_is_true(rawequal(res[1], b))
+   lu.assert_is_true(rawequal(tick, b))
+   lu.assert_equals(res[2], { 'i', p1.Bar })
+end
+
+function TestServer:TestCo()
+   local co = lsdb.co
+
+   -- outside of tasks, calls block
+   lu.assert_equals({ co.call(b, P.srv, '/1', P.intf, 'pow', 'i', 3) }, { true, 9 })
+   lu.assert_nil(co.current())
+
+   -- three tasks with sequential calls run concurrently
+   local order = {}
+   local tasks = {}
+   for i,ms in ipairs{ 300, 200, 100 } do
+      tasks[i] = co.spawn(function()
+	    local res = p1:call('Delay', ms)
+	    order[#order+1] = res
+	    return p2('pow', res)
+      end)
+      lu.assert_is_false(tasks[i].done)
+   end
+
+   lu.assert_equals(tasks[1]:join(b), 90000)
+   lu.assert_equals(tasks[3]:join(b), 10000)
+   lu.assert_equals(order, { 100, 200, 300 })
+
+   -- many calls in flight within one task
+   local res = co.run(b, function()
+	 local futs = {}
+	 for i=1,50 do futs[i] = p1:async('Delay', 100 + i % 5) end
+	 futs[#futs+1] = co.async(b, P.srv, '/1', P.intf, 'FailWithDBusError')
+	 lu.assert_is_table(co.current())
+	 return co.await_all(futs)
+   end)
+
+   lu.assert_equals(#res, 51)
+   lu.assert_equals(res[7], { n=2, true, 102 })
+   lu.assert_equals(res[51][1], false)
+   lu.assert_equals(res[51][2][1], "lsdbus.test.BananaPeelSlip")
+
+   -- tasks can join tasks, errors are raised by join
+   lu.assert_error_msg_contains("lsdbus.test.BananaPeelSlip", co.run, b, function()
+	 local t = co.spawn(function() return p1('FailWithDBusError') end)
+	 return t:join()
+   end)
+
+   -- properties too
+   lu.assert_equals(co.run(b, function() return p1.Bar end), p1.Bar)
+end
+
+function TestServer:TestCallMany()
+   local calls = {
+      { P.srv, '/1', P.intf, 'Delay', 'u', 200 },
+      { P.srv, '/2', P.intf, 'pow', 'i', 7 },
+      { P.srv, '/1', P.intf, 'FailWithDBusError' },
+      { P.srv, '/3', P.intf, 'Delay', 'u', 10 },
+      { P.srv, '/1', P.intf, 'thunk' },
+   }
+
+   -- the results are in the order of the calls
+   local res = b:call_many(calls)
+   lu.assert_equals(res[1], { n=2, true, 200 })
+   lu.assert_equals(res[2], { n=2, true, 49 })
+   lu.assert_equals(res[3], { n=2, false, { "lsdbus.test.BananaPeelSlip", "argh!" } })
+   lu.assert_equals(res[4], { n=2, true, 10 })
+   lu.assert_equals(res[5], { n=1, true })
+
+   -- the calls are in flight concurrently
+   local t0 = os.time()
+   calls = {}
+   for i=1,100 do calls[i] = { P.srv, '/1', P.intf, 'Delay', 'u', 500 } end
+   res = b:call_many(calls)
+   lu.assert_equals(#res, 100)
+   lu.assert_equals(res[100], { n=2, true, 500 })
+   lu.assert_true(os.time() - t0 <= 2)
+
+   -- replies missing the deadline fail
+   res = b:call_many({ { P.srv, '/1', P.intf, 'Delay', 'u', 500 },
+		       { P.srv, '/1', P.intf, 'pow', 'i', 2 } }, 100*1000)
+   lu.assert_is_false(res[1][1])
+   lu.assert_equals(res[2], { n=2, true, 4 })
+
+   lu.assert_equals(b:call_many({}), {})
+   lu.assert_error_msg_contains("call 2: expected", b.call_many, b, { calls[1], { P.srv } })
+   lu.assert_error_msg_contains("integer expected", b.call_many, b, { { P.srv, '/1', P.intf, 'pow', 'i', "x" } })
+   lu.assert_error_msg_contains("must not be negative", b.call_many, b, {}, -1)
+
+   -- many args
+   local call = { P.srv, '/1', P.intf, 'pow', string.rep('i', 100) }
+   for i=1,100 do call[#call+1] = i end
+   res = b:call_many({ call })
+   lu.assert_equals(res[1][2][1], lsdb.error.INVALID_ARGS)
+end
+
+function TestServer:TestTimeout()
+   local err = lsdb.error
+   local slottab = debug.getregistry()['lsdbus.slot_table']
+
+   -- per call timeouts in us precede the destination
+   local ok, e = b:call(100*1000, P.srv, '/1', P.intf, 'Delay', 'u', 500)
+   lu.assert_is_false(ok)
+   lu.assert_equals(e[1], err.TIMEOUT)
+   lu.assert_equals({ b:callr(1000*1000, P.srv, '/1', P.intf, 'Delay', 'u', 10) }, { true, 10 })
+   lu.assert_error_msg_contains("must not be negative", b.call, b, -1, P.srv, '/1', P.intf, 'thunk')
+
+   local res
+   local slot = b:call_async(function(_, ...) res = { ... } end,
+			     100*1000, P.srv, '/1', P.intf, 'Delay', 'u', 500)
+   while not res do b:run(1000*1000) end
+   lu.assert_equals(res, { '__error__', { err.NO_REPLY, "Method call timed out" } })
+
+   -- the callback is released once the reply has been dispatched
+   lu.assert_nil(slottab[slot:rawslot()])
+
+   -- unref cancels a pending call
+   local called = false
+   slot = b:call_async(function() called = true end, P.srv, '/1', P.intf, 'Delay', 'u', 50)
+   local raw = slot:rawslot()
+   lu.assert_is_function(slottab[raw])
+   slot:unref()
+   lu.assert_nil(slottab[raw])
+   lu.assert_equals(b:call(P.srv, '/1', P.intf, 'Delay', 'u', 100), true)
+   lu.assert_is_false(called)
+
+   -- proxies and prepared calls
+   local p = proxy.new(b, P.srv, '/1', P.intf, { timeout=100*1000 })
+   lu.assert_error_msg_contains(err.TIMEOUT, p.call, p, 'Delay', 500)
+   lu.assert_equals(p('Delay', 10), 10)
+   lu.assert_equals(p.Bar, p1.Bar)
+
+   local pc = b:prepare(P.srv, '/1', P.intf, 'Delay', 'u', 100*1000)
+   lu.assert_equals(select(2, pc(500))[1], err.TIMEOUT)
+
+   -- futures of lsdbus.co
+   local co = lsdb.co
+   res = co.run(b, function()
+	 local f1 = co.async(b, 100*1000, P.srv, '/1', P.intf, 'Delay', 'u', 500)
+	 local f2 = p1:async('Delay', 500)
+	 lu.assert_is_true(f2:cancel())
+	 lu.assert_is_false(f2:cancel())
+	 return co.await_all({ f1, f2 })
+   end)
+   lu.assert_equals(res[1][2][1], err.NO_REPLY)
+   lu.assert_equals(res[2], { n=2, false, { err.NO_REPLY, "call cancelled" } })
+end
+
+function TestServer:TestCoalesce()
+   local co = lsdb.co
+   local err = lsdb.error
+   local p = proxy.new(b, P.srv, '/1', P.intf, { coalesce = { 'Delay' } })
+
+   lu.assert_nil(p1:coalesce_stats())
+   lu.assert_equals(p:coalesce_stats(), { issued=0, coalesced=0, cached=0 })
+
+   -- identical calls in flight share one call
+   local tasks = {}
+   for i=1,15 do
+      tasks[i] = co.spawn(function() return p:call('Delay', i <= 10 and 200 or 100) end)
+   end
+   for i=1,15 do lu.assert_equals(tasks[i]:join(b), i <= 10 and 200 or 100) end
+   lu.assert_equals(p:coalesce_stats(), { issued=2, coalesced=13, cached=0 })
+
+   -- so do property reads, other methods are not coalesced
+   local res = co.run(b, function()
+	 local futs = {}
+	 for i=1,5 do futs[i] = co.spawn(function() return p.Bar end) end
+	 for i=6,8 do futs[i] = co.spawn(function() return p('pow', 3) end) end
+	 for i=1,8 do futs[i] = futs[i]:join() end
+	 return futs
+   end)
+   lu.assert_equals(res[5], p1.Bar)
+   lu.assert_equals(res[8], 9)
+   lu.assert_equals(p:coalesce_stats(), { issued=3, coalesced=17, cached=0 })
+
+   -- without ttl, sequential calls are not cached
+   lu.assert_equals(p('Delay', 10), 10)
+   lu.assert_equals(p('Delay', 10), 10)
+   lu.assert_equals(p:coalesce_stats().issued, 5)
+
+   -- ttl cache for successful replies
+   local pc = proxy.new(b, P.srv, '/2', P.intf, { coalesce = { 'pow', 'FailWithDBusError' }, ttl = 100*1000 })
+   lu.assert_equals(pc('pow', 3), 9)
+   lu.assert_equals(pc('pow', 3), 9)
+   lu.assert_equals(pc('pow', 4), 16)
+   lu.assert_error_msg_contains("BananaPeelSlip", pc.call, pc, 'FailWithDBusError')
+   lu.assert_error_msg_contains("BananaPeelSlip", pc.call, pc, 'FailWithDBusError')
+   lu.assert_equals(pc:coalesce_stats(), { issued=4, coalesced=0, cached=1 })
+
+   local t0 = lsdb.now()
+   while lsdb.now() - t0 < 150*1000 do b:run(50*1000) end
+   lu.assert_equals(pc('pow', 3), 9)
+   lu.assert_equals(pc:coalesce_stats().issued, 5)
+
+   -- Set drops cached property values
+   local v = pc.Bar
+   lu.assert_equals(pc.Bar, v)
+   pc.Bar = v
+   lu.assert_equals(pc.Bar, v)
+   lu.assert_equals(pc:coalesce_stats(), { issued=7, coalesced=0, cached=2 })
+
+   -- groups can be used directly, calls with table args are not coalesced
+   local g = co.group()
+   local dly = b:prepare(P.srv, '/1', P.intf, 'Delay', 'u')
+   local f1, f2 = g:async_prepared(b, dly, 50), g:async_prepared(b, dly, 50)
+   local f3 = g:async(b, P.srv, '/1', P.intf, 'Delay', 'u', 50)
+   local f4 = g:async(b, P.srv, '/1', P.intf, 'twoin', 'ia{ss}', 1, { a="b" })
+   g:async(b, P.srv, '/1', P.intf, 'twoin', 'ia{ss}', 1, { a="b" })
+   lu.assert_equals(g:stats(), { issued=4, coalesced=1, cached=0 })
+
+   -- cancelling only detaches the caller from the shared call
+   lu.assert_is_true(f1:cancel())
+   lu.assert_equals(co.await_all({ f1, f2, f4 }),
+		    { { n=2, false, { err.NO_REPLY, "call cancelled" } }, { n=2, true, 50 }, { n=1, true } })
+
+   -- the shared call is cancelled once all callers have cancelled
+   f1, f2 = g:async_prepared(b, dly, 50), g:async_prepared(b, dly, 50)
+   f1:cancel()
+   f2:cancel()
+   lu.assert_equals(g:async_prepared(b, dly, 50):cancel(), true)
+   lu.assert_equals(g:stats(), { issued=6, coalesced=2, cached=0 })
+   lu.assert_equals({ co.await(f3) }, { true, 50 })
+
+   -- outside of tasks, coalescing proxies call synchronously, which
+   -- also works from callbacks of the event loop
+   local vals
+   local ev = b:add_periodic(10*1000, 1000, function()
+				if not vals then vals = { p('pow', 5), p.Bar, p('Delay', 20) } end
+			     end)
+   while not vals do b:run(1000*1000) end
+   ev:unref()
+   lu.assert_equals(vals, { 25, p1.Bar, 20 })
+end
+
 return TestServer
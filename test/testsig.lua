@@ -50,6 +50,44 @@ function TestSig:TestEmitMatchSignal()
    lu.assert_true(cb_ok)
 end
 
+function TestSig:TestEmitMatchLazy()
+   local intf = "lsdbus.test.testemit"
+   local path = "/testsig/emitmatchlazy"
+   local member = "TestEmitMatchLazy"
+
+   local msg
+
+   local function cb(_, m) msg = m end
+
+   local slot = b:match_signal(nil, path, intf, member, cb)
+   slot:set_msg_flags(lsdb.MSG_LAZY)
+   lu.assert_equals(slot:get_msg_flags(), lsdb.MSG_LAZY)
+   slots[#slots+1] = slot
+
+   b:emit_signal(path, intf, member, "ua{ss}s", 542, { x="three" }, "last")
+
+   for _=1,10 do
+      if msg then break end
+      b:run(1000)
+   end
+
+   lu.assert_equals(msg:path(), path)
+   lu.assert_equals(msg:interface(), intf)
+   lu.assert_equals(msg:member(), member)
+   lu.assert_equals(msg:signature(), "ua{ss}s")
+   lu.assert_nil(msg:error())
+
+   -- args can be read in any order and repeatedly
+   lu.assert_equals(msg:arg(3), "last")
+   lu.assert_equals(msg:arg(1), 542)
+   lu.assert_equals(msg:arg(2), { x="three" })
+   lu.assert_equals(msg:arg(1), 542)
+   lu.assert_nil(msg:arg(4))
+   lu.assert_equals({msg:args()}, {542, { x="three" }, "last"})
+   lu.assert_error_msg_contains("index must be >= 1", msg.arg, msg, 0)
+   lu.assert_str_contains(tostring(msg), intf.."."..member)
+end
+
 function TestSig:TestEmitMatch()
    local intf = "lsdbus.test.testemit"
    local path = "/testsig/emitmatch"
@@ -188,5 +188,368 @@ function TestVtab:TestVtabMemUsage()
    lu.assert_false(mem2>mem1, string.format("mem2 > mem1 (%s>%s)", mem2, mem1))
 end
 
+function TestVtab:TestLazyMethod()
+   local inmsg, reply
+   local intf = {
+      name="lsdbus.test.lazy",
+      msg_flags=lsdb.MSG_LAZY,
+      methods={
+	 Echo={
+	    { direction="in", name="s", type="s" },
+	    { direction="in", name="a", type="ai" },
+	    { direction="out", name="res", type="s" },
+	    handler=function(vt, msg)
+	       inmsg = msg
+	       return msg:arg(1)..#msg:arg(2)
+	    end
+	 }
+      }
+   }
+
+   b:request_name("lsdbus.test.lazy")
+   local vt = lsdb.server.new(b, "/lazy", intf)
+   lu.assert_equals(vt._slot:get_msg_flags(), lsdb.MSG_LAZY)
+
+   local slot = b:call_async(function(_, msg) reply = msg end,
+			     "lsdbus.test.lazy", "/lazy", "lsdbus.test.lazy", "Echo",
+			     "sai", "foo", {1,2,3})
+   slot:set_msg_flags(lsdb.MSG_LAZY)
+
+   for _=1,20 do
+      if reply then break end
+      b:run(10000)
+   end
+
+   lu.assert_equals(inmsg:path(), "/lazy")
+   lu.assert_equals(inmsg:interface(), "lsdbus.test.lazy")
+   lu.assert_equals(inmsg:member(), "Echo")
+   lu.assert_equals(inmsg:signature(), "sai")
+   lu.assert_equals(inmsg:destination(), "lsdbus.test.lazy")
+   lu.assert_is_string(inmsg:sender())
+   lu.assert_is_number(inmsg:serial())
+   lu.assert_equals(inmsg:arg(2), {1,2,3})
+   lu.assert_nil(inmsg:arg(3))
+   lu.assert_equals({inmsg:args()}, {"foo", {1,2,3}})
+
+   lu.assert_nil(reply:error())
+   lu.assert_equals(reply:signature(), "s")
+   lu.assert_equals(reply:arg(1), "foo3")
+
+   slot:set_msg_flags(nil)
+   lu.assert_nil(slot:get_msg_flags())
+
+   vt:unref()
+   b:release_name("lsdbus.test.lazy")
+end
+
+function TestVtab:TestFallback()
+   local srvname, intfname = "lsdbus.test.fallback", "lsdbus.test.fallback"
+   local objs, nfind = {}, 0
+
+   local intf = {
+      name=intfname,
+      methods={
+	 Mul={
+	    { direction="in", name="x", type="u" },
+	    { direction="out", name="res", type="u" },
+	    handler=function(o, x) return o.id * x end
+	 }
+      },
+      properties={
+	 Id={ access="read", type="u", get=function(o) return o.id end },
+      },
+   }
+
+   -- objects /fb/1 to /fb/200000 are created on first access
+   local function find(path)
+      nfind = nfind + 1
+      local id = tonumber(path:match("^/fb/(%d+)$"))
+      if not id or id < 1 or id > 200000 then return end
+      objs[id] = objs[id] or { id=id }
+      return objs[id]
+   end
+
+   local function enumerate(prefix)
+      lu.assert_equals(prefix, "/fb")
+      return { "/fb/1", "/fb/2", "/fb/3" }
+   end
+
+   local function call(path, intf, member, ts, ...)
+      local res
+      local slot = b:call_async(function(_, ...) res = { ... } end,
+				srvname, path, intf, member, ts, ...)
+      for _=1,20 do
+	 if res then break end
+	 b:run(10000)
+      end
+      slot:unref()
+      return res
+   end
+
+   b:request_name(srvname)
+   local fb = lsdb.server.fallback(b, "/fb", intf, find, enumerate)
+
+   lu.assert_equals(call("/fb/123456", "org.freedesktop.DBus.Properties", "Get", "ss",
+			 intfname, "Id"), { 123456 })
+   lu.assert_equals(call("/fb/7", intfname, "Mul", "u", 3), { 21 })
+   lu.assert_true(nfind >= 2)
+
+   local n = 0
+   for _ in pairs(objs) do n = n + 1 end
+   lu.assert_equals(n, 2)
+
+   local res = call("/fb/200001", intfname, "Mul", "u", 3)
+   lu.assert_equals(res[1], "__error__")
+   lu.assert_equals(res[2][1], "org.freedesktop.DBus.Error.UnknownObject")
+
+   local xml = call("/fb", "org.freedesktop.DBus.Introspectable", "Introspect")[1]
+   local node = lsdb.xml_fromstr(xml)
+   lu.assert_equals(node.nodes, { "1", "2", "3" })
+
+   fb:unref()
+   b:release_name(srvname)
+end
+
+function TestVtab:TestCompiledVtab()
+   local st = debug.getregistry()['lsdbus.slot_table']
+
+   -- objects created from a compiled interface share its vtable
+   local cintf = lsdb.server.compile(test_intf)
+   local vt1 = lsdb.server.new(b, "/compiled/1", cintf)
+   local vt2 = lsdb.server.new(b, "/compiled/2", cintf)
+   local slottab = st[vt1._slot:rawslot()]
+   lu.assert_is_table(slottab)
+   lu.assert_is_true(slottab == st[vt2._slot:rawslot()])
+   lu.assert_equals(vt1.name, "a.b.c")
+   lu.assert_is_true(vt1:get_interface() == test_intf)
+   lu.assert_error_msg_contains("errh must be passed", lsdb.server.new, b, "/compiled/3", cintf, print)
+
+   -- a modified interface is not picked up by a compiled one, but by
+   -- objects created from the interface table
+   local intf = { name="a.b.d", methods={ ick={ handler=function() end } } }
+   cintf = lsdb.server.compile(intf)
+   intf.methods.ack = { handler=function() end }
+   local vt3 = lsdb.server.new(b, "/compiled/3", cintf)
+   local vt4 = lsdb.server.new(b, "/compiled/4", intf)
+   lu.assert_nil(vt3.methods.ack)
+   lu.assert_not_nil(vt4.methods.ack)
+   lu.assert_is_false(st[vt4._slot:rawslot()] == st[vt3._slot:rawslot()])
+
+   vt1:unref()
+   vt2:unref()
+   vt3:unref()
+   vt4:unref()
+   lu.assert_nil(next(st))
+
+   -- plumbing: one compiled vtable with per-path user args
+   local srvname = "lsdbus.test.compiled"
+   local res
+   local cvt = lsdb.vtable({
+	 name=srvname,
+	 properties={
+	    Id={ access="read", type="u", get=function(o) return o.id end }
+	 }
+   })
+   lu.assert_str_contains(tostring(cvt), srvname)
+
+   b:request_name(srvname)
+   local slots = {}
+   local objs = { { id=1 }, { id=2 } }
+   for i,o in ipairs(objs) do slots[i] = b:add_object_vtable("/compiled/"..i, cvt, o) end
+   cvt = nil
+   collectgarbage()
+
+   local slot = b:call_async(function(_, ...) res = { ... } end, srvname, "/compiled/2",
+			     "org.freedesktop.DBus.Properties", "Get", "ss", srvname, "Id")
+   for _=1,20 do
+      if res then break end
+      b:run(10000)
+   end
+   lu.assert_equals(res, { 2 })
+
+   slot:unref()
+   for _,s in ipairs(slots) do s:unref() end
+   b:release_name(srvname)
+   lu.assert_nil(next(st))
+end
+
+function TestVtab:TestGetAll()
+   local srvname, intfname = "lsdbus.test.getall", "lsdbus.test.getall"
+   local ngetall, nget, fail = 0, 0, false
+
+   local function get(o) nget = nget + 1; return o.id end
+
+   local intf = {
+      name=intfname,
+      properties={
+	 Id={ access="read", type="u", get=get },
+	 Name={ access="readwrite", type="s", get=function(o) nget = nget + 1; return "n"..o.id end,
+		set=function() end },
+	 Extra={ access="read", type="as", get=function() nget = nget + 1; return { "x" } end },
+	 Secret={ access="write", type="s", set=function() end },
+      },
+      -- Extra is missing and read with its getter
+      getall=function(o)
+	 ngetall = ngetall + 1
+	 if fail then error("org.freedesktop.DBus.Error.Failed|getall failed") end
+	 return { Id=o.id, Name="n"..o.id }
+      end,
+   }
+
+   local function getall(path, name)
+      local res
+      local slot = b:call_async(function(_, ...) res = { ... } end, srvname, path,
+				"org.freedesktop.DBus.Properties", "GetAll", "s", name)
+      for _=1,20 do
+	 if res then break end
+	 b:run(10000)
+      end
+      slot:unref()
+      return res
+   end
+
+   b:request_name(srvname)
+
+   local o = lsdb.server.new(b, "/getall", intf)
+   o.id = 7
+   local o2 = lsdb.server.new(b, "/getall", test_intf)
+
+   lu.assert_equals(getall("/getall", intfname), { { Id=7, Name="n7", Extra={ "x" } } })
+   lu.assert_equals(ngetall, 1)
+   lu.assert_equals(nget, 1)
+
+   -- other interfaces of the object are not affected
+   lu.assert_equals(getall("/getall", "a.b.c"), { { Foo="Foo" } })
+   lu.assert_equals(ngetall, 1)
+
+   fail = true
+   local res = getall("/getall", intfname)
+   lu.assert_equals(res[1], "__error__")
+   lu.assert_equals(res[2], { "org.freedesktop.DBus.Error.Failed", "getall failed" })
+   fail = false
+
+   o:unref()
+   o2:unref()
+
+   -- fallback objects get the found object
+   local fb = lsdb.server.fallback(b, "/getallfb", intf,
+				   function(path) return { id=tonumber(path:match("(%d+)$")) } end)
+   lu.assert_equals(getall("/getallfb/42", intfname), { { Id=42, Name="n42", Extra={ "x" } } })
+   lu.assert_equals(ngetall, 3)
+   fb:unref()
+
+   b:release_name(srvname)
+   lu.assert_nil(next(debug.getregistry()['lsdbus.slot_table']))
+end
+
+function TestVtab:TestDeferredReply()
+   local srvname = "lsdbus.test.deferred"
+   local N = 200
+   local pending = {}
+
+   local intf = {
+      name=srvname,
+      methods={
+	 Square={
+	    { direction="in", name="x", type="u" },
+	    { direction="out", name="res", type="u" },
+	    handler=function(o, x)
+	       local r = o._bus:defer_reply()
+	       pending[#pending+1] = { r=r, x=x }
+	       return r
+	    end
+	 },
+	 Now={
+	    { direction="out", name="res", type="s" },
+	    handler=function() return "now" end
+	 },
+      },
+   }
+
+   lu.assert_error_msg_contains("not called from a method handler", b.defer_reply, b)
+
+   b:request_name(srvname)
+   local o = lsdb.server.new(b, "/deferred", intf)
+
+   local res, slots, nres = {}, {}, 0
+   for i=1,N do
+      slots[i] = b:call_async(function(_, ...) res[i] = { ... }; nres = nres + 1 end,
+			      srvname, "/deferred", srvname, "Square", "u", i)
+   end
+
+   -- all calls are in flight, while other calls are still answered
+   while #pending < N do b:run(10000) end
+   lu.assert_equals(nres, 0)
+   local now
+   local nslot = b:call_async(function(_, r) now = r end, srvname, "/deferred", srvname, "Now")
+   while not now do b:run(10000) end
+   lu.assert_equals(now, "now")
+   lu.assert_equals(nres, 0)
+   nslot:unref()
+
+   -- answer in reverse order, one with an error and one dropped
+   for i=N,3,-1 do
+      local p = pending[i]
+      lu.assert_is_true(p.r:pending())
+      p.r:reply(p.x * p.x)
+      lu.assert_is_false(p.r:pending())
+   end
+   lu.assert_error_msg_contains("reply already sent", pending[N].r.reply, pending[N].r, 1)
+
+   pending[2].r:error("lsdbus.test.Error", "no square")
+   pending[1] = nil
+   collectgarbage()
+
+   while nres < N do b:run(10000) end
+
+   for i=3,N do lu.assert_equals(res[i], { i * i }) end
+   lu.assert_equals(res[2], { "__error__", { "lsdbus.test.Error", "no square" } })
+   lu.assert_equals(res[1][1], "__error__")
+   lu.assert_equals(res[1][2][1], "org.freedesktop.DBus.Error.NoReply")
+
+   for _,s in ipairs(slots) do s:unref() end
+   o:unref()
+   b:release_name(srvname)
+end
+
+function TestVtab:TestCallManyInHandler()
+   local srvname = "lsdbus.test.callmany"
+   local dbus = { 'org.freedesktop.DBus', '/org/freedesktop/DBus', 'org.freedesktop.DBus' }
+   local function dcall(memb, ...) return { dbus[1], dbus[2], dbus[3], memb, ... } end
+
+   local intf = {
+      name=srvname,
+      methods={
+	 Batch={
+	    { direction="out", name="owned", type="b" },
+	    { direction="out", name="ok", type="b" },
+	    { direction="out", name="id", type="s" },
+	    handler=function(o)
+	       local res = o._bus:call_many({
+		     dcall('NameHasOwner', 's', srvname),
+		     dcall('GetNameOwner', 's', 'lsdbus.test.nosuchname'),
+		     dcall('GetId'),
+	       })
+	       return res[1][2], res[2][1], res[3][2]
+	    end
+	 },
+      },
+   }
+
+   b:request_name(srvname)
+   local o = lsdb.server.new(b, "/callmany", intf)
+
+   local res
+   local slot = b:call_async(function(_, ...) res = { ... } end, srvname, "/callmany", srvname, "Batch")
+   while not res do b:run(10000) end
+
+   lu.assert_equals(res[1], true)
+   lu.assert_equals(res[2], false)
+   lu.assert_equals(res[3], select(2, b:call(dbus[1], dbus[2], dbus[3], 'GetId')))
+
+   slot:unref()
+   o:unref()
+   b:release_name(srvname)
+end
 
 return TestVtab
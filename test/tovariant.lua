@@ -28,4 +28,32 @@ function TestToVariant.Test()
    end
 end
 
+function TestToVariant.TestEncoding()
+   lu.assertEquals(lsdb.tovariant{a=1,b={foo='hi'}},
+		   {"a{sv}", {a={"x",1}, b={"a{sv}", {foo={"s","hi"}}}}})
+   lu.assertEquals(lsdb.tovariant{1.5, true}, {"a{iv}", {{"d",1.5}, {"b",true}}})
+   lu.assertEquals(lsdb.tovariant2{[0]='zero'}, {[0]={"s","zero"}})
+   lu.assertErrorMsgContains("unsupported type function", lsdb.tovariant, print)
+end
+
+function TestToVariant.TestAutoVariant()
+   for _,c in pairs(cases) do
+      lu.assertEquals(b:testmsgf(lsdb.MSG_AUTO_VARIANT, 'v', c), c)
+   end
+
+   local t = { foo={1,2,3}, bar={a='yup', b=333 } }
+   lu.assertEquals(b:testmsgf(lsdb.MSG_AUTO_VARIANT, 'a{sv}', t), t)
+   lu.assertEquals(b:testmsgf(lsdb.MSG_AUTO_VARIANT, 'av', {1, "two", false}), {1, "two", false})
+
+   -- explicitly typed variants are kept
+   local ret = b:testmsgf(lsdb.MSG_AUTO_VARIANT + lsdb.MSG_RAW, 'a{sv}',
+			  { u=lsdb.variant('u', 7), x=7, v=lsdb.variant('v', {1}) })
+   lu.assertEquals(ret, { u={'u', 7}, x={'x', 7}, v={'v', {'a{iv}', {{'x', 1}}}} })
+
+   lu.assertErrorMsgContains("unsupported type function",
+			     b.testmsgf, b, lsdb.MSG_AUTO_VARIANT, 'v', print)
+   lu.assertErrorMsgContains("invalid key type table in variant a{sv}",
+			     b.testmsgf, b, lsdb.MSG_AUTO_VARIANT, 'v', { a=1, [{}]=2 })
+end
+
 return TestToVariant